@@ -9,6 +9,7 @@
 #include <linux/slab.h>
 #include <linux/jiffies.h>
 #include <linux/delay.h>
+#include <linux/dma-mapping.h>
 
 #include "blackhole.h"
 #include "pcie.h"
@@ -636,6 +637,10 @@ static bool blackhole_init_hardware(struct tenstorrent_device *tt_dev)
 	if (!send_arc_message(bh, &msg))
 		dev_warn(&tt_dev->pdev->dev, "Failed to set ARC watchdog timeout (this is normal for old FW)\n");
 
+	// A region spans at most 1 TiB.
+	if (identity_noc_window)
+		tenstorrent_identity_noc_window_init(tt_dev, min_t(u64, SZ_1T - 1, dma_get_mask(&pdev->dev)));
+
 	return true;
 }
 
@@ -16,6 +16,7 @@
 #include <linux/version.h>
 #include <linux/debugfs.h>
 #include <linux/proc_fs.h>
+#include <linux/poll.h>
 
 #include "chardev_private.h"
 #include "device.h"
@@ -36,6 +37,7 @@ static long tt_cdev_ioctl(struct file *, unsigned int, unsigned long);
 static int tt_cdev_mmap(struct file *, struct vm_area_struct *);
 static int tt_cdev_open(struct inode *, struct file *);
 static int tt_cdev_release(struct inode *, struct file *);
+static __poll_t tt_cdev_poll(struct file *, poll_table *);
 
 static struct file_operations chardev_fops = {
 	.owner = THIS_MODULE,
@@ -43,6 +45,10 @@ static struct file_operations chardev_fops = {
 	.mmap = tt_cdev_mmap,
 	.open = tt_cdev_open,
 	.release = tt_cdev_release,
+	.poll = tt_cdev_poll,
+#ifdef TENSTORRENT_DMA_BUF_PMD_MAPPINGS
+	.get_unmapped_area = thp_get_unmapped_area,	// PMD-align DMA buffer mappings
+#endif
 };
 
 int init_char_driver(unsigned int max_devices)
@@ -134,6 +140,7 @@ static long ioctl_get_device_info(struct chardev_private *priv,
 				  struct tenstorrent_get_device_info __user *arg)
 {
 	const struct pci_dev *pdev = priv->device->pdev;
+	int node = dev_to_node(&priv->device->pdev->dev);
 	u32 bytes_to_copy;
 
 	struct tenstorrent_get_device_info_in in;
@@ -150,8 +157,9 @@ static long ioctl_get_device_info(struct chardev_private *priv,
 	out.subsystem_vendor_id = pdev->subsystem_vendor;
 	out.subsystem_id = pdev->subsystem_device;
 	out.bus_dev_fn = PCI_DEVID(pdev->bus->number, pdev->devfn);
-	out.max_dma_buf_size_log2 = MAX_DMA_BUF_SIZE_LOG2;
+	out.max_dma_buf_size_log2 = tenstorrent_max_dma_buf_size_log2(priv->device);
 	out.pci_domain = pci_domain_nr(pdev->bus);
+	out.numa_node = node == NUMA_NO_NODE ? U16_MAX : node;
 
 	if (clear_user(&arg->out, in.output_size_bytes) != 0)
 		return -EFAULT;
@@ -221,10 +229,12 @@ static void tenstorrent_reset_reclaim_tlbs(struct tenstorrent_device *tt_dev)
 
 		mutex_lock(&priv->tlb_mutex);
 		for_each_set_bit(bitpos, priv->tlbs, TENSTORRENT_MAX_INBOUND_TLBS) {
-			tenstorrent_device_free_tlb(tt_dev, bitpos);
+			tenstorrent_device_free_tlb(tt_dev, &priv->tlb_quota, bitpos);
 			clear_bit(bitpos, priv->tlbs);
 		}
 		mutex_unlock(&priv->tlb_mutex);
+
+		tenstorrent_tlb_drop_reservations(tt_dev, &priv->tlb_quota);
 	}
 	mutex_unlock(&tt_dev->chardev_mutex);
 }
@@ -731,6 +741,59 @@ static long tt_cdev_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 			ret = ioctl_export_tlb_dmabuf(priv, (struct tenstorrent_export_tlb_dmabuf __user *)arg);
 			break;
 
+		case TENSTORRENT_IOCTL_SET_TLB_QUOTA:
+			ret = ioctl_set_tlb_quota(priv, (struct tenstorrent_set_tlb_quota __user *)arg);
+			break;
+
+		case TENSTORRENT_IOCTL_SYNC_DMA_BUF:
+			ret = ioctl_sync_dma_buf(priv, (struct tenstorrent_sync_dma_buf __user *)arg);
+			break;
+
+		case TENSTORRENT_IOCTL_EXPORT_DMA_BUF:
+			ret = ioctl_export_dma_buf(priv, (struct tenstorrent_export_dma_buf __user *)arg);
+			break;
+
+		case TENSTORRENT_IOCTL_LOOKUP_PINNING:
+			ret = ioctl_lookup_pinning(priv, (struct tenstorrent_lookup_pinning __user *)arg);
+			break;
+
+		case TENSTORRENT_IOCTL_PIN_PAGES_BATCH:
+			ret = ioctl_pin_pages_batch(priv, (struct tenstorrent_pin_pages_batch __user *)arg);
+			break;
+
+		case TENSTORRENT_IOCTL_PIN_PAGES_ASYNC:
+			ret = ioctl_pin_pages_async(priv, (struct tenstorrent_pin_pages_async __user *)arg);
+			break;
+
+		case TENSTORRENT_IOCTL_PIN_PAGES_COMPLETE:
+			ret = ioctl_pin_pages_complete(priv, (struct tenstorrent_pin_pages_complete __user *)arg);
+			break;
+
+		case TENSTORRENT_IOCTL_GET_PIN_SEGMENTS:
+			ret = ioctl_get_pin_segments(priv, (struct tenstorrent_get_pin_segments __user *)arg);
+			break;
+
+		case TENSTORRENT_IOCTL_IMPORT_DMA_BUF:
+			ret = ioctl_import_dma_buf(priv, (struct tenstorrent_import_dma_buf __user *)arg);
+			break;
+
+		case TENSTORRENT_IOCTL_RELEASE_DMA_BUF_IMPORT:
+			ret = ioctl_release_dma_buf_import(priv, (struct tenstorrent_release_dma_buf_import __user *)arg);
+			break;
+
+		case TENSTORRENT_IOCTL_PIN_MEMFD:
+			ret = ioctl_pin_memfd(priv, (struct tenstorrent_pin_memfd __user *)arg);
+			break;
+
+		case TENSTORRENT_IOCTL_UNPIN_MEMFD:
+			ret = ioctl_unpin_memfd(priv, (struct tenstorrent_unpin_memfd __user *)arg);
+			break;
+
+		case TENSTORRENT_IOCTL_RESERVE_OUTBOUND_IATU:
+			ret = ioctl_reserve_outbound_iatu(priv,
+							  (struct tenstorrent_reserve_outbound_iatu __user *)arg);
+			break;
+
 		default:
 			ret = -EINVAL;
 			break;
@@ -775,6 +838,16 @@ out:
 	return ret;
 }
 
+// Readable when a PIN_PAGES_ASYNC result is waiting for PIN_PAGES_COMPLETE.
+static __poll_t tt_cdev_poll(struct file *file, poll_table *wait)
+{
+	struct chardev_private *priv = file->private_data;
+
+	poll_wait(file, &priv->async_pin_wait, wait);
+
+	return tenstorrent_async_pin_completed(priv) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
 static struct tenstorrent_device *inode_to_tt_dev(struct inode *inode)
 {
 	return container_of(inode->i_cdev, struct tenstorrent_device, chardev);
@@ -834,6 +907,7 @@ static int tt_cdev_open(struct inode *inode, struct file *file)
 	struct chardev_private *private_data;
 	bool power_aware = file->f_flags & O_APPEND;
 	int ret;
+	int i;
 
 	private_data = kzalloc(sizeof(*private_data), GFP_KERNEL);
 	if (private_data == NULL)
@@ -841,9 +915,20 @@ static int tt_cdev_open(struct inode *inode, struct file *file)
 
 	mutex_init(&private_data->mutex);
 
-	hash_init(private_data->dmabufs);
-	INIT_LIST_HEAD(&private_data->pinnings);
+	xa_init_flags(&private_data->dmabufs, XA_FLAGS_ALLOC);
+	mutex_init(&private_data->dmabuf_mutex);
+	private_data->pinnings = RB_ROOT_CACHED;
+	tenstorrent_pin_cache_init(private_data);
+	for (i = 0; i < TENSTORRENT_MAX_OUTBOUND_IATU_REGIONS; ++i)
+		INIT_LIST_HEAD(&private_data->pinning_windows[i]);
+	INIT_LIST_HEAD(&private_data->noc_retired_pinnings);
+	range_alloc_node_init(&private_data->noc_reservation);
+	INIT_LIST_HEAD(&private_data->async_pins);
+	spin_lock_init(&private_data->async_pin_lock);
+	init_waitqueue_head(&private_data->async_pin_wait);
 	INIT_LIST_HEAD(&private_data->peer_mappings);
+	INIT_LIST_HEAD(&private_data->dmabuf_imports);
+	INIT_LIST_HEAD(&private_data->memfd_pins);
 	INIT_LIST_HEAD(&private_data->vma_list);
 	mutex_init(&private_data->vma_lock);
 	mutex_init(&private_data->tlb_mutex);
@@ -935,10 +1020,12 @@ static void tt_cdev_release_tlbs(struct chardev_private *priv)
 
 	mutex_lock(&priv->tlb_mutex);
 	for_each_set_bit(bitpos, priv->tlbs, TENSTORRENT_MAX_INBOUND_TLBS) {
-		tenstorrent_device_free_tlb(priv->device, bitpos);
+		tenstorrent_device_free_tlb(priv->device, &priv->tlb_quota, bitpos);
 		clear_bit(bitpos, priv->tlbs);
 	}
 	mutex_unlock(&priv->tlb_mutex);
+
+	tenstorrent_tlb_drop_reservations(priv->device, &priv->tlb_quota);
 }
 
 static void tt_cdev_release_power(struct chardev_private *priv)
@@ -974,6 +1061,9 @@ static int tt_cdev_release(struct inode *inode, struct file *file)
 	struct chardev_private *priv = file->private_data;
 	struct tenstorrent_device *tt_dev = priv->device;
 
+	// Before reset_rwsem, which async pins take.
+	tenstorrent_async_pin_cleanup(priv);
+
 	// Hold reset_rwsem (shared) across the body so the reset ioctl (which holds
 	// it exclusive) cannot interleave with the device-touching cleanup.
 	down_read(&tt_dev->reset_rwsem);
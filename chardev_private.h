@@ -9,8 +9,17 @@
 #include <linux/hashtable.h>
 #include <linux/sched.h>
 #include <linux/refcount.h>
+#include <linux/kref.h>
+#include <linux/scatterlist.h>
+#include <linux/xarray.h>
+#include <linux/workqueue.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
 
 #include "ioctl.h"
+#include "memory.h"
+#include "range_alloc.h"
+#include "tlb.h"
 
 struct file;
 struct tenstorrent_device;
@@ -39,14 +48,29 @@ struct tenstorrent_mmap_vma {
 	};
 };
 
-#define DMABUF_HASHTABLE_BITS 4
+enum dmabuf_backing {
+	DMABUF_COHERENT,	// dma_alloc_coherent, recycled through the device cache
+	DMABUF_POOL,		// carved from tenstorrent_device.dma_buf_pool
+	DMABUF_PAGES,		// pages from one NUMA node with a streaming mapping
+};
+
 struct dmabuf {
-	struct hlist_node hash_chain;
+	// One reference for the owning fd (dropped by FREE_DMA_BUF or close) and
+	// one for each VMA mapping the buffer. The memory is freed with the last.
+	struct kref kref;
+	struct tenstorrent_device *device;
 
-	void *ptr;	// kernel address for dma buffer
+	enum dmabuf_backing backing;
+	void *ptr;	// kernel address for dma buffer, NULL for DMABUF_PAGES
 	dma_addr_t phys;
 	u64 size;	// always a multiple of PAGE_SIZE
-	u8 index;
+
+	// DMABUF_PAGES only: size >> PAGE_SHIFT order-0 pages (kvcalloc) and
+	// their mapping (alloc_chained_sgt_for_pages).
+	struct page **pages;
+	struct sg_table dma_mapping;
+	bool pmd_mappable;	// userspace mappings are faulted in with PMD entries
+	u32 index;
 	int outbound_iatu_region;
 };
 
@@ -55,10 +79,51 @@ struct dmabuf {
 struct chardev_private {
 	struct tenstorrent_device *device;
 	struct mutex mutex;
-	DECLARE_HASHTABLE(dmabufs, DMABUF_HASHTABLE_BITS);	// keyed on by dmabuf.index, chained on struct dmabuf.hash_chain
-	struct list_head pinnings;	// struct pinned_page_range.list
+	struct xarray dmabufs;	// struct dmabuf, keyed by dmabuf.index
+
+	// Protects dmabufs against concurrent mmap and FREE_DMA_BUF. Additions
+	// and removals also hold mutex. The mmap path takes it with mmap_lock
+	// held, so never access userspace memory while holding it. Ordering:
+	// mutex -> dmabuf_mutex; mmap_lock -> dmabuf_mutex.
+	struct mutex dmabuf_mutex;
+	struct rb_root_cached pinnings;	// struct pinned_page_range, by virtual address
+	struct list_head pin_cache_lru;	// idle cached pinnings, most recently used first
+	u64 pin_cache_bytes;		// size of pin_cache_lru
+	struct work_struct pin_cache_work;	// releases stale idle pinnings
+
+	// RESERVE_OUTBOUND_IATU: whether it was made, and the NOC DMA address
+	// space reserved, a node in device->noc_dma_space that this fd's windows
+	// are placed in first, as noc_space. Protected by device->iatu_mutex.
+	bool iatu_reserved;
+	struct range_alloc_node noc_reservation;
+	struct range_alloc noc_space;
+
+	// Live PIN_PAGES pinnings by the outbound iATU region of their NOC
+	// window (pinned_page_range.window_link), so that a window's pinnings
+	// are found without walking all of them. Protected by mutex.
+	struct list_head pinning_windows[TENSTORRENT_MAX_OUTBOUND_IATU_REGIONS];
+
+	// Pinnings released by close or by undoing a pin whose pages a shared
+	// NOC window still covers; freed once the window shrinks past them.
+	// UNPIN_PAGES fails with EBUSY rather than leave one. Protected by mutex.
+	struct list_head noc_retired_pinnings;
+
+	// PIN_PAGES_ASYNC requests, oldest first, until PIN_PAGES_COMPLETE
+	// collects them. The list, counters and completion state are protected
+	// by async_pin_lock; async_pin_wait is woken as requests complete.
+	struct list_head async_pins;
+	spinlock_t async_pin_lock;
+	wait_queue_head_t async_pin_wait;
+	unsigned int async_pin_count;
+	u64 async_pin_last_ticket;
+
 	struct list_head peer_mappings; // struct peer_resource_mapping.list
 
+	struct list_head dmabuf_imports;	// struct dmabuf_import.list, protected by mutex
+	u32 dmabuf_import_last_handle;
+
+	struct list_head memfd_pins;	// struct memfd_pin_ref.list, protected by mutex
+
 	struct list_head vma_list;	// struct tenstorrent_mmap_vma.list
 	struct mutex vma_lock;		// Protects vma_list
 
@@ -78,6 +143,8 @@ struct chardev_private {
 	// also chardev_mutex -> tlb_mutex (reset reclaim).
 	struct mutex tlb_mutex;
 
+	struct tenstorrent_tlb_quota tlb_quota; // Protected by tenstorrent_device.tlb_quota_lock
+
 	struct tenstorrent_set_noc_cleanup noc_cleanup; // NOC write on release action
 	struct tenstorrent_power_state power_state; // Power state for this fd
 
@@ -17,10 +17,10 @@
 #include "ioctl.h"
 #include "memory.h"
 #include "telemetry.h"
-
-#define MAX_TLB_KINDS 4
+#include "tlb.h"
 
 struct tenstorrent_device_class;
+struct gen_pool;
 
 struct tenstorrent_device {
 	// dev owns the lifetime of this structure: dev.release (tt_dev_release)
@@ -46,6 +46,11 @@ struct tenstorrent_device {
 	bool dma_capable;
 	bool interrupt_enabled;
 
+	// Bumped by the IRQ handler, which ARC firmware raises when it posts a
+	// message response. ARC message waiters sleep on arc_irq_waitqueue.
+	atomic_t arc_irq_seq;
+	wait_queue_head_t arc_irq_waitqueue;
+
 	struct mutex chardev_mutex;
 	bool chardev_excl_held;	// An O_EXCL fd is currently open
 	wait_queue_head_t chardev_excl_waitqueue;
@@ -73,8 +78,21 @@ struct tenstorrent_device {
 	u32 tlb_counts[MAX_TLB_KINDS];	// Per-device TLB counts (may differ from dev_class defaults)
 	refcount_t tlb_refcount[TENSTORRENT_MAX_INBOUND_TLBS];
 
+	// Serializes claiming windows in tlbs and protects every fd's tlb_quota
+	// and tlb_reserve_outstanding: windows fds have reserved but not yet
+	// allocated, which are held back from all other fds.
+	spinlock_t tlb_quota_lock;
+	u32 tlb_reserve_outstanding[MAX_TLB_KINDS];
+
 	struct mutex iatu_mutex;
 	struct tenstorrent_outbound_iatu_region outbound_iatus[TENSTORRENT_MAX_OUTBOUND_IATU_REGIONS];
+	struct range_alloc noc_dma_space;	// [0, noc_dma_limit], protected by iatu_mutex
+	int identity_iatu_region;	// identity_noc_window's region, or -1; set once
+
+	// PIN_MEMFD pinnings, shared by every fd that pins the same range of a
+	// file. Ordering: chardev_private.mutex -> memfd_pin_mutex -> iatu_mutex.
+	struct mutex memfd_pin_mutex;
+	struct list_head memfd_pinnings;	// struct memfd_pinning.list
 
 	struct attribute **telemetry_attrs;
 	struct attribute_group telemetry_group;
@@ -86,9 +104,23 @@ struct tenstorrent_device {
 
 	struct list_head dmabuf_exports;
 	struct mutex dmabuf_export_lock;
-};
 
-struct tlb_descriptor;
+	// Contiguous memory reserved at probe for DMA buffers too large for
+	// dma_alloc_coherent. Freed in tt_dev_release because buffers carved
+	// from it may stay mapped after remove. NULL if there is no pool.
+	struct gen_pool *dma_buf_pool;
+	void *dma_buf_pool_ptr;
+	dma_addr_t dma_buf_pool_dma;
+	size_t dma_buf_pool_size;
+
+	// Freed coherent DMA buffers kept for reuse by any fd, bucketed by
+	// order_base_2(size) and capped at dma_buf_cache_mb. Disabled and
+	// emptied at remove. Protected by dma_buf_cache_lock.
+	spinlock_t dma_buf_cache_lock;
+	struct list_head dma_buf_cache[MAX_DMA_BUF_SIZE_LOG2 + 1];
+	u64 dma_buf_cache_bytes;
+	bool dma_buf_cache_disabled;
+};
 
 struct tenstorrent_device_class {
 	const char *name;
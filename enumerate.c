@@ -85,7 +85,7 @@ static int mappings_seq_show(struct seq_file *s, void *v)
 {
 	struct tenstorrent_device *tt_dev = s->private;
 	struct chardev_private *priv;
-	struct pinned_page_range *pinning;
+	struct rb_node *node;
 	unsigned int tlb_id;
 	struct tlb_descriptor desc;
 	bool sensitive = capable(CAP_SYS_ADMIN);
@@ -100,8 +100,10 @@ static int mappings_seq_show(struct seq_file *s, void *v)
 	mutex_lock(&tt_dev->chardev_mutex);
 	list_for_each_entry(priv, &tt_dev->open_fds_list, open_fd) {
 		struct tenstorrent_mmap_vma *mmap_vma;
+		struct tenstorrent_tlb_quota quota;
 		struct dmabuf *dmabuf;
-		unsigned int bkt;
+		unsigned long index;
+		int kind;
 		pid_t pid;
 
 		pid = pid_vnr(priv->pid);
@@ -121,33 +123,38 @@ static int mappings_seq_show(struct seq_file *s, void *v)
 		}
 
 		// User pinnings, including iATU entries.
-		list_for_each_entry(pinning, &priv->pinnings, list) {
+		for (node = rb_first_cached(&priv->pinnings); node; node = rb_next(node)) {
+			struct pinned_page_range *pinning = rb_entry(node, struct pinned_page_range, rb);
 			unsigned long long va_start = pinning->virtual_address;
 			unsigned long size_bytes = pinning->page_count * PAGE_SIZE;
 			unsigned long long addr = 0;
 			const char *addr_label;
 
-			if (pinning->dma_mapping.sgl) {
+			if (pinning->dma_mapped) {
 				// IOMMU path: show IOVA
 				addr_label = "IOVA";
 				if (sensitive)
-					addr = pinning->dma_mapping.sgl->dma_address;
+					addr = sg_dma_address(pinning->sgt.sgl);
 			} else {
 				// Non-IOMMU path: show physical address
 				addr_label = "PA";
-				if (sensitive && pinning->pages)
-					addr = page_to_phys(pinning->pages[0]);
+				if (sensitive)
+					addr = sg_phys(pinning->sgt.sgl);
 			}
 
 			if (pinning->outbound_iatu_region >= 0) {
 				const struct tenstorrent_outbound_iatu_region *region;
+				u64 target = pinning->dma_mapped ? sg_dma_address(pinning->sgt.sgl)
+								 : sg_phys(pinning->sgt.sgl);
+
+				// Pinnings may share a window, or use the identity window.
 				region = &priv->device->outbound_iatus[pinning->outbound_iatu_region];
 
 				seq_printf(
 					s,
 					"%-8d %-16s %-14s VA: 0x%016llx -> %s: 0x%016llx -> NOC: 0x%llx (size=0x%lx)\n",
 					pid, priv->comm, "PIN_PAGES+IATU", va_start, addr_label, addr,
-					sensitive ? region->base : 0, size_bytes);
+					sensitive ? region->base + (target - region->target) : 0, size_bytes);
 			} else {
 				seq_printf(s, "%-8d %-16s %-14s VA: 0x%016llx -> %s: 0x%016llx (size=0x%lx)\n", pid,
 					   priv->comm, "PIN_PAGES", va_start, addr_label, addr, size_bytes);
@@ -155,7 +162,7 @@ static int mappings_seq_show(struct seq_file *s, void *v)
 		}
 
 		// Driver-allocated DMA buffers, including iATU entries.
-		hash_for_each(priv->dmabufs, bkt, dmabuf, hash_chain) {
+		xa_for_each(&priv->dmabufs, index, dmabuf) {
 			unsigned long long addr = sensitive ? dmabuf->phys : 0;
 			unsigned long size_bytes = dmabuf->size;
 			const char *addr_label = is_iommu_translated(&priv->device->pdev->dev) ? "IOVA" : "PA";
@@ -164,10 +171,11 @@ static int mappings_seq_show(struct seq_file *s, void *v)
 				const struct tenstorrent_outbound_iatu_region *region;
 				region = &priv->device->outbound_iatus[dmabuf->outbound_iatu_region];
 
+				// The window may be the identity window.
 				seq_printf(s,
 					   "%-8d %-16s %-14s ID: %-3u -> %s: 0x%016llx -> NOC: 0x%llx (size=0x%lx)\n",
 					   pid, priv->comm, "DMA_BUF+IATU", dmabuf->index, addr_label, addr,
-					   sensitive ? region->base : 0, size_bytes);
+					   sensitive ? region->base + (dmabuf->phys - region->target) : 0, size_bytes);
 			} else {
 				seq_printf(s, "%-8d %-16s %-14s ID: %-3u -> %s: 0x%016llx (size=0x%lx)\n", pid,
 					   priv->comm, "DMA_BUF", dmabuf->index, addr_label, addr, size_bytes);
@@ -184,6 +192,21 @@ static int mappings_seq_show(struct seq_file *s, void *v)
 			mutex_unlock(&priv->tlb_mutex);
 		}
 
+		// TLB quotas and reservations that differ from the default.
+		spin_lock(&tt_dev->tlb_quota_lock);
+		quota = priv->tlb_quota;
+		spin_unlock(&tt_dev->tlb_quota_lock);
+
+		for (kind = 0; kind < tt_dev->dev_class->tlb_kinds; ++kind) {
+			if (quota.limit[kind] == 0 && quota.reserved[kind] == 0)
+				continue;
+
+			seq_printf(s, "%-8d %-16s %-14s size=0x%llx used=%u limit=%u reserved=%u\n",
+				   pid, priv->comm, "TLB-quota", tt_dev->dev_class->tlb_sizes[kind],
+				   quota.used[kind], tenstorrent_tlb_quota_limit(tt_dev, &quota, kind),
+				   quota.reserved[kind]);
+		}
+
 		// BAR/TLB mappings.
 		if (!mutex_trylock(&priv->vma_lock)) {
 			seq_printf(s, "%-8s %-16s %-14s\n", "", "", "...VMA list busy, skipping...");
@@ -232,6 +255,34 @@ static const struct file_operations mappings_fops = {
 	.release = single_release,
 };
 
+static int noc_dma_space_seq_show(struct seq_file *s, void *v)
+{
+	struct tenstorrent_device *tt_dev = s->private;
+
+	seq_printf(s, "WARNING: This file is for diagnostic purposes only.\n"
+		      "Its format is not stable and may change in future driver versions.\n"
+		      "Do not write scripts that parse this file.\n\n");
+
+	mutex_lock(&tt_dev->iatu_mutex);
+	range_alloc_show(s, &tt_dev->noc_dma_space, capable(CAP_SYS_ADMIN));
+	mutex_unlock(&tt_dev->iatu_mutex);
+
+	return 0;
+}
+
+static int noc_dma_space_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, noc_dma_space_seq_show, inode->i_private);
+}
+
+static const struct file_operations noc_dma_space_fops = {
+	.owner   = THIS_MODULE,
+	.open    = noc_dma_space_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
 int pids_proc_show(struct seq_file *s, void *v)
 {
 	struct tenstorrent_device *tt_dev = s->private;
@@ -317,6 +368,11 @@ static int tenstorrent_pci_probe(struct pci_dev *dev, const struct pci_device_id
 
 	mutex_init(&tt_dev->chardev_mutex);
 	mutex_init(&tt_dev->iatu_mutex);
+	tenstorrent_iatu_init(tt_dev);
+	mutex_init(&tt_dev->memfd_pin_mutex);
+	INIT_LIST_HEAD(&tt_dev->memfd_pinnings);
+	spin_lock_init(&tt_dev->tlb_quota_lock);
+	tenstorrent_dma_buf_cache_init(tt_dev);
 	mutex_init(&tt_dev->dmabuf_export_lock);
 	INIT_LIST_HEAD(&tt_dev->dmabuf_exports);
 	INIT_DELAYED_WORK(&tt_dev->power_down_work, tenstorrent_power_down_work_func);
@@ -382,6 +438,8 @@ static int tenstorrent_pci_probe(struct pci_dev *dev, const struct pci_device_id
 	pci_save_state(dev);
 	device_class->save_reset_state(tt_dev);
 
+	tenstorrent_dma_buf_pool_init(tt_dev);
+
 	tenstorrent_register_device(tt_dev);
 
 	if (device_class->reboot) {
@@ -393,6 +451,7 @@ static int tenstorrent_pci_probe(struct pci_dev *dev, const struct pci_device_id
 		device_class->init_telemetry(tt_dev);
 
 	debugfs_create_file("mappings", 0444, tt_dev->debugfs_root, tt_dev, &mappings_fops);
+	debugfs_create_file("noc_dma_space", 0444, tt_dev->debugfs_root, tt_dev, &noc_dma_space_fops);
 
 	// Set initial low-power state via aggregation logic.
 	if (power_policy)
@@ -472,6 +531,9 @@ static void tenstorrent_pci_remove(struct pci_dev *dev)
 	}
 	mutex_unlock(&tt_dev->chardev_mutex);
 
+	// Buffers still mapped after this are freed directly at their last munmap.
+	tenstorrent_dma_buf_cache_flush(tt_dev);
+
 	tenstorrent_unregister_device(tt_dev);
 	tenstorrent_disable_interrupts(tt_dev);
 
@@ -498,6 +560,8 @@ void tt_dev_release(struct device *dev)
 	if (tt_dev->dev_class->reboot)
 		unregister_reboot_notifier(&tt_dev->reboot_notifier);
 
+	tenstorrent_dma_buf_pool_destroy(tt_dev);
+
 	pci_dev_put(pdev);
 	kfree(tt_dev);
 }
@@ -6,6 +6,9 @@
 #include <linux/pci.h>
 #include <linux/types.h>
 #include <linux/interrupt.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/wait.h>
 
 #include "device.h"
 #include "enumerate.h"
@@ -13,13 +16,40 @@
 static irqreturn_t irq_handler(int irq, void *device)
 {
 	struct tenstorrent_device *tt_dev = device;
-	(void)tt_dev;	// to be used later
+
+	// With a shared INTx line this may not be ours. ARC message waiters
+	// recheck the queue after waking, so a spurious wakeup is harmless.
+	atomic_inc(&tt_dev->arc_irq_seq);
+	wake_up_all(&tt_dev->arc_irq_waitqueue);
 
 	return IRQ_HANDLED;
 }
 
+u32 tenstorrent_arc_irq_seq(struct tenstorrent_device *tt_dev)
+{
+	return tt_dev ? atomic_read(&tt_dev->arc_irq_seq) : 0;
+}
+
+// Wait for an ARC firmware response after sampling seq. Sleeps until the
+// next interrupt or max_us, whichever comes first, so firmware that doesn't
+// raise the interrupt sees the same polling interval as before.
+void tenstorrent_wait_arc_irq(struct tenstorrent_device *tt_dev, u32 seq, u32 min_us, u32 max_us)
+{
+	if (!tt_dev || !tt_dev->interrupt_enabled) {
+		usleep_range(min_us, max_us);
+		return;
+	}
+
+	wait_event_hrtimeout(tt_dev->arc_irq_waitqueue,
+			     (u32)atomic_read(&tt_dev->arc_irq_seq) != seq,
+			     ns_to_ktime((u64)max_us * NSEC_PER_USEC));
+}
+
 bool tenstorrent_enable_interrupts(struct tenstorrent_device *tt_dev)
 {
+	atomic_set(&tt_dev->arc_irq_seq, 0);
+	init_waitqueue_head(&tt_dev->arc_irq_waitqueue);
+
 	if (pci_alloc_irq_vectors(tt_dev->pdev, 1, 1, PCI_IRQ_ALL_TYPES) <= 0)
 		goto out_pci_alloc_irq_vectors_failed;
 
@@ -11,4 +11,7 @@ struct tenstorrent_device;
 bool tenstorrent_enable_interrupts(struct tenstorrent_device *tt_dev);
 void tenstorrent_disable_interrupts(struct tenstorrent_device *tt_dev);
 
+u32 tenstorrent_arc_irq_seq(struct tenstorrent_device *tt_dev);
+void tenstorrent_wait_arc_irq(struct tenstorrent_device *tt_dev, u32 seq, u32 min_us, u32 max_us);
+
 #endif
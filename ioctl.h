@@ -28,6 +28,19 @@
 #define TENSTORRENT_IOCTL_SET_NOC_CLEANUP		_IO(TENSTORRENT_IOCTL_MAGIC, 14)
 #define TENSTORRENT_IOCTL_SET_POWER_STATE		_IO(TENSTORRENT_IOCTL_MAGIC, 15)
 #define TENSTORRENT_IOCTL_EXPORT_TLB_DMABUF		_IO(TENSTORRENT_IOCTL_MAGIC, 16)
+#define TENSTORRENT_IOCTL_SET_TLB_QUOTA		_IO(TENSTORRENT_IOCTL_MAGIC, 17)
+#define TENSTORRENT_IOCTL_SYNC_DMA_BUF		_IO(TENSTORRENT_IOCTL_MAGIC, 18)
+#define TENSTORRENT_IOCTL_EXPORT_DMA_BUF	_IO(TENSTORRENT_IOCTL_MAGIC, 19)
+#define TENSTORRENT_IOCTL_LOOKUP_PINNING	_IO(TENSTORRENT_IOCTL_MAGIC, 20)
+#define TENSTORRENT_IOCTL_PIN_PAGES_BATCH	_IO(TENSTORRENT_IOCTL_MAGIC, 21)
+#define TENSTORRENT_IOCTL_PIN_PAGES_ASYNC	_IO(TENSTORRENT_IOCTL_MAGIC, 22)
+#define TENSTORRENT_IOCTL_PIN_PAGES_COMPLETE	_IO(TENSTORRENT_IOCTL_MAGIC, 23)
+#define TENSTORRENT_IOCTL_GET_PIN_SEGMENTS	_IO(TENSTORRENT_IOCTL_MAGIC, 24)
+#define TENSTORRENT_IOCTL_IMPORT_DMA_BUF	_IO(TENSTORRENT_IOCTL_MAGIC, 25)
+#define TENSTORRENT_IOCTL_RELEASE_DMA_BUF_IMPORT	_IO(TENSTORRENT_IOCTL_MAGIC, 26)
+#define TENSTORRENT_IOCTL_PIN_MEMFD		_IO(TENSTORRENT_IOCTL_MAGIC, 27)
+#define TENSTORRENT_IOCTL_UNPIN_MEMFD		_IO(TENSTORRENT_IOCTL_MAGIC, 28)
+#define TENSTORRENT_IOCTL_RESERVE_OUTBOUND_IATU	_IO(TENSTORRENT_IOCTL_MAGIC, 29)
 
 // For tenstorrent_mapping.mapping_id. These are not array indices.
 #define TENSTORRENT_MAPPING_UNUSED		0
@@ -56,7 +69,7 @@ struct tenstorrent_get_device_info_out {
 	__u16 bus_dev_fn;	// [0:2] function, [3:7] device, [8:15] bus
 	__u16 max_dma_buf_size_log2;	// Since 1.0
 	__u16 pci_domain;		// Since 1.23
-	__u16 reserved;
+	__u16 numa_node;	// U16_MAX if the platform does not report one
 };
 
 struct tenstorrent_get_device_info {
@@ -87,22 +100,68 @@ struct tenstorrent_query_mappings {
 
 // tenstorrent_allocate_dma_buf_in.flags
 #define TENSTORRENT_ALLOCATE_DMA_BUF_NOC_DMA 2
-
+#define TENSTORRENT_ALLOCATE_DMA_BUF_NUMA_NODE 4	// Allocate only from numa_node
+#define TENSTORRENT_ALLOCATE_DMA_BUF_CACHEABLE 8	// Cached CPU mapping, see SYNC_DMA_BUF
+#define TENSTORRENT_ALLOCATE_DMA_BUF_DYNAMIC_INDEX 16	// Kernel picks out.buf_index
+#define TENSTORRENT_ALLOCATE_DMA_BUF_NOC_BOTTOM_UP 32	// NOC DMA address allocated bottom-up (default is top-down)
+#define TENSTORRENT_ALLOCATE_DMA_BUF_NOC_FIXED 64	// NOC DMA at in.noc_address
+#define TENSTORRENT_ALLOCATE_DMA_BUF_HUGE_PAGES 128	// Prefer memory userspace can map with huge pages
+
+// Buffers larger than 256 MiB are carved from the device's contiguous pool
+// (dma_buf_pool_mb module parameter) and may be up to 4 GiB; the largest size
+// available is reported in max_dma_buf_size_log2. The requested size is
+// requested_size | (__u64)requested_size_hi << 32, likewise for out.size.
+//
+// Buffers are allocated near the device by default. With
+// TENSTORRENT_ALLOCATE_DMA_BUF_NUMA_NODE they come only from numa_node, are
+// not limited to 32-bit addresses, and without an IOMMU cannot be larger than
+// the page allocator's largest contiguous allocation (typically 4 MiB). The
+// same applies to TENSTORRENT_ALLOCATE_DMA_BUF_CACHEABLE buffers, which are
+// allocated near the device unless a node is given.
+//
+// With TENSTORRENT_ALLOCATE_DMA_BUF_DYNAMIC_INDEX, in.buf_index is ignored and
+// the kernel assigns a handle of at least TENSTORRENT_MAX_DMA_BUFS, returned
+// in out.buf_index, so an fd is not limited to 256 buffers. Use the handle
+// wherever a buf_index is expected. Its mapping_offset is beyond the reach of
+// 32-bit mmap.
+//
+// Where the kernel supports it, buffers of at least 2 MiB (on x86) may be
+// mapped into userspace with huge pages; out.page_size reports the page size
+// used. Huge pages need a shared mapping at a virtual address aligned like
+// mapping_offset, which mmap of the device chooses when given no address.
+// Behind an IOMMU a buffer usually gets them only with
+// TENSTORRENT_ALLOCATE_DMA_BUF_HUGE_PAGES, which backs it with huge pages
+// where possible. Such buffers skip the driver's cache of freed buffers.
+//
+// TENSTORRENT_ALLOCATE_DMA_BUF_NOC_BOTTOM_UP, TENSTORRENT_ALLOCATE_DMA_BUF_NOC_FIXED
+// and noc_align_log2 require TENSTORRENT_ALLOCATE_DMA_BUF_NOC_DMA. The NOC
+// address is aligned to 1 << noc_align_log2 bytes. With NOC_FIXED the buffer
+// is placed at noc_address, which must be page-aligned, or the allocation
+// fails with EBUSY if that range is taken. Otherwise it goes in the smallest
+// free NOC range that fits, at the end given by the direction flag, which
+// also decides between equally small ranges. This applies to every NOC DMA
+// window. With the identity_noc_window module parameter, a buffer whose DMA
+// address is in the identity window gets the NOC address matching it
+// instead, needing no window, and NOC_FIXED addresses there fail with EBUSY
+// unless they are that address.
 struct tenstorrent_allocate_dma_buf_in {
 	__u32 requested_size;
 	__u8  buf_index;	// [0,TENSTORRENT_MAX_DMA_BUFS)
 	__u8  flags;
-	__u8  reserved0[2];
-	__u64 reserved1[2];
+	__u16 numa_node;	// valid if TENSTORRENT_ALLOCATE_DMA_BUF_NUMA_NODE is set
+	__u32 requested_size_hi;
+	__u32 noc_align_log2;
+	__u64 noc_address;	// valid if TENSTORRENT_ALLOCATE_DMA_BUF_NOC_FIXED is set
 };
 
 struct tenstorrent_allocate_dma_buf_out {
 	__u64 physical_address;	// or IOVA
 	__u64 mapping_offset;
 	__u32 size;
-	__u32 reserved0;
+	__u32 size_hi;
 	__u64 noc_address;	// valid if TENSTORRENT_ALLOCATE_DMA_BUF_NOC_DMA is set
-	__u64 reserved1;
+	__u32 buf_index;	// in.buf_index or the kernel-assigned handle
+	__u32 page_size;	// page size of userspace mappings
 };
 
 struct tenstorrent_allocate_dma_buf {
@@ -110,7 +169,10 @@ struct tenstorrent_allocate_dma_buf {
 	struct tenstorrent_allocate_dma_buf_out out;
 };
 
+// Fails with -EBUSY while the buffer is mapped into userspace or exported.
 struct tenstorrent_free_dma_buf_in {
+	__u32 buf_index;
+	__u32 reserved;
 };
 
 struct tenstorrent_free_dma_buf_out {
@@ -170,6 +232,32 @@ struct tenstorrent_reset_device {
 #define TENSTORRENT_PIN_PAGES_NOC_DMA 2		// app wants to use the pages for NOC DMA
 #define TENSTORRENT_PIN_PAGES_NOC_TOP_DOWN 4	// NOC DMA will be allocated top-down (default is bottom-up)
 #define TENSTORRENT_PIN_PAGES_READ_ONLY 8	// device will only read; IOMMU enforced, requires IOMMU translation
+#define TENSTORRENT_PIN_PAGES_CACHE 16		// reuse a cached pinning of the same range, see below
+#define TENSTORRENT_PIN_PAGES_SEGMENTED 32	// accept physically discontiguous pages, see below
+
+// With TENSTORRENT_PIN_PAGES_CACHE, a pinning stays pinned and mapped after
+// UNPIN_PAGES, and a later cached PIN_PAGES of the same virtual address and
+// size returns the same addresses without pinning again, as long as the range
+// has not been unmapped or remapped in between. A cached range may be pinned
+// several times; each needs its own UNPIN_PAGES. READ_ONLY must match. The
+// pin_cache_mb module parameter bounds how much unpinned memory each fd keeps.
+// Fails with EOPNOTSUPP if the kernel lacks MMU notifiers.
+
+// Without IOMMU translation PIN_PAGES fails with EINVAL unless the pages are
+// physically contiguous. With TENSTORRENT_PIN_PAGES_SEGMENTED it accepts
+// any pages and physical_address is that of the first page only; the full
+// list comes from TENSTORRENT_IOCTL_GET_PIN_SEGMENTS. Such a pinning can't
+// have a NOC window, so NOC_DMA still requires contiguous pages. With an
+// IOMMU the flag changes nothing, the pinning is always one IOVA range.
+
+// Outbound iATU regions are few. A NOC_DMA pinning that would take the last
+// free one instead extends the NOC window of an earlier pinning of the same
+// fd if its IOVA (or physical) range directly follows or precedes that
+// window's, and gets the NOC address that continues it; the flags then don't
+// choose its placement. Cached pinnings never share a window. A shared window
+// only shrinks from its ends, so UNPIN_PAGES of a pinning it can't shrink past,
+// such as one in its middle, fails with EBUSY and leaves it pinned; it can be
+// unpinned once the pinnings on one side of it are.
 
 struct tenstorrent_pin_pages_in {
 	__u32 output_size_bytes;
@@ -187,7 +275,12 @@ struct tenstorrent_pin_pages_out_extended {
 	__u64 noc_address;
 };
 
-// unpinning subset of a pinned buffer is not supported
+// UNPIN_PAGES of a page-aligned part of a pinning unpins just that part and
+// leaves the rest pinned at the same physical and NOC addresses, as up to two
+// pinnings. This needs a free outbound iATU region if a NOC-mapped pinning is
+// left with a tail. It fails with EOPNOTSUPP for IOMMU-mapped and cached
+// pinnings, which can only be unpinned whole, and with EBUSY for pinnings
+// sharing their NOC window.
 struct tenstorrent_unpin_pages_in {
 	__u64 virtual_address;	// original VA used to pin, not current VA if remapped
 	__u64 size;
@@ -455,4 +548,419 @@ struct tenstorrent_export_tlb_dmabuf {
 	__u64 size;
 };
 
+/**
+ * TENSTORRENT_IOCTL_SET_TLB_QUOTA - Set this fd's TLB window limit and reservation
+ *
+ * Each TLB window kind (selected by window size, as for ALLOCATE_TLB) has a
+ * per-fd limit on the number of windows the fd may own at once. By default the
+ * limit is the tlb_quota_percent module parameter's share of the windows of
+ * that kind. ALLOCATE_TLB fails with -EDQUOT once the fd reaches its limit.
+ *
+ * An fd may also reserve windows of a kind. Reserved windows are held back
+ * from every other fd, so a latency-sensitive process is guaranteed them even
+ * when co-located processes allocate greedily: ALLOCATE_TLB on another fd fails
+ * with -ENOMEM once the only free windows left are reserved. A reservation is
+ * granted only if enough windows are free at the time of the call, otherwise
+ * this fails with -ENOSPC. Reservations end when the fd is closed or a device
+ * reset invalidates it.
+ *
+ * Reserving windows or raising the limit above the default requires
+ * CAP_SYS_ADMIN. Lowering the limit below the number of windows the fd already
+ * owns is allowed; it only affects future allocations.
+ *
+ * Quotas and reservations are shown in the debugfs mappings file.
+ *
+ * @argsz: Must be sizeof(struct tenstorrent_set_tlb_quota).
+ * @flags: Reserved for future use, must be 0.
+ * @size: TLB window size, selecting the window kind.
+ * @limit: Most windows of this kind the fd may own; 0 restores the default.
+ * @reserve: Number of windows of this kind reserved for the fd; must not
+ *           exceed the limit. 0 releases any reservation.
+ */
+struct tenstorrent_set_tlb_quota {
+	__u32 argsz;
+	__u32 flags;
+	__u64 size;
+	__u32 limit;
+	__u32 reserve;
+};
+
+// tenstorrent_sync_dma_buf.flags
+#define TENSTORRENT_SYNC_DMA_BUF_FOR_CPU	1
+#define TENSTORRENT_SYNC_DMA_BUF_FOR_DEVICE	2
+
+/**
+ * TENSTORRENT_IOCTL_SYNC_DMA_BUF - Hand a DMA buffer range to the CPU or device
+ *
+ * A buffer allocated with TENSTORRENT_ALLOCATE_DMA_BUF_CACHEABLE is mapped
+ * into userspace with normal cached memory, which the device may not snoop.
+ * Before reading data the device wrote, sync the range FOR_CPU; after writing
+ * data the device will read, sync it FOR_DEVICE. On cache-coherent platforms
+ * and for other buffers this is a no-op. The range must lie within the
+ * buffer, but the driver may sync more of the buffer than the range.
+ *
+ * @argsz: Must be sizeof(struct tenstorrent_sync_dma_buf).
+ * @flags: Exactly one of TENSTORRENT_SYNC_DMA_BUF_FOR_CPU or _FOR_DEVICE.
+ * @buf_index: The buffer, as passed to TENSTORRENT_IOCTL_ALLOCATE_DMA_BUF.
+ * @reserved: Must be 0.
+ * @offset: Byte offset of the range within the buffer.
+ * @size: Number of bytes to sync; 0 means to the end of the buffer.
+ */
+struct tenstorrent_sync_dma_buf {
+	__u32 argsz;
+	__u32 flags;
+	__u32 buf_index;
+	__u32 reserved;
+	__u64 offset;
+	__u64 size;
+};
+
+/**
+ * TENSTORRENT_IOCTL_EXPORT_DMA_BUF - Export a DMA buffer as a dma-buf
+ *
+ * Exports a buffer from TENSTORRENT_IOCTL_ALLOCATE_DMA_BUF so that another
+ * device (e.g. an RDMA NIC) can DMA into the same host memory the Tenstorrent
+ * device reads. The dma-buf can also be mmapped. Cacheable buffers are synced
+ * by DMA_BUF_IOCTL_SYNC on the dma-buf as well as by SYNC_DMA_BUF.
+ *
+ * The dma-buf keeps the memory alive after close() of this fd, but not the
+ * buffer's NOC mapping, which ends with the fd. FREE_DMA_BUF fails with
+ * -EBUSY until every dma-buf fd referring to the buffer is closed.
+ *
+ * @argsz: Must be sizeof(struct tenstorrent_export_dma_buf).
+ * @flags: Reserved for future use, must be 0.
+ * @buf_index: The buffer, as passed to TENSTORRENT_IOCTL_ALLOCATE_DMA_BUF.
+ * @fd: OUT: the dma-buf file descriptor.
+ */
+struct tenstorrent_export_dma_buf {
+	__u32 argsz;
+	__u32 flags;
+	__u32 buf_index;
+	__s32 fd;
+};
+
+/**
+ * TENSTORRENT_IOCTL_LOOKUP_PINNING - Find the pinning that covers an address
+ *
+ * Looks up the TENSTORRENT_IOCTL_PIN_PAGES pinning of this fd whose range
+ * contains @virtual_address. If several do, the one that starts lowest is
+ * reported. Fails with -ENOENT if there is none.
+ *
+ * @argsz: Must be sizeof(struct tenstorrent_lookup_pinning).
+ * @flags: Reserved for future use, must be 0.
+ * @virtual_address: The address to look up.
+ * @pinned_address: OUT: virtual address of the pinning, as passed to PIN_PAGES.
+ * @pinned_size: OUT: size of the pinning in bytes.
+ * @physical_address: OUT: IOVA, or physical address without an IOMMU, of
+ *	@virtual_address.
+ * @noc_address: OUT: NOC address of @virtual_address, or 0 if the pinning
+ *	is not mapped for NOC DMA.
+ */
+struct tenstorrent_lookup_pinning {
+	__u32 argsz;
+	__u32 flags;
+	__u64 virtual_address;
+	__u64 pinned_address;
+	__u64 pinned_size;
+	__u64 physical_address;
+	__u64 noc_address;
+};
+
+#define TENSTORRENT_PIN_PAGES_BATCH_MAX 1024
+
+/**
+ * TENSTORRENT_IOCTL_PIN_PAGES_BATCH - Pin many ranges in one call
+ *
+ * Does what TENSTORRENT_IOCTL_PIN_PAGES does for each entry of an array, in
+ * order, taking the fd's locks once. Entries succeed or fail independently;
+ * each reports its result in @status and successful ones are released with
+ * TENSTORRENT_IOCTL_UNPIN_PAGES as usual. The ioctl itself fails only if the
+ * arguments are malformed or the array can't be read or written back, in
+ * which case nothing is left pinned by it.
+ *
+ * @argsz: Must be sizeof(struct tenstorrent_pin_pages_batch).
+ * @flags: Reserved for future use, must be 0.
+ * @count: Number of entries, 1 to TENSTORRENT_PIN_PAGES_BATCH_MAX.
+ * @reserved: Must be 0.
+ * @entries: User pointer to @count struct tenstorrent_pin_pages_batch_entry.
+ */
+struct tenstorrent_pin_pages_batch {
+	__u32 argsz;
+	__u32 flags;
+	__u32 count;
+	__u32 reserved;
+	__u64 entries;
+};
+
+/**
+ * struct tenstorrent_pin_pages_batch_entry - One range of PIN_PAGES_BATCH
+ *
+ * @virtual_address: As tenstorrent_pin_pages_in.virtual_address.
+ * @size: As tenstorrent_pin_pages_in.size.
+ * @flags: TENSTORRENT_PIN_PAGES_* flags for this range.
+ * @status: OUT: 0, or the negative errno PIN_PAGES would have failed with.
+ * @physical_address: OUT: IOVA, or physical address without an IOMMU.
+ * @noc_address: OUT: NOC address if NOC DMA was requested, otherwise 0.
+ */
+struct tenstorrent_pin_pages_batch_entry {
+	__u64 virtual_address;
+	__u64 size;
+	__u32 flags;
+	__s32 status;
+	__u64 physical_address;
+	__u64 noc_address;
+};
+
+// Outstanding and uncollected PIN_PAGES_ASYNC requests per fd.
+#define TENSTORRENT_MAX_ASYNC_PINS 256
+
+/**
+ * TENSTORRENT_IOCTL_PIN_PAGES_ASYNC - Start pinning a range in the background
+ *
+ * Queues what TENSTORRENT_IOCTL_PIN_PAGES would do and returns at once with
+ * a ticket. The pinning is set up by a kernel worker in the caller's address
+ * space; TENSTORRENT_IOCTL_PIN_PAGES_COMPLETE reports the outcome. poll() on
+ * the fd reports POLLIN while a completed request is waiting to be
+ * collected. Once collected, a successful pinning is like any other and is
+ * released with TENSTORRENT_IOCTL_UNPIN_PAGES or close(). Fails with -EBUSY
+ * when TENSTORRENT_MAX_ASYNC_PINS requests are outstanding or uncollected.
+ *
+ * @argsz: Must be sizeof(struct tenstorrent_pin_pages_async).
+ * @flags: TENSTORRENT_PIN_PAGES_* flags, checked when the request runs.
+ * @virtual_address: As tenstorrent_pin_pages_in.virtual_address.
+ * @size: As tenstorrent_pin_pages_in.size.
+ * @ticket: OUT: identifies the request to PIN_PAGES_COMPLETE, never 0.
+ */
+struct tenstorrent_pin_pages_async {
+	__u32 argsz;
+	__u32 flags;
+	__u64 virtual_address;
+	__u64 size;
+	__u64 ticket;
+};
+
+// tenstorrent_pin_pages_complete.flags
+#define TENSTORRENT_PIN_PAGES_COMPLETE_NONBLOCK 1	// fail with EAGAIN instead of waiting
+
+/**
+ * TENSTORRENT_IOCTL_PIN_PAGES_COMPLETE - Collect a PIN_PAGES_ASYNC result
+ *
+ * Waits for the request with @ticket to finish, or with @ticket 0 for any
+ * request to finish, then reports and forgets it. Fails with -ENOENT if no
+ * such request is outstanding. If the result can't be written back, this
+ * fails with -EFAULT and the request stays to be collected again.
+ *
+ * @argsz: Must be sizeof(struct tenstorrent_pin_pages_complete).
+ * @flags: TENSTORRENT_PIN_PAGES_COMPLETE_* flags.
+ * @ticket: The request to collect, or 0 for any. OUT: the request collected.
+ * @status: OUT: 0, or the negative errno PIN_PAGES would have failed with.
+ * @reserved: Reserved for future use.
+ * @physical_address: OUT: IOVA, or physical address without an IOMMU.
+ * @noc_address: OUT: NOC address if NOC DMA was requested, otherwise 0.
+ */
+struct tenstorrent_pin_pages_complete {
+	__u32 argsz;
+	__u32 flags;
+	__u64 ticket;
+	__s32 status;
+	__u32 reserved;
+	__u64 physical_address;
+	__u64 noc_address;
+};
+
+struct tenstorrent_pin_segment {
+	__u64 address;	// IOVA, or physical address without an IOMMU
+	__u64 size;
+};
+
+/**
+ * TENSTORRENT_IOCTL_GET_PIN_SEGMENTS - List the DMA segments of a pinning
+ *
+ * Reports the pinning that TENSTORRENT_IOCTL_LOOKUP_PINNING would find for
+ * @virtual_address as the device sees it: maximal runs of contiguous IOVA,
+ * or of physical address without an IOMMU, in virtual address order. Up to
+ * @count segments are stored and @count is set to the total, so a caller
+ * can pass 0 to size its array. Fails with -ENOENT if nothing is pinned at
+ * @virtual_address.
+ *
+ * @argsz: Must be sizeof(struct tenstorrent_get_pin_segments).
+ * @flags: Reserved for future use, must be 0.
+ * @virtual_address: Any address in the pinning.
+ * @count: Capacity of @segments. OUT: number of segments in the pinning.
+ * @reserved: Must be 0.
+ * @segments: User pointer to an array of struct tenstorrent_pin_segment.
+ */
+struct tenstorrent_get_pin_segments {
+	__u32 argsz;
+	__u32 flags;
+	__u64 virtual_address;
+	__u32 count;
+	__u32 reserved;
+	__u64 segments;
+};
+
+// tenstorrent_import_dma_buf.flags
+#define TENSTORRENT_IMPORT_DMA_BUF_NOC_DMA	1	// map it through an outbound iATU region
+#define TENSTORRENT_IMPORT_DMA_BUF_NOC_TOP_DOWN	2	// place the NOC window top-down
+
+/**
+ * TENSTORRENT_IOCTL_IMPORT_DMA_BUF - Attach another driver's dma-buf
+ *
+ * Attaches the dma-buf @fd, exported by another driver (a GPU, udmabuf, an
+ * RDMA or storage driver), to this device and maps it for device DMA, so the
+ * device can read and write memory another subsystem owns without a copy
+ * through a host buffer. The exporter's placement is used as is: the buffer
+ * must map to a single range of IOVA, or of physical address without an
+ * IOMMU, and the ioctl fails with -EINVAL otherwise.
+ *
+ * The attachment holds a reference on the dma-buf, so @fd may be closed
+ * once this returns. It lasts until TENSTORRENT_IOCTL_RELEASE_DMA_BUF_IMPORT
+ * or close() of this fd.
+ *
+ * @argsz: Must be sizeof(struct tenstorrent_import_dma_buf).
+ * @flags: TENSTORRENT_IMPORT_DMA_BUF_* flags.
+ * @fd: The dma-buf file descriptor.
+ * @handle: OUT: identifies the import to RELEASE_DMA_BUF_IMPORT, never 0.
+ * @size: OUT: size of the dma-buf in bytes.
+ * @dma_address: OUT: IOVA, or physical address without an IOMMU.
+ * @noc_address: OUT: NOC address if TENSTORRENT_IMPORT_DMA_BUF_NOC_DMA was
+ *	set, otherwise 0.
+ */
+struct tenstorrent_import_dma_buf {
+	__u32 argsz;
+	__u32 flags;
+	__s32 fd;
+	__u32 handle;
+	__u64 size;
+	__u64 dma_address;
+	__u64 noc_address;
+};
+
+/**
+ * TENSTORRENT_IOCTL_RELEASE_DMA_BUF_IMPORT - Detach an imported dma-buf
+ *
+ * Tears down the NOC mapping of an import, unmaps it and drops its dma-buf
+ * reference. The device must no longer be accessing it.
+ *
+ * @argsz: Must be sizeof(struct tenstorrent_release_dma_buf_import).
+ * @flags: Reserved for future use, must be 0.
+ * @handle: As returned by TENSTORRENT_IOCTL_IMPORT_DMA_BUF.
+ * @reserved: Must be 0.
+ */
+struct tenstorrent_release_dma_buf_import {
+	__u32 argsz;
+	__u32 flags;
+	__u32 handle;
+	__u32 reserved;
+};
+
+// tenstorrent_pin_memfd.flags
+#define TENSTORRENT_PIN_MEMFD_NOC_DMA		1	// map it through an outbound iATU region
+#define TENSTORRENT_PIN_MEMFD_NOC_TOP_DOWN	2	// place the NOC window top-down
+
+/**
+ * TENSTORRENT_IOCTL_PIN_MEMFD - Pin a range of a memfd, shared across fds
+ *
+ * Pins @size bytes at @offset of the memfd (or other shmem or hugetlbfs
+ * file) @fd and maps them for device DMA, like TENSTORRENT_IOCTL_PIN_PAGES
+ * does for a virtual address range. The pinning belongs to the file rather
+ * than to this fd: every fd of the device that pins the same range of the
+ * same file, in any process, shares one pinning, one IOVA and one NOC
+ * window. The first PIN_MEMFD pins and maps the range; the pinning lasts
+ * until every PIN_MEMFD of it is matched by TENSTORRENT_IOCTL_UNPIN_MEMFD or
+ * close() of the fd that made it.
+ *
+ * A pinning is only shared while its pages are still the file's. Once the
+ * range is truncated or hole-punched, existing holders keep the old pages and
+ * the next PIN_MEMFD pins the file's new ones.
+ *
+ * The device may write the range, so @fd must be open for writing (else
+ * -EBADF) and the file must not have F_SEAL_WRITE or F_SEAL_FUTURE_WRITE
+ * (else -EPERM).
+ *
+ * The first caller that sets TENSTORRENT_PIN_MEMFD_NOC_DMA gives the shared
+ * pinning its NOC window. Without an IOMMU the range must be physically
+ * contiguous. Fails with -EOPNOTSUPP on kernels before 6.11.
+ *
+ * @argsz: Must be sizeof(struct tenstorrent_pin_memfd).
+ * @flags: TENSTORRENT_PIN_MEMFD_* flags.
+ * @fd: The memfd.
+ * @reserved: Must be 0.
+ * @offset: Offset in the file, page-aligned.
+ * @size: Size in bytes, page-aligned.
+ * @physical_address: OUT: IOVA, or physical address without an IOMMU.
+ * @noc_address: OUT: NOC address if TENSTORRENT_PIN_MEMFD_NOC_DMA was set,
+ *	otherwise 0.
+ */
+struct tenstorrent_pin_memfd {
+	__u32 argsz;
+	__u32 flags;
+	__s32 fd;
+	__u32 reserved;
+	__u64 offset;
+	__u64 size;
+	__u64 physical_address;
+	__u64 noc_address;
+};
+
+/**
+ * TENSTORRENT_IOCTL_UNPIN_MEMFD - Drop a TENSTORRENT_IOCTL_PIN_MEMFD
+ *
+ * Drops one PIN_MEMFD this fd made of the range. The range is unpinned when
+ * no fd holds it any more. Fails with -EINVAL if this fd holds no such
+ * pinning.
+ *
+ * @argsz: Must be sizeof(struct tenstorrent_unpin_memfd).
+ * @flags: Reserved for future use, must be 0.
+ * @fd: The memfd, or any fd of the same file.
+ * @reserved: Must be 0.
+ * @offset: As passed to PIN_MEMFD.
+ * @size: As passed to PIN_MEMFD.
+ */
+struct tenstorrent_unpin_memfd {
+	__u32 argsz;
+	__u32 flags;
+	__s32 fd;
+	__u32 reserved;
+	__u64 offset;
+	__u64 size;
+};
+
+/**
+ * TENSTORRENT_IOCTL_RESERVE_OUTBOUND_IATU - Reserve NOC DMA resources for this fd
+ *
+ * Reserves @count outbound iATU regions, which only this fd's NOC DMA
+ * windows may then use, and @noc_size bytes of NOC DMA address space, in
+ * which this fd's windows are placed first and no other fd's are. Once the
+ * reservation is used up, the fd's windows come from the shared pool as
+ * before. A service that must not be starved of NOC DMA by other users of
+ * the device reserves right after open(); the reservation lasts until
+ * close(), or until a reset that makes the fd stale. A window placed at a
+ * NOC_FIXED address uses the reserved space only if it lies within it.
+ * TENSTORRENT_IOCTL_PIN_MEMFD windows, which other fds share, never use the
+ * reserved space.
+ *
+ * Reserving regions or address space requires CAP_SYS_ADMIN, as reserving
+ * TLB windows does. An fd can reserve once. Fails with -EPERM without
+ * CAP_SYS_ADMIN, with -EBUSY if the fd already has reserved, and with
+ * -ENOSPC if fewer than @count regions are free and unreserved or no free
+ * NOC address range of @noc_size bytes is left.
+ *
+ * @argsz: Must be sizeof(struct tenstorrent_reserve_outbound_iatu).
+ * @flags: Reserved for future use, must be 0.
+ * @count: Number of regions to reserve, may be 0.
+ * @reserved: Must be 0.
+ * @noc_size: Bytes of NOC DMA address space to reserve, page-aligned, may
+ *	be 0.
+ * @noc_address: OUT: NOC address of the reserved space, 0 if @noc_size is 0.
+ */
+struct tenstorrent_reserve_outbound_iatu {
+	__u32 argsz;
+	__u32 flags;
+	__u32 count;
+	__u32 reserved;
+	__u64 noc_size;
+	__u64 noc_address;
+};
+
 #endif
@@ -18,6 +18,23 @@
 #include <linux/dma-buf.h>
 #include <linux/module.h>
 #include <linux/dma-resv.h>
+#include <linux/genalloc.h>
+#include <linux/cc_platform.h>
+#include <linux/interval_tree_generic.h>
+#include <linux/kthread.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 8, 0)
+#include <linux/mmu_context.h>
+#define kthread_use_mm use_mm
+#define kthread_unuse_mm unuse_mm
+#endif
+#if defined(CONFIG_ARCH_SUPPORTS_PMD_PFNMAP) && LINUX_VERSION_CODE < KERNEL_VERSION(6, 17, 0)
+#include <linux/pfn_t.h>
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+#include <linux/shmem_fs.h>
+#include <linux/hugetlb.h>
+#include <linux/magic.h>
+#endif
 
 #include "chardev_private.h"
 #include "device.h"
@@ -25,6 +42,7 @@
 #include "ioctl.h"
 #include "sg_helpers.h"
 #include "tlb.h"
+#include "module.h"
 
 #define BAR0_SIZE (1UL << 29)
 
@@ -36,169 +54,348 @@
 #define dma_buf_invalidate_mappings(dmabuf) dma_buf_move_notify(dmabuf)
 #endif
 
-static int get_sorted_iatu_region_indices(const struct tenstorrent_outbound_iatu_region *regions, int *sorted_indices)
+void tenstorrent_iatu_init(struct tenstorrent_device *tt_dev)
 {
 	int i;
-	int in_use_count = 0;
 
-	// First, collect indices of in-use regions.
-	for (i = 0; i < TENSTORRENT_MAX_OUTBOUND_IATU_REGIONS; i++) {
-		if (regions[i].priv) {
-			sorted_indices[in_use_count++] = i;
-		}
-	}
+	range_alloc_init(&tt_dev->noc_dma_space, 0, tt_dev->dev_class->noc_dma_limit);
+	tt_dev->identity_iatu_region = -1;
 
-	// Insertion sort the collected indices by the corresponding region's base.
-	for (i = 1; i < in_use_count; i++) {
-		int index = sorted_indices[i];
-		u64 base = regions[index].base;
-		int j = i - 1;
+	for (i = 0; i < TENSTORRENT_MAX_OUTBOUND_IATU_REGIONS; ++i)
+		range_alloc_node_init(&tt_dev->outbound_iatus[i].range);
+}
 
-		while (j >= 0 && regions[sorted_indices[j]].base > base) {
-			sorted_indices[j + 1] = sorted_indices[j];
-			j--;
-		}
-		sorted_indices[j + 1] = index;
-	}
+// The identity window belongs to no fd, so its priv is NULL too.
+static bool outbound_iatu_is_free(struct tenstorrent_device *tt_dev, int iatu_region)
+{
+	return tt_dev->outbound_iatus[iatu_region].priv == NULL && iatu_region != tt_dev->identity_iatu_region;
+}
+
+// Whether priv may take a free region: one no fd reserved, or it did. priv
+// is NULL for the driver itself.
+static bool outbound_iatu_is_usable(struct tenstorrent_device *tt_dev, int iatu_region,
+				    struct chardev_private *priv)
+{
+	struct chardev_private *reserved_for = tt_dev->outbound_iatus[iatu_region].reserved_for;
 
-	return in_use_count;
+	return outbound_iatu_is_free(tt_dev, iatu_region) && (reserved_for == NULL || reserved_for == priv);
 }
 
-static u64 find_iatu_region_top_down(const struct tenstorrent_outbound_iatu_region *regions, u64 max_addr, u64 size)
+// Returns a region number or -ENOSPC, preferring a region priv reserved.
+// Caller holds iatu_mutex.
+static int find_free_outbound_iatu(struct tenstorrent_device *tt_dev, struct chardev_private *priv)
 {
-	int sorted_indices[TENSTORRENT_MAX_OUTBOUND_IATU_REGIONS];
-	u64 current_pos = max_addr;
-	int in_use_count;
+	int found = -ENOSPC;
 	int i;
 
-	in_use_count = get_sorted_iatu_region_indices(regions, sorted_indices);
+	for (i = 0; i < TENSTORRENT_MAX_OUTBOUND_IATU_REGIONS; ++i) {
+		if (!outbound_iatu_is_usable(tt_dev, i, priv))
+			continue;
 
-	if (in_use_count == 0) {
-		// Allocate at top if there's enough space.
-		if (size <= (max_addr + 1)) {
-			return max_addr - size + 1;
-		}
-		return U64_MAX; // Size too large for address space.
-	}
+		if (priv && tt_dev->outbound_iatus[i].reserved_for == priv)
+			return i;
 
-	// Check each region from top to bottom.
-	for (i = in_use_count - 1; i >= 0; i--) {
-		const struct tenstorrent_outbound_iatu_region *region = &regions[sorted_indices[i]];
+		if (found < 0)
+			found = i;
+	}
 
-		if ((current_pos - region->limit) >= size)
-			return current_pos - size + 1;
+	return found;
+}
 
-		current_pos = region->base - 1;
-	}
+// The NOC DMA address space in which priv places a window at [base, last]:
+// its reservation if that holds the window, otherwise the device's.
+static struct range_alloc *noc_space_for(struct chardev_private *priv, u64 base, u64 last)
+{
+	struct range_alloc_node *reservation = &priv->noc_reservation;
 
-	// Check gap at the bottom (from 0 to the lowest region).
-	if ((current_pos + 1) >= size)
-		return current_pos - size + 1;
+	if (!RB_EMPTY_NODE(&reservation->rb) && base >= reservation->start && last <= reservation->last)
+		return &priv->noc_space;
 
-	return U64_MAX; // No suitable gap found.
+	return &priv->device->noc_dma_space;
 }
 
-static u64 find_iatu_region_bottom_up(const struct tenstorrent_outbound_iatu_region *regions, u64 max_addr, u64 size)
+// Reserve, the first time, and program a region translating NOC DMA
+// addresses [0, last] to the same DMA addresses, so that buffers the device
+// has mapped there need no region of their own. Only with an IOMMU, which
+// limits what the window reaches to what is mapped for the device; every fd
+// can then reach every such buffer. Called at each hardware init, as reset
+// clears the iATU.
+void tenstorrent_identity_noc_window_init(struct tenstorrent_device *tt_dev, u64 last)
 {
-	int sorted_indices[TENSTORRENT_MAX_OUTBOUND_IATU_REGIONS];
-	u64 current_pos = 0;
-	int in_use_count;
-	int i;
+	struct tenstorrent_outbound_iatu_region *region;
+	int iatu_region;
+
+	if (!is_iommu_translated(&tt_dev->pdev->dev))
+		return;
+
+	mutex_lock(&tt_dev->iatu_mutex);
 
-	in_use_count = get_sorted_iatu_region_indices(regions, sorted_indices);
+	iatu_region = tt_dev->identity_iatu_region;
+	if (iatu_region < 0) {
+		iatu_region = find_free_outbound_iatu(tt_dev, NULL);
+		if (iatu_region < 0)
+			goto out;
 
-	if (in_use_count == 0) {
-		// Allocate at bottom if there's enough space.
-		if (size <= max_addr + 1) {
-			return 0;
+		region = &tt_dev->outbound_iatus[iatu_region];
+		region->space = &tt_dev->noc_dma_space;
+		if (range_alloc_insert_at(region->space, &region->range, 0, last)) {
+			dev_warn(&tt_dev->pdev->dev, "NOC DMA addresses in use, no identity window\n");
+			goto out;
 		}
-		return U64_MAX;
+
+		region->base = 0;
+		region->limit = last;
+		region->target = 0;
+		tt_dev->identity_iatu_region = iatu_region;
 	}
 
-	// Check each region from bottom to top.
-	for (i = 0; i < in_use_count; i++) {
-		const struct tenstorrent_outbound_iatu_region *region = &regions[sorted_indices[i]];
+	region = &tt_dev->outbound_iatus[iatu_region];
+	if (tt_dev->dev_class->configure_outbound_atu(tt_dev, iatu_region, 0, region->limit, 0))
+		dev_warn(&tt_dev->pdev->dev, "Failed to program the identity NOC window\n");
+
+out:
+	mutex_unlock(&tt_dev->iatu_mutex);
+}
+
+// Whether the identity window covers [target, target + size), and if so
+// the NOC address of target. Caller holds iatu_mutex.
+static bool identity_noc_dma(struct tenstorrent_device *tt_dev, u64 size, u64 target, u64 *noc_address)
+{
+	u64 last;
+
+	if (tt_dev->identity_iatu_region < 0)
+		return false;
+
+	last = tt_dev->outbound_iatus[tt_dev->identity_iatu_region].limit;
+	if (target > last || size - 1 > last - target)
+		return false;
+
+	*noc_address = tt_dev->dev_class->noc_pcie_offset + target;
+	return true;
+}
 
-		if ((region->base - current_pos) >= size)
-			return current_pos;
+// Program a free region whose range has been placed in its space and mark
+// it in use. On failure the range is released again. Returns the
+// region number or a negative error code. Caller holds iatu_mutex.
+static int configure_outbound_iatu(struct chardev_private *priv, int region, u64 target)
+{
+	struct tenstorrent_device *tt_dev = priv->device;
+	struct tenstorrent_outbound_iatu_region *iatu = &tt_dev->outbound_iatus[region];
+	int ret;
 
-		current_pos = region->limit + 1;
+	// Program the hardware.
+	ret = tt_dev->dev_class->configure_outbound_atu(tt_dev, region, iatu->range.start, iatu->range.last, target);
+	if (ret) {
+		range_alloc_remove(iatu->space, &iatu->range);
+		return ret;
 	}
 
-	// Check gap at the top (from highest region to max_addr).
-	if ((max_addr - current_pos + 1) >= size)
-		return current_pos;
+	// Mark region as in use.
+	iatu->priv = priv;
+	iatu->base = iatu->range.start;
+	iatu->limit = iatu->range.last;
+	iatu->target = target;
 
-	return U64_MAX; // No suitable gap found.
+	return region;
 }
 
-// returns the region number or a negative error code.
-static int configure_outbound_iatu(struct chardev_private *priv, u64 base, u64 limit, u64 target)
+// Return the iATU region number or a negative error code. The window's NOC
+// address is aligned to align, a power of two. noc_pcie_offset is aligned
+// beyond any window that fits below noc_dma_limit, so aligning the window
+// base is enough. The window goes where it fits best, see range_alloc_insert,
+// in priv's reserved NOC address space first if it has one. Windows that
+// can outlive priv pass fd_local false to stay out of that space and of the
+// iATU regions priv reserved.
+static int setup_noc_dma(struct chardev_private *priv, bool fd_local, bool top_down, u64 align, size_t size,
+			 u64 target, u64 *noc_address)
 {
 	struct tenstorrent_device *tt_dev = priv->device;
-	int region = -1;
-	int i;
+	struct tenstorrent_outbound_iatu_region *iatu;
+	int iatu_region;
 	int ret;
 
-	if (base > limit)
+	if (size == 0)
 		return -EINVAL;
 
-	// Find a free region.
-	for (i = 0; i < TENSTORRENT_MAX_OUTBOUND_IATU_REGIONS; ++i) {
-		if (tt_dev->outbound_iatus[i].priv == NULL) {
-			region = i;
-			break;
-		}
+	mutex_lock(&tt_dev->iatu_mutex);
+
+	if (IS_ALIGNED(target, align) && identity_noc_dma(tt_dev, size, target, noc_address)) {
+		iatu_region = tt_dev->identity_iatu_region;
+		goto out;
 	}
 
-	if (region < 0)
-		return -ENOSPC;
+	iatu_region = find_free_outbound_iatu(tt_dev, fd_local ? priv : NULL);
+	if (iatu_region < 0)
+		goto out;
 
-	// Program the hardware.
-	ret = tt_dev->dev_class->configure_outbound_atu(tt_dev, region, base, limit, target);
+	iatu = &tt_dev->outbound_iatus[iatu_region];
+
+	ret = -ENOMEM;
+	if (fd_local && !RB_EMPTY_NODE(&priv->noc_reservation.rb))
+		ret = range_alloc_insert(&priv->noc_space, &iatu->range, size, align, top_down);
+
+	iatu->space = ret ? &tt_dev->noc_dma_space : &priv->noc_space;
 	if (ret)
-		return ret;
+		ret = range_alloc_insert(iatu->space, &iatu->range, size, align, top_down);
+	if (ret) {
+		iatu_region = ret;
+		goto out;
+	}
 
-	// Mark region as in use.
-	tt_dev->outbound_iatus[region].priv = priv;
-	tt_dev->outbound_iatus[region].base = base;
-	tt_dev->outbound_iatus[region].limit = limit;
-	tt_dev->outbound_iatus[region].target = target;
+	iatu_region = configure_outbound_iatu(priv, iatu_region, target);
+	if (iatu_region >= 0)
+		*noc_address = tt_dev->dev_class->noc_pcie_offset + iatu->base;
 
-	return region;
+out:
+	mutex_unlock(&tt_dev->iatu_mutex);
+	return iatu_region;
 }
 
-// Return the iATU region number or a negative error code.
-static int setup_noc_dma(struct chardev_private *priv, bool top_down, size_t size, u64 target, u64 *noc_address)
+// Like setup_noc_dma, but at the given NOC address, which must be free.
+static int setup_noc_dma_fixed(struct chardev_private *priv, u64 noc_address, size_t size, u64 target)
 {
 	struct tenstorrent_device *tt_dev = priv->device;
 	u64 max_addr = tt_dev->dev_class->noc_dma_limit;
-	u64 base;
-	u64 limit;
+	u64 base = noc_address - tt_dev->dev_class->noc_pcie_offset;
+	u64 identity_address;
 	int iatu_region;
+	int ret;
 
-	if (size == 0)
+	if (size == 0
+	    || noc_address < tt_dev->dev_class->noc_pcie_offset
+	    || !PAGE_ALIGNED(base)
+	    || base > max_addr
+	    || size - 1 > max_addr - base)
 		return -EINVAL;
 
 	mutex_lock(&tt_dev->iatu_mutex);
-	if (top_down)
-		base = find_iatu_region_top_down(tt_dev->outbound_iatus, max_addr, size);
-	else
-		base = find_iatu_region_bottom_up(tt_dev->outbound_iatus, max_addr, size);
 
-	if (base == U64_MAX) {
-		mutex_unlock(&tt_dev->iatu_mutex);
-		return -ENOMEM;
+	if (identity_noc_dma(tt_dev, size, target, &identity_address) && identity_address == noc_address) {
+		iatu_region = tt_dev->identity_iatu_region;
+		goto out;
 	}
 
-	limit = base + size - 1;
-	iatu_region = configure_outbound_iatu(priv, base, limit, target);
-	*noc_address = tt_dev->dev_class->noc_pcie_offset + base;
+	iatu_region = find_free_outbound_iatu(tt_dev, priv);
+	if (iatu_region >= 0) {
+		struct tenstorrent_outbound_iatu_region *iatu = &tt_dev->outbound_iatus[iatu_region];
+
+		iatu->space = noc_space_for(priv, base, base + size - 1);
+		ret = range_alloc_insert_at(iatu->space, &iatu->range, base, base + size - 1);
+		if (ret)
+			iatu_region = ret;
+		else
+			iatu_region = configure_outbound_iatu(priv, iatu_region, target);
+	}
 
+out:
 	mutex_unlock(&tt_dev->iatu_mutex);
+
 	return iatu_region;
 }
 
+// Give up priv's RESERVE_OUTBOUND_IATU reservation, once none of its
+// windows is left in the reserved NOC address space. Caller holds
+// iatu_mutex.
+static void release_iatu_reservation(struct chardev_private *priv)
+{
+	struct tenstorrent_device *tt_dev = priv->device;
+	int i;
+
+	lockdep_assert_held(&tt_dev->iatu_mutex);
+
+	for (i = 0; i < TENSTORRENT_MAX_OUTBOUND_IATU_REGIONS; ++i) {
+		if (tt_dev->outbound_iatus[i].reserved_for == priv)
+			tt_dev->outbound_iatus[i].reserved_for = NULL;
+	}
+
+	if (!RB_EMPTY_NODE(&priv->noc_reservation.rb)) {
+		WARN_ON(priv->noc_space.nr_used != 0);
+		range_alloc_remove(&tt_dev->noc_dma_space, &priv->noc_reservation);
+	}
+}
+
+long ioctl_reserve_outbound_iatu(struct chardev_private *priv,
+				 struct tenstorrent_reserve_outbound_iatu __user *arg)
+{
+	struct tenstorrent_device *tt_dev = priv->device;
+	struct tenstorrent_reserve_outbound_iatu data = {0};
+	unsigned int nr_usable = 0;
+	unsigned int count;
+	long ret = 0;
+	int i;
+
+	if (copy_from_user(&data, arg, sizeof(data)))
+		return -EFAULT;
+
+	if (data.argsz != sizeof(data))
+		return -EINVAL;
+
+	if (data.flags != 0 || data.reserved != 0 || !PAGE_ALIGNED(data.noc_size))
+		return -EINVAL;
+
+	// Reserved resources are held back from every other fd.
+	if ((data.count > 0 || data.noc_size > 0) && !capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	mutex_lock(&priv->mutex);
+	mutex_lock(&tt_dev->iatu_mutex);
+
+	if (priv->iatu_reserved) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	for (i = 0; i < TENSTORRENT_MAX_OUTBOUND_IATU_REGIONS; ++i) {
+		if (outbound_iatu_is_usable(tt_dev, i, NULL))
+			nr_usable++;
+	}
+
+	if (data.count > nr_usable) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	data.noc_address = 0;
+	if (data.noc_size != 0) {
+		if (range_alloc_insert(&tt_dev->noc_dma_space, &priv->noc_reservation, data.noc_size, PAGE_SIZE,
+				       true)) {
+			ret = -ENOSPC;
+			goto out;
+		}
+
+		range_alloc_init(&priv->noc_space, priv->noc_reservation.start, priv->noc_reservation.last);
+		data.noc_address = tt_dev->dev_class->noc_pcie_offset + priv->noc_reservation.start;
+	}
+
+	count = data.count;
+	for (i = 0; count > 0 && i < TENSTORRENT_MAX_OUTBOUND_IATU_REGIONS; ++i) {
+		if (outbound_iatu_is_usable(tt_dev, i, NULL)) {
+			tt_dev->outbound_iatus[i].reserved_for = priv;
+			count--;
+		}
+	}
+
+	priv->iatu_reserved = true;
+
+	mutex_unlock(&tt_dev->iatu_mutex);
+
+	if (copy_to_user(arg, &data, sizeof(data))) {
+		mutex_lock(&tt_dev->iatu_mutex);
+		release_iatu_reservation(priv);
+		priv->iatu_reserved = false;
+		mutex_unlock(&tt_dev->iatu_mutex);
+		ret = -EFAULT;
+	}
+
+	mutex_unlock(&priv->mutex);
+	return ret;
+
+out:
+	mutex_unlock(&tt_dev->iatu_mutex);
+	mutex_unlock(&priv->mutex);
+	return ret;
+}
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
 static int pin_user_pages_fast_longterm(unsigned long start, int nr_pages, unsigned int gup_flags, struct page **pages)
 {
@@ -250,585 +447,3256 @@ static void unpin_user_pages_dirty_lock(struct page **pages, unsigned long npage
 }
 #endif
 
-#define MAX_DMA_BUF_SIZE (1u << MAX_DMA_BUF_SIZE_LOG2)
-
-// These are the mmap offsets for various resources. In the user-kernel
-// interface they are dynamic (TENSTORRENT_IOCTL_QUERY_MAPPINGS and
-// TENSTORRENT_IOCTL_ALLOCATE_DMA_BUF), but they are actually hard-coded.
-#define MMAP_OFFSET_RESOURCE0_UC	(U64_C(0) << 36)
-#define MMAP_OFFSET_RESOURCE0_WC	(U64_C(1) << 36)
-#define MMAP_OFFSET_RESOURCE1_UC	(U64_C(2) << 36)
-#define MMAP_OFFSET_RESOURCE1_WC	(U64_C(3) << 36)
-#define MMAP_OFFSET_RESOURCE2_UC	(U64_C(4) << 36)
-#define MMAP_OFFSET_RESOURCE2_WC	(U64_C(5) << 36)
-#define MMAP_OFFSET_TLB_UC		(U64_C(6) << 36)
-#define MMAP_OFFSET_TLB_WC		(U64_C(7) << 36)
-
-#define MMAP_RESOURCE_SIZE (U64_C(1) << 36)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+// unpin_user_page_range_dirty_lock is provided by the kernel.
+#else
+static void unpin_user_page_range_dirty_lock(struct page *page, unsigned long npages, bool make_dirty)
+{
+	unsigned long i;
 
-// tenstorrent_allocate_dma_buf_in.buf_index is u8 so that sets a limit of
-// U8_MAX DMA buffers per fd. 32-bit mmap offsets are divided by PAGE_SIZE,
-// so PAGE_SIZE << 32 is the largest possible offset.
-#define MMAP_OFFSET_DMA_BUF		((u64)(PAGE_SIZE-U8_MAX-1) << 32)
+	for (i = 0; i < npages; i++) {
+		struct page *p = nth_page(page, i);
 
-#define MMAP_SIZE_DMA_BUF (U64_C(1) << 32)
+		unpin_user_pages_dirty_lock(&p, 1, make_dirty);
+	}
+}
+#endif
 
-// Clear an outbound iATU slot's bookkeeping without touching the hardware.
-static void release_outbound_iatu_slot(struct tenstorrent_device *tt_dev, int iatu_region)
+// Unpin the pages of a table built by pin_user_pages_sgt, even a partly
+// built one. Each entry is a physically contiguous run.
+static void unpin_sgt_pages(struct sg_table *sgt, bool make_dirty)
 {
-	struct tenstorrent_outbound_iatu_region *region = &tt_dev->outbound_iatus[iatu_region];
-
-	lockdep_assert_held(&tt_dev->iatu_mutex);
+	struct scatterlist *sg;
+	unsigned int i;
 
-	region->priv = NULL;
-	region->base = 0;
-	region->limit = 0;
-	region->target = 0;
+	for_each_sg(sgt->sgl, sg, sgt->orig_nents, i)
+		unpin_user_page_range_dirty_lock(sg_page(sg), sg->length >> PAGE_SHIFT, make_dirty);
 }
 
-static void teardown_outbound_iatu(struct chardev_private *priv, int iatu_region)
+// The device sees a mapped buffer at a single address, so its mapping must be
+// one run of DMA address space covering at least size bytes.
+static int sgt_dma_range(struct sg_table *sgt, u64 size, dma_addr_t *dma_address)
 {
-	struct tenstorrent_device *tt_dev = priv->device;
-
-	if (iatu_region < 0)
-		return;
+	struct scatterlist *sg;
+	dma_addr_t start = 0;
+	u64 len = 0;
+	int i;
 
-	mutex_lock(&tt_dev->iatu_mutex);
+	for_each_sgtable_dma_sg(sgt, sg, i) {
+		if (len == 0)
+			start = sg_dma_address(sg);
+		else if (sg_dma_address(sg) != start + len)
+			return -EINVAL;
 
-	if (!tt_dev->detached)
-		tt_dev->dev_class->configure_outbound_atu(tt_dev, iatu_region, 0, 0, 0);
+		len += sg_dma_len(sg);
+	}
 
-	release_outbound_iatu_slot(tt_dev, iatu_region);
+	if (len < size || !PAGE_ALIGNED(start))
+		return -EINVAL;
 
-	mutex_unlock(&tt_dev->iatu_mutex);
+	*dma_address = start;
+	return 0;
 }
 
-// Reclaim outbound iATU slots from fds this reset invalidated (stale
-// open_reset_gen); a wedged process would otherwise hold them until a
-// close() that never comes.  Only the bookkeeping is released: reset leaves
-// the ATU default-clear, which is what a free slot means.  Nulling each
-// back-reference makes the stale fd's close() a no-op, so it cannot disable
-// a slot a post-reset fd has since claimed.  Caller holds reset_rwsem
-// exclusive and has already called bump_reset_gen().
-void tenstorrent_reset_reclaim_iatus(struct tenstorrent_device *tt_dev)
+// GUP hands back one struct page pointer per base page, so pin through a
+// small buffer of them and keep only the merged runs.
+#define PIN_BATCH_PAGES 8192
+
+// Pin nr_pages from start into a chained sg_table with one entry per
+// physically contiguous run, so a huge page takes one entry rather than 512
+// page pointers. On failure nothing stays pinned.
+static int pin_user_pages_sgt_serial(unsigned long start, unsigned long nr_pages,
+				     unsigned int gup_flags, struct sg_table *sgt)
 {
-	long gen = atomic_long_read(&tt_dev->reset_gen);
-	struct chardev_private *priv;
-	struct pinned_page_range *pinning;
-	struct dmabuf *dmabuf;
-	unsigned int i;
+	struct chained_sgt_builder builder;
+	struct page **batch;
+	unsigned long done = 0;
+	int ret = 0;
 
-	mutex_lock(&tt_dev->chardev_mutex);
-	list_for_each_entry(priv, &tt_dev->open_fds_list, open_fd) {
-		if (priv->open_reset_gen == gen)
-			continue;
+	batch = kvmalloc_array(min_t(unsigned long, nr_pages, PIN_BATCH_PAGES), sizeof(*batch), GFP_KERNEL);
+	if (!batch)
+		return -ENOMEM;
 
-		mutex_lock(&priv->mutex);
-		mutex_lock(&tt_dev->iatu_mutex);
+	chained_sgt_builder_init(&builder, sgt);
 
-		hash_for_each(priv->dmabufs, i, dmabuf, hash_chain) {
-			if (dmabuf->outbound_iatu_region >= 0) {
-				release_outbound_iatu_slot(tt_dev, dmabuf->outbound_iatu_region);
-				dmabuf->outbound_iatu_region = -1;
-			}
+	while (done < nr_pages) {
+		int n = min_t(unsigned long, nr_pages - done, PIN_BATCH_PAGES);
+		int pinned = pin_user_pages_fast_longterm(start + (done << PAGE_SHIFT), n, gup_flags, batch);
+		int i;
+
+		if (pinned <= 0) {
+			ret = pinned ? pinned : -EFAULT;
+			break;
 		}
 
-		list_for_each_entry(pinning, &priv->pinnings, list) {
-			if (pinning->outbound_iatu_region >= 0) {
-				release_outbound_iatu_slot(tt_dev, pinning->outbound_iatu_region);
-				pinning->outbound_iatu_region = -1;
+		for (i = 0; i < pinned; i++) {
+			if (!chained_sgt_append(&builder, batch[i], 1)) {
+				unpin_user_pages_dirty_lock(batch + i, pinned - i, false);
+				ret = -ENOMEM;
+				break;
 			}
 		}
 
-		mutex_unlock(&tt_dev->iatu_mutex);
-		mutex_unlock(&priv->mutex);
+		done += pinned;
+
+		if (ret == 0 && pinned != n)
+			ret = -EINVAL;	// hit an unmapped or unpinnable page
+		if (ret)
+			break;
 	}
-	mutex_unlock(&tt_dev->chardev_mutex);
+
+	kvfree(batch);
+
+	if (ret) {
+		unpin_sgt_pages(sgt, false);
+		free_chained_sgt(sgt);
+		return ret;
+	}
+
+	chained_sgt_builder_finish(&builder);
+	return 0;
 }
 
-static void unpin_pinned_page_range(struct chardev_private *priv,
-	struct pinned_page_range *pinning)
-{
-	enum dma_data_direction dir = pinning->read_only ? DMA_TO_DEVICE : DMA_BIDIRECTIONAL;
+// Pinning is split across tenstorrent_pin_wq workers for ranges of at
+// least PIN_PARALLEL_MIN_SIZE, in chunks of at least PIN_PARALLEL_MIN_CHUNK.
+#define PIN_PARALLEL_MIN_SIZE (U64_C(1) << 30)
+#define PIN_PARALLEL_MIN_CHUNK (U64_C(256) << 20)
 
-	teardown_outbound_iatu(priv, pinning->outbound_iatu_region);
+static struct workqueue_struct *tenstorrent_pin_wq;
 
-	dma_unmap_sgtable(&priv->device->pdev->dev, &pinning->dma_mapping, dir, 0);
-	free_chained_sgt(&pinning->dma_mapping);
+struct pin_chunk {
+	struct work_struct work;
+	struct mm_struct *mm;
+	unsigned long start;
+	unsigned long nr_pages;
+	unsigned int gup_flags;
+	struct sg_table sgt;
+	int ret;	// result of pin_user_pages_sgt_serial
+};
 
-	unpin_user_pages_dirty_lock(pinning->pages, pinning->page_count, !pinning->read_only);
-	vfree(pinning->pages);
+static void pin_chunk_work_fn(struct work_struct *work)
+{
+	struct pin_chunk *chunk = container_of(work, struct pin_chunk, work);
 
-	list_del(&pinning->list);
-	kfree(pinning);
+	kthread_use_mm(chunk->mm);
+	chunk->ret = pin_user_pages_sgt_serial(chunk->start, chunk->nr_pages, chunk->gup_flags, &chunk->sgt);
+	kthread_unuse_mm(chunk->mm);
 }
 
-struct peer_resource_mapping {
-	struct list_head list;
+// pin_user_pages_sgt_serial, but large ranges are pinned by up to
+// pin_threads workers at once and their tables joined.
+static int pin_user_pages_sgt(unsigned long start, unsigned long nr_pages,
+			      unsigned int gup_flags, struct sg_table *sgt)
+{
+	unsigned long min_chunk_pages = PIN_PARALLEL_MIN_CHUNK >> PAGE_SHIFT;
+	unsigned long chunk_pages;
+	unsigned int nr_chunks = READ_ONCE(pin_threads);
+	struct chained_sgt_builder builder;
+	struct pin_chunk *chunks;
+	unsigned int i;
+	int ret = 0;
+
+	if (((u64)nr_pages << PAGE_SHIFT) < PIN_PARALLEL_MIN_SIZE || nr_chunks <= 1)
+		return pin_user_pages_sgt_serial(start, nr_pages, gup_flags, sgt);
+
+	nr_chunks = min_t(unsigned long, nr_chunks, DIV_ROUND_UP(nr_pages, min_chunk_pages));
+	chunk_pages = DIV_ROUND_UP(nr_pages, nr_chunks);
+
+	chunks = kcalloc(nr_chunks, sizeof(*chunks), GFP_KERNEL);
+	if (!chunks)
+		return pin_user_pages_sgt_serial(start, nr_pages, gup_flags, sgt);
+
+	for (i = 0; i < nr_chunks; i++) {
+		unsigned long first = i * chunk_pages;
+
+		INIT_WORK(&chunks[i].work, pin_chunk_work_fn);
+		chunks[i].mm = current->mm;
+		chunks[i].start = start + (first << PAGE_SHIFT);
+		chunks[i].nr_pages = min(chunk_pages, nr_pages - first);
+		chunks[i].gup_flags = gup_flags;
+		queue_work(tenstorrent_pin_wq, &chunks[i].work);
+	}
+
+	for (i = 0; i < nr_chunks; i++) {
+		flush_work(&chunks[i].work);
+		if (chunks[i].ret && !ret)
+			ret = chunks[i].ret;
+	}
+
+	// Join the chunks in address order, merging runs across their seams.
+	chained_sgt_builder_init(&builder, sgt);
+
+	for (i = 0; i < nr_chunks && !ret; i++) {
+		struct scatterlist *sg;
+		unsigned int j;
+
+		for_each_sg(chunks[i].sgt.sgl, sg, chunks[i].sgt.orig_nents, j) {
+			if (!chained_sgt_append(&builder, sg_page(sg), sg->length >> PAGE_SHIFT)) {
+				ret = -ENOMEM;
+				break;
+			}
+		}
+	}
+
+	// The pages are pinned once, through the chunk tables.
+	for (i = 0; i < nr_chunks; i++) {
+		if (chunks[i].ret == 0) {
+			if (ret)
+				unpin_sgt_pages(&chunks[i].sgt, false);
+			free_chained_sgt(&chunks[i].sgt);
+		}
+	}
+
+	kfree(chunks);
+
+	if (ret) {
+		free_chained_sgt(sgt);
+		return ret;
+	}
+
+	chained_sgt_builder_finish(&builder);
+	return 0;
+}
+
+int tenstorrent_memory_init(void)
+{
+	tenstorrent_pin_wq = alloc_workqueue("tenstorrent_pin", WQ_UNBOUND, 0);
+	if (!tenstorrent_pin_wq)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void tenstorrent_memory_exit(void)
+{
+	destroy_workqueue(tenstorrent_pin_wq);
+}
+
+#define MAX_DMA_BUF_SIZE (1u << MAX_DMA_BUF_SIZE_LOG2)
+
+// These are the mmap offsets for various resources. In the user-kernel
+// interface they are dynamic (TENSTORRENT_IOCTL_QUERY_MAPPINGS and
+// TENSTORRENT_IOCTL_ALLOCATE_DMA_BUF), but they are actually hard-coded.
+#define MMAP_OFFSET_RESOURCE0_UC	(U64_C(0) << 36)
+#define MMAP_OFFSET_RESOURCE0_WC	(U64_C(1) << 36)
+#define MMAP_OFFSET_RESOURCE1_UC	(U64_C(2) << 36)
+#define MMAP_OFFSET_RESOURCE1_WC	(U64_C(3) << 36)
+#define MMAP_OFFSET_RESOURCE2_UC	(U64_C(4) << 36)
+#define MMAP_OFFSET_RESOURCE2_WC	(U64_C(5) << 36)
+#define MMAP_OFFSET_TLB_UC		(U64_C(6) << 36)
+#define MMAP_OFFSET_TLB_WC		(U64_C(7) << 36)
+
+#define MMAP_RESOURCE_SIZE (U64_C(1) << 36)
+
+// tenstorrent_allocate_dma_buf_in.buf_index is u8 so that sets a limit of
+// U8_MAX caller-chosen DMA buffers per fd. 32-bit mmap offsets are divided by
+// PAGE_SIZE, so PAGE_SIZE << 32 is the largest possible offset.
+#define MMAP_OFFSET_DMA_BUF		((u64)(PAGE_SIZE-U8_MAX-1) << 32)
+
+// Kernel-assigned handles (TENSTORRENT_ALLOCATE_DMA_BUF_DYNAMIC_INDEX) are
+// mapped above that, so only 64-bit userspace can reach them.
+#define MMAP_OFFSET_DMA_BUF_HANDLE	((u64)PAGE_SIZE << 32)
+#define DMA_BUF_HANDLE_LIMIT		XA_LIMIT(TENSTORRENT_MAX_DMA_BUFS, (1u << 24) - 1)
+
+#define MMAP_SIZE_DMA_BUF (U64_C(1) << 32)
+
+#define PINNING_START(pinning) ((pinning)->virtual_address)
+#define PINNING_LAST(pinning) ((pinning)->virtual_address + ((u64)(pinning)->page_count << PAGE_SHIFT) - 1)
+
+INTERVAL_TREE_DEFINE(struct pinned_page_range, rb, u64, subtree_last,
+		     PINNING_START, PINNING_LAST, static, pinning_tree)
+
+// The pinning of exactly [virtual_address, virtual_address + size).
+static struct pinned_page_range *find_pinning(struct chardev_private *priv, u64 virtual_address, u64 size)
+{
+	struct pinned_page_range *pinning;
+
+	for (pinning = pinning_tree_iter_first(&priv->pinnings, virtual_address, virtual_address);
+	     pinning;
+	     pinning = pinning_tree_iter_next(pinning, virtual_address, virtual_address)) {
+		if (pinning->virtual_address == virtual_address
+		    && (u64)pinning->page_count << PAGE_SHIFT == size)
+			return pinning;
+	}
+
+	return NULL;
+}
+
+// A dma-buf attached by IMPORT_DMA_BUF, in chardev_private.dmabuf_imports.
+struct dmabuf_import {
+	struct list_head list;
+	u32 handle;
+
+	struct dma_buf_attachment *attachment;
+	struct sg_table *sgt;	// as mapped for our device by the exporter
+	int outbound_iatu_region;
+};
+
+// A PIN_MEMFD pinning, in tenstorrent_device.memfd_pinnings. It is shared by
+// every fd that pins the same range of the same file: each PIN_MEMFD holds a
+// memfd_pin_ref on it and the last one dropped unpins it.
+struct memfd_pinning {
+	struct list_head list;
+	struct list_head refs;		// struct memfd_pin_ref.pinning_list
+
+	struct file *file;		// keeps the inode, which identifies the file, alive
+	u64 offset;
+	u64 size;
+
+	// The pinned folios, one entry per physically contiguous run, with each
+	// folio pinned once (pin_memfd_sgt). DMA-mapped if dma_mapped.
+	struct sg_table sgt;
+	bool dma_mapped;
+	dma_addr_t dma_address;
+
+	int outbound_iatu_region;
+	bool stale;			// no longer shared, see find_memfd_pinning
+};
+
+struct memfd_pin_ref {
+	struct list_head list;		// in chardev_private.memfd_pins
+	struct list_head pinning_list;	// in memfd_pinning.refs
+	struct chardev_private *priv;
+	struct memfd_pinning *pinning;
+};
+
+// Clear an outbound iATU slot's bookkeeping without touching the hardware.
+static void release_outbound_iatu_slot(struct tenstorrent_device *tt_dev, int iatu_region)
+{
+	struct tenstorrent_outbound_iatu_region *region = &tt_dev->outbound_iatus[iatu_region];
+
+	lockdep_assert_held(&tt_dev->iatu_mutex);
+
+	// The identity window outlives whatever is mapped through it.
+	if (iatu_region == tt_dev->identity_iatu_region)
+		return;
+
+	if (region->space)
+		range_alloc_remove(region->space, &region->range);
+	region->space = NULL;
+	region->priv = NULL;
+	region->base = 0;
+	region->limit = 0;
+	region->target = 0;
+}
+
+static void teardown_outbound_iatu(struct chardev_private *priv, int iatu_region)
+{
+	struct tenstorrent_device *tt_dev = priv->device;
+
+	if (iatu_region < 0)
+		return;
+
+	mutex_lock(&tt_dev->iatu_mutex);
+
+	if (iatu_region != tt_dev->identity_iatu_region) {
+		if (!tt_dev->detached)
+			tt_dev->dev_class->configure_outbound_atu(tt_dev, iatu_region, 0, 0, 0);
+
+		release_outbound_iatu_slot(tt_dev, iatu_region);
+	}
+
+	mutex_unlock(&tt_dev->iatu_mutex);
+}
+
+// Reclaim outbound iATU slots from fds this reset invalidated (stale
+// open_reset_gen); a wedged process would otherwise hold them until a
+// close() that never comes.  Only the bookkeeping is released: reset leaves
+// the ATU default-clear, which is what a free slot means.  Nulling each
+// back-reference makes the stale fd's close() a no-op, so it cannot disable
+// a slot a post-reset fd has since claimed.  Caller holds reset_rwsem
+// exclusive and has already called bump_reset_gen().
+void tenstorrent_reset_reclaim_iatus(struct tenstorrent_device *tt_dev)
+{
+	long gen = atomic_long_read(&tt_dev->reset_gen);
+	struct chardev_private *priv;
+	struct pinned_page_range *pinning;
+	struct memfd_pinning *memfd_pinning;
+	struct dmabuf_import *import;
+	struct dmabuf *dmabuf;
+	struct rb_node *node;
+	unsigned long index;
+
+	mutex_lock(&tt_dev->chardev_mutex);
+	list_for_each_entry(priv, &tt_dev->open_fds_list, open_fd) {
+		if (priv->open_reset_gen == gen)
+			continue;
+
+		mutex_lock(&priv->mutex);
+		mutex_lock(&tt_dev->iatu_mutex);
+
+		xa_for_each(&priv->dmabufs, index, dmabuf) {
+			if (dmabuf->outbound_iatu_region >= 0) {
+				release_outbound_iatu_slot(tt_dev, dmabuf->outbound_iatu_region);
+				dmabuf->outbound_iatu_region = -1;
+			}
+		}
+
+		// Pinnings may share a window; releasing its slot twice is harmless.
+		for (node = rb_first_cached(&priv->pinnings); node; node = rb_next(node)) {
+			pinning = rb_entry(node, struct pinned_page_range, rb);
+			if (pinning->outbound_iatu_region >= 0) {
+				release_outbound_iatu_slot(tt_dev, pinning->outbound_iatu_region);
+				pinning->outbound_iatu_region = -1;
+				list_del_init(&pinning->window_link);
+			}
+		}
+
+		list_for_each_entry(pinning, &priv->noc_retired_pinnings, noc_retired) {
+			if (pinning->outbound_iatu_region >= 0) {
+				release_outbound_iatu_slot(tt_dev, pinning->outbound_iatu_region);
+				pinning->outbound_iatu_region = -1;
+			}
+		}
+
+		list_for_each_entry(import, &priv->dmabuf_imports, list) {
+			if (import->outbound_iatu_region >= 0) {
+				release_outbound_iatu_slot(tt_dev, import->outbound_iatu_region);
+				import->outbound_iatu_region = -1;
+			}
+		}
+
+		// With its windows gone the fd's reservation can go too; it stays
+		// marked as made, as the fd can't use it again.
+		release_iatu_reservation(priv);
+
+		mutex_unlock(&tt_dev->iatu_mutex);
+		mutex_unlock(&priv->mutex);
+	}
+
+	// Only fds this reset invalidated can hold shared memfd pinnings, as
+	// none has made an ioctl since.
+	mutex_lock(&tt_dev->memfd_pin_mutex);
+	mutex_lock(&tt_dev->iatu_mutex);
+	list_for_each_entry(memfd_pinning, &tt_dev->memfd_pinnings, list) {
+		if (memfd_pinning->outbound_iatu_region >= 0) {
+			release_outbound_iatu_slot(tt_dev, memfd_pinning->outbound_iatu_region);
+			memfd_pinning->outbound_iatu_region = -1;
+		}
+	}
+	mutex_unlock(&tt_dev->iatu_mutex);
+	mutex_unlock(&tt_dev->memfd_pin_mutex);
+
+	mutex_unlock(&tt_dev->chardev_mutex);
+}
+
+#ifdef TENSTORRENT_PIN_CACHE
+// Unpinned by userspace but kept in the cache.
+static bool pinning_is_idle(struct pinned_page_range *pinning)
+{
+	return pinning->cached && pinning->cache_users == 0;
+}
+
+static bool pinning_is_cached(struct pinned_page_range *pinning)
+{
+	return pinning->cached;
+}
+
+static void pin_cache_unregister(struct chardev_private *priv, struct pinned_page_range *pinning)
+{
+	if (!pinning->cached)
+		return;
+
+	mmu_interval_notifier_remove(&pinning->notifier);
+
+	if (!list_empty(&pinning->cache_lru)) {
+		list_del_init(&pinning->cache_lru);
+		priv->pin_cache_bytes -= (u64)pinning->page_count << PAGE_SHIFT;
+	}
+}
+#else
+static bool pinning_is_idle(struct pinned_page_range *pinning)
+{
+	return false;
+}
+
+static bool pinning_is_cached(struct pinned_page_range *pinning)
+{
+	return false;
+}
+
+static void pin_cache_unregister(struct chardev_private *priv, struct pinned_page_range *pinning)
+{
+}
+#endif
+
+// IOVA, or physical address without an IOMMU, of a byte in a pinning.
+// Without an IOMMU a TENSTORRENT_PIN_PAGES_SEGMENTED pinning may be
+// physically discontiguous, so find the run holding it.
+static u64 pinning_dma_address(struct pinned_page_range *pinning, u64 offset)
+{
+	struct scatterlist *sg;
+	unsigned int i;
+
+	if (pinning->dma_mapped)
+		return sg_dma_address(pinning->sgt.sgl) + offset;
+
+	for_each_sg(pinning->sgt.sgl, sg, pinning->sgt.orig_nents, i) {
+		if (offset < sg->length)
+			break;
+		offset -= sg->length;
+	}
+
+	return sg_phys(sg) + offset;
+}
+
+// NOC address of a byte in a pinning with a NOC window, which it may share.
+static u64 pinning_noc_address(struct tenstorrent_device *tt_dev, struct pinned_page_range *pinning, u64 offset)
+{
+	struct tenstorrent_outbound_iatu_region *region = &tt_dev->outbound_iatus[pinning->outbound_iatu_region];
+
+	return tt_dev->dev_class->noc_pcie_offset + region->base
+	       + (pinning_dma_address(pinning, 0) - region->target) + offset;
+}
+
+// Outbound iATU regions run out long before NOC address space does. When a
+// PIN_PAGES pinning's window would take the last free region, it instead
+// extends a pinning window of the same fd that its IOVA (physical address
+// without an IOMMU) range continues, see setup_pin_pages_noc_dma.
+//
+// A shared window only ever shrinks from its ends, so that the pinnings left
+// on it keep their NOC addresses. UNPIN_PAGES of a pinning it can't shrink
+// past fails with EBUSY. Where a pinning has to go anyway, on close or when
+// a pin is undone, it is retired: it leaves priv->pinnings but stays pinned
+// and mapped on priv->noc_retired_pinnings, since the device can still reach
+// it, and is freed once the window shrinks past it or goes. Cached pinnings,
+// which the driver releases on its own, never share a window.
+//
+// Each live pinning with a window other than the identity window is on
+// priv->pinning_windows[] for its region, so that only the window's own
+// pinnings are walked.
+
+static void pinning_window_add(struct chardev_private *priv, struct pinned_page_range *pinning)
+{
+	int iatu_region = pinning->outbound_iatu_region;
+
+	if (iatu_region >= 0 && iatu_region != priv->device->identity_iatu_region)
+		list_add_tail(&pinning->window_link, &priv->pinning_windows[iatu_region]);
+}
+
+// Whether a pinning other than this live one, live or retired, shares its
+// window. The identity window is everyone's.
+static bool pinning_window_shared(struct chardev_private *priv, struct pinned_page_range *pinning)
+{
+	int iatu_region = pinning->outbound_iatu_region;
+	struct pinned_page_range *other;
+
+	if (iatu_region == priv->device->identity_iatu_region
+	    || !list_is_singular(&priv->pinning_windows[iatu_region]))
+		return true;
+
+	list_for_each_entry(other, &priv->noc_retired_pinnings, noc_retired) {
+		if (other->outbound_iatu_region == iatu_region)
+			return true;
+	}
+
+	return false;
+}
+
+// The targets [*lo, *hi] that live pinnings on iatu_region cover. Returns
+// false if there are none.
+static bool pinning_window_extent(struct chardev_private *priv, int iatu_region, u64 *lo, u64 *hi)
+{
+	struct pinned_page_range *pinning;
+	bool found = false;
+	u64 target;
+
+	list_for_each_entry(pinning, &priv->pinning_windows[iatu_region], window_link) {
+		target = pinning_dma_address(pinning, 0);
+		if (!found || target < *lo)
+			*lo = target;
+		if (!found || target + ((u64)pinning->page_count << PAGE_SHIFT) - 1 > *hi)
+			*hi = target + ((u64)pinning->page_count << PAGE_SHIFT) - 1;
+		found = true;
+	}
+
+	return found;
+}
+
+// Make a pinning window translate targets [lo, hi], keeping its NOC address
+// for each target. If lo is the window's target only the limit changes.
+// Otherwise the moved window is programmed into a free region before the old
+// one is disabled, both translating the targets they share the same way, and
+// the window's pinnings follow it. Returns the window's region or a negative
+// error code, leaving the window as it was. Caller holds priv->mutex and
+// iatu_mutex.
+static int move_pinning_window(struct chardev_private *priv, int iatu_region, u64 lo, u64 hi)
+{
+	struct tenstorrent_device *tt_dev = priv->device;
+	struct tenstorrent_outbound_iatu_region *old = &tt_dev->outbound_iatus[iatu_region];
+	struct tenstorrent_outbound_iatu_region *new;
+	struct pinned_page_range *pinning;
+	u64 base = old->base + (lo - old->target);
+	u64 limit = base + (hi - lo);
+	int region;
+	int ret;
+
+	if (lo == old->target) {
+		if (limit == old->limit)
+			return iatu_region;
+
+		ret = range_alloc_resize(old->space, &old->range, base, limit);
+		if (ret)
+			return ret;
+
+		if (!tt_dev->detached) {
+			ret = tt_dev->dev_class->configure_outbound_atu(tt_dev, iatu_region, base, limit, lo);
+			if (ret) {
+				WARN_ON(range_alloc_resize(old->space, &old->range, old->base, old->limit));
+				return ret;
+			}
+		}
+
+		old->limit = limit;
+		return iatu_region;
+	}
+
+	region = find_free_outbound_iatu(tt_dev, priv);
+	if (region < 0)
+		return region;
+
+	new = &tt_dev->outbound_iatus[region];
+
+	// The moved range may overlap the old one, which makes way for it.
+	range_alloc_remove(old->space, &old->range);
+	new->space = old->space;
+	ret = range_alloc_insert_at(new->space, &new->range, base, limit);
+	if (ret)
+		goto err_restore;
+
+	if (!tt_dev->detached) {
+		ret = tt_dev->dev_class->configure_outbound_atu(tt_dev, region, base, limit, lo);
+		if (ret) {
+			range_alloc_remove(new->space, &new->range);
+			goto err_restore;
+		}
+
+		tt_dev->dev_class->configure_outbound_atu(tt_dev, iatu_region, 0, 0, 0);
+	}
+
+	new->priv = priv;
+	new->base = base;
+	new->limit = limit;
+	new->target = lo;
+	release_outbound_iatu_slot(tt_dev, iatu_region);
+
+	list_splice_init(&priv->pinning_windows[iatu_region], &priv->pinning_windows[region]);
+	list_for_each_entry(pinning, &priv->pinning_windows[region], window_link)
+		pinning->outbound_iatu_region = region;
+
+	list_for_each_entry(pinning, &priv->noc_retired_pinnings, noc_retired) {
+		if (pinning->outbound_iatu_region == iatu_region)
+			pinning->outbound_iatu_region = region;
+	}
+
+	return region;
+
+err_restore:
+	new->space = NULL;
+	WARN_ON(range_alloc_insert_at(old->space, &old->range, old->base, old->limit));
+	return ret;
+}
+
+static void release_pinning_pages(struct chardev_private *priv, struct pinned_page_range *pinning)
+{
+	enum dma_data_direction dir = pinning->read_only ? DMA_TO_DEVICE : DMA_BIDIRECTIONAL;
+
+	if (pinning->dma_mapped)
+		dma_unmap_sgtable(&priv->device->pdev->dev, &pinning->sgt, dir, 0);
+
+	unpin_sgt_pages(&pinning->sgt, !pinning->read_only);
+	free_chained_sgt(&pinning->sgt);
+}
+
+static void free_retired_pinning(struct chardev_private *priv, struct pinned_page_range *pinning)
+{
+	list_del(&pinning->noc_retired);
+	release_pinning_pages(priv, pinning);
+	kfree(pinning);
+}
+
+// Give up a pinning's share of its NOC window. The pinning has left its
+// window's list. A window left with no live pinnings goes with its retired
+// ones; otherwise it shrinks to the live pinnings as far as it can, freeing
+// the retired ones it no longer covers. Returns true if the window still
+// covers the pinning, whose region then follows the window's.
+static bool release_pinning_noc_dma(struct chardev_private *priv, struct pinned_page_range *pinning)
+{
+	struct tenstorrent_device *tt_dev = priv->device;
+	int iatu_region = pinning->outbound_iatu_region;
+	struct tenstorrent_outbound_iatu_region *region;
+	struct pinned_page_range *retired, *tmp;
+	u64 target = pinning_dma_address(pinning, 0);
+	u64 size = (u64)pinning->page_count << PAGE_SHIFT;
+	u64 lo = 0, hi = 0;
+	int ret;
+
+	if (iatu_region < 0 || iatu_region == tt_dev->identity_iatu_region)
+		return false;
+
+	if (!pinning_window_extent(priv, iatu_region, &lo, &hi)) {
+		teardown_outbound_iatu(priv, iatu_region);
+
+		list_for_each_entry_safe(retired, tmp, &priv->noc_retired_pinnings, noc_retired) {
+			if (retired->outbound_iatu_region == iatu_region)
+				free_retired_pinning(priv, retired);
+		}
+
+		return false;
+	}
+
+	mutex_lock(&tt_dev->iatu_mutex);
+
+	// Without a free region to move to, the window keeps its bottom.
+	ret = move_pinning_window(priv, iatu_region, lo, hi);
+	if (ret < 0)
+		ret = move_pinning_window(priv, iatu_region, tt_dev->outbound_iatus[iatu_region].target, hi);
+	if (ret >= 0)
+		iatu_region = ret;
+
+	region = &tt_dev->outbound_iatus[iatu_region];
+	lo = region->target;
+	hi = region->target + (region->limit - region->base);
+
+	mutex_unlock(&tt_dev->iatu_mutex);
+
+	list_for_each_entry_safe(retired, tmp, &priv->noc_retired_pinnings, noc_retired) {
+		u64 retired_target = pinning_dma_address(retired, 0);
+
+		if (retired->outbound_iatu_region == iatu_region
+		    && (retired_target > hi || retired_target + ((u64)retired->page_count << PAGE_SHIFT) - 1 < lo))
+			free_retired_pinning(priv, retired);
+	}
+
+	if (target > hi || target + size - 1 < lo)
+		return false;
+
+	pinning->outbound_iatu_region = iatu_region;
+	return true;
+}
+
+// Unpin a pinning. If its shared NOC window can't shrink past it, it is
+// retired if retire is set, and otherwise left as it was with -EBUSY.
+static int release_pinned_page_range(struct chardev_private *priv, struct pinned_page_range *pinning,
+				     bool retire)
+{
+	list_del_init(&pinning->window_link);
+
+	if (release_pinning_noc_dma(priv, pinning)) {
+		if (!retire) {
+			pinning_window_add(priv, pinning);
+			return -EBUSY;
+		}
+
+		pin_cache_unregister(priv, pinning);
+		pinning_tree_remove(pinning, &priv->pinnings);
+		list_add(&pinning->noc_retired, &priv->noc_retired_pinnings);
+		return 0;
+	}
+
+	pin_cache_unregister(priv, pinning);
+	pinning_tree_remove(pinning, &priv->pinnings);
+	release_pinning_pages(priv, pinning);
+	kfree(pinning);
+	return 0;
+}
+
+static void unpin_pinned_page_range(struct chardev_private *priv,
+	struct pinned_page_range *pinning)
+{
+	release_pinned_page_range(priv, pinning, true);
+}
+
+
+#ifdef TENSTORRENT_PIN_CACHE
+// Called with the mm's locks held, possibly mmap_lock, so this can only mark
+// the pinning stale and leave its release to pin_cache_work.
+static bool pin_cache_invalidate(struct mmu_interval_notifier *notifier,
+				 const struct mmu_notifier_range *range, unsigned long cur_seq)
+{
+	struct pinned_page_range *pinning = container_of(notifier, struct pinned_page_range, notifier);
+
+	// Protection changes, including NUMA hinting, leave the pinned pages
+	// mapped where they were.
+	if (range->event == MMU_NOTIFY_PROTECTION_VMA
+	    || range->event == MMU_NOTIFY_PROTECTION_PAGE
+	    || range->event == MMU_NOTIFY_SOFT_DIRTY)
+		return true;
+
+	mmu_interval_set_seq(notifier, cur_seq);
+	WRITE_ONCE(pinning->cache_stale, true);
+	schedule_work(&pinning->priv->pin_cache_work);
+
+	return true;
+}
+
+static const struct mmu_interval_notifier_ops pin_cache_notifier_ops = {
+	.invalidate = pin_cache_invalidate,
+};
+
+// Make a new pinning cached, before its pages are pinned so that no unmap
+// can be missed. Undone by unpin_pinned_page_range.
+static int pin_cache_register(struct chardev_private *priv, struct pinned_page_range *pinning,
+			      u64 virtual_address, u64 size)
+{
+	int ret;
+
+	ret = mmu_interval_notifier_insert(&pinning->notifier, current->mm, virtual_address, size,
+					   &pin_cache_notifier_ops);
+	if (ret)
+		return ret;
+
+	pinning->priv = priv;
+	INIT_LIST_HEAD(&pinning->cache_lru);
+	pinning->cached = true;
+	pinning->cache_users = 1;
+	return 0;
+}
+
+static bool pin_cache_hit(struct pinned_page_range *pinning, bool read_only)
+{
+	return pinning->cached && !READ_ONCE(pinning->cache_stale) && pinning->read_only == read_only;
+}
+
+static void pin_cache_get(struct chardev_private *priv, struct pinned_page_range *pinning)
+{
+	if (!list_empty(&pinning->cache_lru)) {
+		list_del_init(&pinning->cache_lru);
+		priv->pin_cache_bytes -= (u64)pinning->page_count << PAGE_SHIFT;
+	}
+
+	pinning->cache_users++;
+}
+
+// Drop the cache's oldest idle pinnings until it fits in pin_cache_mb.
+static void pin_cache_trim(struct chardev_private *priv)
+{
+	u64 limit = (u64)READ_ONCE(pin_cache_mb) << 20;
+
+	while (priv->pin_cache_bytes > limit)
+		unpin_pinned_page_range(priv, list_last_entry(&priv->pin_cache_lru,
+							      struct pinned_page_range, cache_lru));
+}
+
+// UNPIN_PAGES of any pinning. A cached one is kept once idle unless stale.
+static void pin_cache_put(struct chardev_private *priv, struct pinned_page_range *pinning)
+{
+	if (pinning->cached && --pinning->cache_users > 0)
+		return;
+
+	if (!pinning->cached || READ_ONCE(pinning->cache_stale)) {
+		unpin_pinned_page_range(priv, pinning);
+		return;
+	}
+
+	list_add(&pinning->cache_lru, &priv->pin_cache_lru);
+	priv->pin_cache_bytes += (u64)pinning->page_count << PAGE_SHIFT;
+	pin_cache_trim(priv);
+}
+
+// Release idle pinnings holding NOC windows so that a new pinning can have
+// one. Returns whether any were released.
+static bool pin_cache_evict_noc(struct chardev_private *priv)
+{
+	struct pinned_page_range *pinning, *tmp;
+	bool evicted = false;
+
+	list_for_each_entry_safe(pinning, tmp, &priv->pin_cache_lru, cache_lru) {
+		if (pinning->outbound_iatu_region >= 0
+		    && pinning->outbound_iatu_region != priv->device->identity_iatu_region) {
+			unpin_pinned_page_range(priv, pinning);
+			evicted = true;
+		}
+	}
+
+	return evicted;
+}
+
+static void pin_cache_work_fn(struct work_struct *work)
+{
+	struct chardev_private *priv = container_of(work, struct chardev_private, pin_cache_work);
+	struct pinned_page_range *pinning, *tmp;
+
+	mutex_lock(&priv->mutex);
+	list_for_each_entry_safe(pinning, tmp, &priv->pin_cache_lru, cache_lru) {
+		if (READ_ONCE(pinning->cache_stale))
+			unpin_pinned_page_range(priv, pinning);
+	}
+	mutex_unlock(&priv->mutex);
+}
+#else
+static int pin_cache_register(struct chardev_private *priv, struct pinned_page_range *pinning,
+			      u64 virtual_address, u64 size)
+{
+	return -EOPNOTSUPP;
+}
+
+static bool pin_cache_hit(struct pinned_page_range *pinning, bool read_only)
+{
+	return false;
+}
+
+static void pin_cache_get(struct chardev_private *priv, struct pinned_page_range *pinning)
+{
+}
+
+static void pin_cache_put(struct chardev_private *priv, struct pinned_page_range *pinning)
+{
+	unpin_pinned_page_range(priv, pinning);
+}
+
+static bool pin_cache_evict_noc(struct chardev_private *priv)
+{
+	return false;
+}
+
+static void pin_cache_work_fn(struct work_struct *work)
+{
+}
+#endif
+
+void tenstorrent_pin_cache_init(struct chardev_private *priv)
+{
+	INIT_LIST_HEAD(&priv->pin_cache_lru);
+	INIT_WORK(&priv->pin_cache_work, pin_cache_work_fn);
+}
+
+// setup_noc_dma for a pinning, retried after idle cached pinnings give up
+// their windows if none was available.
+static int setup_pinning_noc_dma(struct chardev_private *priv, bool fd_local, bool top_down, u64 size,
+				 u64 target, u64 *noc_address)
+{
+	int ret = setup_noc_dma(priv, fd_local, top_down, 1, size, target, noc_address);
+
+	if ((ret == -ENOSPC || ret == -ENOMEM) && pin_cache_evict_noc(priv))
+		ret = setup_noc_dma(priv, fd_local, top_down, 1, size, target, noc_address);
+
+	return ret;
+}
+
+// Extend a pinning window of priv's that [target, target + size) continues,
+// above or below, to cover it. Returns the window's region or a negative
+// error code, -ENOENT if no window is adjacent. Caller holds priv->mutex.
+static int coalesce_pinning_noc_dma(struct chardev_private *priv, u64 size, u64 target, u64 *noc_address)
+{
+	struct tenstorrent_device *tt_dev = priv->device;
+	struct tenstorrent_outbound_iatu_region *region;
+	struct pinned_page_range *first;
+	u64 window_last;
+	int ret = -ENOENT;
+	int i;
+
+	mutex_lock(&tt_dev->iatu_mutex);
+
+	for (i = 0; i < TENSTORRENT_MAX_OUTBOUND_IATU_REGIONS; ++i) {
+		first = list_first_entry_or_null(&priv->pinning_windows[i], struct pinned_page_range, window_link);
+		if (!first || pinning_is_cached(first))
+			continue;
+
+		region = &tt_dev->outbound_iatus[i];
+		window_last = region->target + (region->limit - region->base);
+
+		if (window_last + 1 == target)
+			ret = move_pinning_window(priv, i, region->target, target + size - 1);
+		else if (target + size == region->target)
+			ret = move_pinning_window(priv, i, target, window_last);
+		else
+			continue;
+
+		if (ret >= 0) {
+			region = &tt_dev->outbound_iatus[ret];
+			*noc_address = tt_dev->dev_class->noc_pcie_offset + region->base + (target - region->target);
+			break;
+		}
+	}
+
+	mutex_unlock(&tt_dev->iatu_mutex);
+	return ret;
+}
+
+// setup_pinning_noc_dma for PIN_PAGES. Rather than take the last free
+// region, a pinning that may share a window (not a cached one) extends an
+// adjacent window if it can, which leaves that region free for moving
+// windows.
+static int setup_pin_pages_noc_dma(struct chardev_private *priv, bool shareable, bool top_down, u64 size,
+				   u64 target, u64 *noc_address)
+{
+	struct tenstorrent_device *tt_dev = priv->device;
+	unsigned int nr_free = 0;
+	bool identity;
+	int ret;
+	int i;
+
+	mutex_lock(&tt_dev->iatu_mutex);
+	identity = identity_noc_dma(tt_dev, size, target, noc_address);
+	for (i = 0; i < TENSTORRENT_MAX_OUTBOUND_IATU_REGIONS; ++i) {
+		if (outbound_iatu_is_usable(tt_dev, i, priv))
+			nr_free++;
+	}
+	mutex_unlock(&tt_dev->iatu_mutex);
+
+	if (shareable && nr_free <= 1 && !identity) {
+		ret = coalesce_pinning_noc_dma(priv, size, target, noc_address);
+		if (ret >= 0)
+			return ret;
+	}
+
+	return setup_pinning_noc_dma(priv, true, top_down, size, target, noc_address);
+}
+
+struct peer_resource_mapping {
+	struct list_head list;
+
+	dma_addr_t mapped_address;
+	size_t size;
+};
+
+// This replaces tenstorrent_query_mappings from ioctl.h with a version
+// that uses a flexible array member rather than a zero-length array.
+// This keeps UBSAN from triggering when we write the output mappings.
+struct tenstorrent_query_mappings_flex {
+	struct tenstorrent_query_mappings_in in;
+	struct tenstorrent_mapping out_mappings[];
+};
+
+long ioctl_query_mappings(struct chardev_private *priv,
+			  struct tenstorrent_query_mappings __user *arg_)
+{
+	struct tenstorrent_query_mappings_flex __user *arg = (struct tenstorrent_query_mappings_flex __user *)arg_;
+
+	struct tenstorrent_mapping mappings[6];
+	struct tenstorrent_mapping *next_mapping;
+
+	u32 valid_mappings_to_copy;
+	u32 extra_mappings_to_clear;
+	u32 valid_mappings;
+
+	resource_size_t resource_len;
+
+	struct tenstorrent_query_mappings_in in;
+	if (copy_from_user(&in, &arg->in, sizeof(in)) != 0)
+		return -EFAULT;
+
+	memset(mappings, 0, sizeof(mappings));
+	next_mapping = mappings;
+
+	resource_len = pci_resource_len(priv->device->pdev, 0);
+	if (resource_len > 0) {
+		next_mapping->mapping_id = TENSTORRENT_MAPPING_RESOURCE0_UC;
+		next_mapping->mapping_base = MMAP_OFFSET_RESOURCE0_UC;
+		next_mapping->mapping_size = resource_len;
+		next_mapping++;
+
+		next_mapping->mapping_id = TENSTORRENT_MAPPING_RESOURCE0_WC;
+		next_mapping->mapping_base = MMAP_OFFSET_RESOURCE0_WC;
+		next_mapping->mapping_size = resource_len;
+		next_mapping++;
+	}
+
+	resource_len = pci_resource_len(priv->device->pdev, 2);
+	if (resource_len > 0) {
+		next_mapping->mapping_id = TENSTORRENT_MAPPING_RESOURCE1_UC;
+		next_mapping->mapping_base = MMAP_OFFSET_RESOURCE1_UC;
+		next_mapping->mapping_size = resource_len;
+		next_mapping++;
+
+		next_mapping->mapping_id = TENSTORRENT_MAPPING_RESOURCE1_WC;
+		next_mapping->mapping_base = MMAP_OFFSET_RESOURCE1_WC;
+		next_mapping->mapping_size = resource_len;
+		next_mapping++;
+	}
+
+	resource_len = pci_resource_len(priv->device->pdev, 4);
+	if (resource_len > 0) {
+		next_mapping->mapping_id = TENSTORRENT_MAPPING_RESOURCE2_UC;
+		next_mapping->mapping_base = MMAP_OFFSET_RESOURCE2_UC;
+		next_mapping->mapping_size = resource_len;
+		next_mapping++;
+
+		next_mapping->mapping_id = TENSTORRENT_MAPPING_RESOURCE2_WC;
+		next_mapping->mapping_base = MMAP_OFFSET_RESOURCE2_WC;
+		next_mapping->mapping_size = resource_len;
+		next_mapping++;
+	}
+
+	valid_mappings = next_mapping - mappings;
+
+	valid_mappings_to_copy = min(in.output_mapping_count, valid_mappings);
+	extra_mappings_to_clear = (in.output_mapping_count > valid_mappings)
+		? in.output_mapping_count - valid_mappings : 0;
+
+	if (U32_MAX / sizeof(struct tenstorrent_mapping) < extra_mappings_to_clear)
+		return -EFAULT;
+
+	if (copy_to_user(&arg->out_mappings, &mappings,
+			 valid_mappings_to_copy * sizeof(struct tenstorrent_mapping)))
+		return -EFAULT;
+
+	if (clear_user(&arg->out_mappings[valid_mappings_to_copy],
+		       extra_mappings_to_clear * sizeof(struct tenstorrent_mapping)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static struct dmabuf *lookup_dmabuf_by_index(struct chardev_private *priv, u32 buf_index) {
+	lockdep_assert_held(&priv->dmabuf_mutex);
+
+	return xa_load(&priv->dmabufs, buf_index);
+}
+
+static u64 dmabuf_mapping_start(u32 buf_index) {
+	if (buf_index < TENSTORRENT_MAX_DMA_BUFS)
+		return MMAP_OFFSET_DMA_BUF + buf_index * MMAP_SIZE_DMA_BUF;
+	else
+		return MMAP_OFFSET_DMA_BUF_HANDLE + buf_index * MMAP_SIZE_DMA_BUF;
+}
+
+unsigned int tenstorrent_max_dma_buf_size_log2(struct tenstorrent_device *tt_dev)
+{
+	if (tt_dev->dma_buf_pool_size > MAX_DMA_BUF_SIZE)
+		return min_t(unsigned int, ilog2(tt_dev->dma_buf_pool_size), MAX_POOL_DMA_BUF_SIZE_LOG2);
+
+	return MAX_DMA_BUF_SIZE_LOG2;
+}
+
+void tenstorrent_dma_buf_pool_init(struct tenstorrent_device *tt_dev)
+{
+	struct device *dev = &tt_dev->pdev->dev;
+	size_t size = (size_t)dma_buf_pool_mb << 20;
+	struct gen_pool *pool;
+	dma_addr_t dma_handle;
+	void *ptr;
+
+	if (size == 0 || !tt_dev->dma_capable)
+		return;
+
+	pool = gen_pool_create(PAGE_SHIFT, dev_to_node(dev));
+	if (!pool)
+		return;
+
+	// FORCE_CONTIGUOUS keeps the pool physically contiguous even behind an
+	// IOMMU, so any piece of it can be handed out as one coherent buffer.
+	ptr = dma_alloc_attrs(dev, size, &dma_handle, GFP_KERNEL | __GFP_NOWARN,
+			      DMA_ATTR_FORCE_CONTIGUOUS);
+	if (!ptr) {
+		dev_warn(dev, "Could not reserve %u MiB DMA buffer pool, check the cma= boot parameter.\n",
+			 dma_buf_pool_mb);
+		gen_pool_destroy(pool);
+		return;
+	}
+
+	if (gen_pool_add_virt(pool, (unsigned long)ptr, dma_handle, size, dev_to_node(dev)) < 0) {
+		dma_free_attrs(dev, size, ptr, dma_handle, DMA_ATTR_FORCE_CONTIGUOUS);
+		gen_pool_destroy(pool);
+		return;
+	}
+
+	tt_dev->dma_buf_pool = pool;
+	tt_dev->dma_buf_pool_ptr = ptr;
+	tt_dev->dma_buf_pool_dma = dma_handle;
+	tt_dev->dma_buf_pool_size = size;
+
+	dev_info(dev, "Reserved %u MiB DMA buffer pool.\n", dma_buf_pool_mb);
+}
+
+// Every pool buffer has been freed by now: each holds a reference to its
+// fd's file (directly or through a VMA), and the fd holds the device.
+void tenstorrent_dma_buf_pool_destroy(struct tenstorrent_device *tt_dev)
+{
+	if (!tt_dev->dma_buf_pool)
+		return;
+
+	gen_pool_destroy(tt_dev->dma_buf_pool);
+	dma_free_attrs(&tt_dev->pdev->dev, tt_dev->dma_buf_pool_size,
+		       tt_dev->dma_buf_pool_ptr, tt_dev->dma_buf_pool_dma,
+		       DMA_ATTR_FORCE_CONTIGUOUS);
+	tt_dev->dma_buf_pool = NULL;
+}
+
+struct cached_dma_buf {
+	struct list_head list;	// tenstorrent_device.dma_buf_cache[]
+	void *ptr;
+	dma_addr_t dma_handle;
+	u64 size;
+};
+
+void tenstorrent_dma_buf_cache_init(struct tenstorrent_device *tt_dev)
+{
+	unsigned int i;
+
+	spin_lock_init(&tt_dev->dma_buf_cache_lock);
+	for (i = 0; i < ARRAY_SIZE(tt_dev->dma_buf_cache); i++)
+		INIT_LIST_HEAD(&tt_dev->dma_buf_cache[i]);
+}
+
+// Free every cached buffer and stop caching new ones.
+void tenstorrent_dma_buf_cache_flush(struct tenstorrent_device *tt_dev)
+{
+	struct cached_dma_buf *entry, *tmp;
+	LIST_HEAD(freed);
+	unsigned int i;
+
+	spin_lock(&tt_dev->dma_buf_cache_lock);
+	tt_dev->dma_buf_cache_disabled = true;
+	for (i = 0; i < ARRAY_SIZE(tt_dev->dma_buf_cache); i++)
+		list_splice_init(&tt_dev->dma_buf_cache[i], &freed);
+	tt_dev->dma_buf_cache_bytes = 0;
+	spin_unlock(&tt_dev->dma_buf_cache_lock);
+
+	list_for_each_entry_safe(entry, tmp, &freed, list) {
+		dma_free_coherent(&tt_dev->pdev->dev, entry->size, entry->ptr, entry->dma_handle);
+		kfree(entry);
+	}
+}
+
+static void *dma_buf_cache_take(struct tenstorrent_device *tt_dev, u64 size, dma_addr_t *dma_handle)
+{
+	struct list_head *bucket = &tt_dev->dma_buf_cache[order_base_2(size)];
+	struct cached_dma_buf *entry;
+	void *ptr = NULL;
+
+	spin_lock(&tt_dev->dma_buf_cache_lock);
+	list_for_each_entry(entry, bucket, list) {
+		if (entry->size == size) {
+			list_del(&entry->list);
+			tt_dev->dma_buf_cache_bytes -= size;
+			ptr = entry->ptr;
+			*dma_handle = entry->dma_handle;
+			break;
+		}
+	}
+	spin_unlock(&tt_dev->dma_buf_cache_lock);
+
+	if (!ptr)
+		return NULL;
+
+	kfree(entry);
+
+	// The previous owner may have been another process.
+	memset(ptr, 0, size);
+	return ptr;
+}
+
+// Return true if the cache took ownership of the buffer.
+static bool dma_buf_cache_put(struct tenstorrent_device *tt_dev, void *ptr, dma_addr_t dma_handle, u64 size)
+{
+	u64 limit = (u64)dma_buf_cache_mb << 20;
+	struct cached_dma_buf *entry;
+	bool cached = false;
+
+	if (size > limit)
+		return false;
+
+	entry = kmalloc(sizeof(*entry), GFP_KERNEL);
+	if (!entry)
+		return false;
+
+	entry->ptr = ptr;
+	entry->dma_handle = dma_handle;
+	entry->size = size;
+
+	spin_lock(&tt_dev->dma_buf_cache_lock);
+	if (!tt_dev->dma_buf_cache_disabled && tt_dev->dma_buf_cache_bytes + size <= limit) {
+		list_add(&entry->list, &tt_dev->dma_buf_cache[order_base_2(size)]);
+		tt_dev->dma_buf_cache_bytes += size;
+		cached = true;
+	}
+	spin_unlock(&tt_dev->dma_buf_cache_lock);
+
+	if (!cached)
+		kfree(entry);
+
+	return cached;
+}
+
+// pages is zeroed past the last allocated page.
+static void free_dma_buf_page_array(struct page **pages, unsigned long page_count)
+{
+	unsigned long i;
+
+	for (i = 0; i < page_count && pages[i]; i++)
+		__free_page(pages[i]);
+
+	kvfree(pages);
+}
+
+static void free_dma_buf_pages(struct tenstorrent_device *tt_dev, struct dmabuf *dmabuf)
+{
+	dma_unmap_sgtable(&tt_dev->pdev->dev, &dmabuf->dma_mapping, DMA_BIDIRECTIONAL, 0);
+	free_chained_sgt(&dmabuf->dma_mapping);
+	free_dma_buf_page_array(dmabuf->pages, dmabuf->size >> PAGE_SHIFT);
+}
+
+// Fill pages with zeroed memory from node, or preferably from the device's
+// node if node is NUMA_NO_NODE. Behind an IOMMU the pages need only be
+// contiguous in IOVA, so large chunks are preferred but not required.
+// Without one the buffer must be a single physically contiguous allocation.
+static int alloc_dma_buf_page_array(struct tenstorrent_device *tt_dev, struct page **pages,
+				    unsigned long page_count, int node)
+{
+	gfp_t gfp = GFP_KERNEL | __GFP_NOWARN | __GFP_ZERO;
+	unsigned int order;
+	struct page *page;
+	unsigned long i = 0;
+	unsigned long j;
+
+	if (node == NUMA_NO_NODE)
+		node = dev_to_node(&tt_dev->pdev->dev);
+	else
+		gfp |= __GFP_THISNODE;
+
+	if (!is_iommu_translated(&tt_dev->pdev->dev)) {
+		order = get_order(page_count << PAGE_SHIFT);
+		page = alloc_pages_node(node, gfp, order);
+		if (!page)
+			return -ENOMEM;
+
+		split_page(page, order);
+		for (j = page_count; j < 1UL << order; j++)
+			__free_page(page + j);
+		for (j = 0; j < page_count; j++)
+			pages[j] = page + j;
+
+		return 0;
+	}
+
+	order = PMD_SHIFT - PAGE_SHIFT;
+	while (i < page_count) {
+		while (order > 0 && (1UL << order) > page_count - i)
+			order--;
+
+		page = alloc_pages_node(node, order ? gfp | __GFP_NORETRY : gfp, order);
+		if (!page) {
+			if (order == 0)
+				return -ENOMEM;
+			order--;
+			continue;
+		}
+
+		split_page(page, order);
+		for (j = 0; j < 1UL << order; j++)
+			pages[i++] = page + j;
+	}
+
+	return 0;
+}
+
+// Allocate a buffer from pages and map it for streaming DMA. The device must
+// see it as one contiguous range. Unless the buffer is cacheable, in which case
+// userspace uses SYNC_DMA_BUF, the CPU must not need to sync it.
+static int alloc_dma_buf_pages(struct tenstorrent_device *tt_dev, struct dmabuf *dmabuf,
+			       int node, bool cacheable)
+{
+	struct device *dev = &tt_dev->pdev->dev;
+	unsigned long page_count = dmabuf->size >> PAGE_SHIFT;
+	dma_addr_t expected_next_address = 0;
+	struct scatterlist *sg;
+	unsigned int i;
+	int ret;
+
+	dmabuf->pages = kvcalloc(page_count, sizeof(*dmabuf->pages), GFP_KERNEL);
+	if (!dmabuf->pages)
+		return -ENOMEM;
+
+	ret = alloc_dma_buf_page_array(tt_dev, dmabuf->pages, page_count, node);
+	if (ret)
+		goto err_free_pages;
+
+	if (!alloc_chained_sgt_for_pages(&dmabuf->dma_mapping, dmabuf->pages, page_count)) {
+		ret = -ENOMEM;
+		goto err_free_pages;
+	}
+
+	ret = dma_map_sgtable(dev, &dmabuf->dma_mapping, DMA_BIDIRECTIONAL, 0);
+	if (ret)
+		goto err_free_sgt;
+
+	for_each_sgtable_dma_sg((&dmabuf->dma_mapping), sg, i) {
+		if (i > 0 && sg_dma_address(sg) != expected_next_address) {
+			ret = -ENOMEM;
+			goto err_dma_unmap;
+		}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+		if (!cacheable && dma_need_sync(dev, sg_dma_address(sg))) {
+			ret = -EOPNOTSUPP;
+			goto err_dma_unmap;
+		}
+#endif
+		expected_next_address = sg_dma_address(sg) + sg_dma_len(sg);
+	}
+
+	dmabuf->backing = DMABUF_PAGES;
+	dmabuf->ptr = NULL;
+	dmabuf->phys = sg_dma_address(dmabuf->dma_mapping.sgl);
+	return 0;
+
+err_dma_unmap:
+	dma_unmap_sgtable(dev, &dmabuf->dma_mapping, DMA_BIDIRECTIONAL, 0);
+err_free_sgt:
+	free_chained_sgt(&dmabuf->dma_mapping);
+err_free_pages:
+	free_dma_buf_page_array(dmabuf->pages, page_count);
+	dmabuf->pages = NULL;
+	return ret;
+}
+
+// Buffers that dma_alloc_coherent handles come from the cache or from it,
+// larger ones from the device's pool, and cacheable ones or those for an
+// explicit NUMA node from pages. Either way the memory is zeroed.
+//
+// Behind an IOMMU dma_alloc_coherent builds large buffers from scattered
+// pages that it vmaps, so where userspace can map PMD entries and asked for
+// huge pages such buffers are allocated from PMD-sized pages if possible.
+static int alloc_dma_buf_memory(struct tenstorrent_device *tt_dev, struct dmabuf *dmabuf,
+				int node, u8 flags)
+{
+	u64 size = dmabuf->size;
+	u64 offset;
+
+	if (node != NUMA_NO_NODE || (flags & TENSTORRENT_ALLOCATE_DMA_BUF_CACHEABLE))
+		return alloc_dma_buf_pages(tt_dev, dmabuf, node, flags & TENSTORRENT_ALLOCATE_DMA_BUF_CACHEABLE);
+
+#ifdef TENSTORRENT_DMA_BUF_PMD_MAPPINGS
+	if ((flags & TENSTORRENT_ALLOCATE_DMA_BUF_HUGE_PAGES)
+	    && size >= PMD_SIZE && size <= MAX_DMA_BUF_SIZE
+	    && is_iommu_translated(&tt_dev->pdev->dev)
+	    && alloc_dma_buf_pages(tt_dev, dmabuf, node, false) == 0)
+		return 0;
+#endif
+
+	if (size <= MAX_DMA_BUF_SIZE) {
+		dmabuf->backing = DMABUF_COHERENT;
+		dmabuf->ptr = dma_buf_cache_take(tt_dev, size, &dmabuf->phys);
+		if (!dmabuf->ptr)
+			dmabuf->ptr = dma_alloc_coherent(&tt_dev->pdev->dev, size, &dmabuf->phys, GFP_KERNEL);
+
+		return dmabuf->ptr ? 0 : -ENOMEM;
+	}
+
+	if (!tt_dev->dma_buf_pool)
+		return -ENOMEM;
+
+	dmabuf->backing = DMABUF_POOL;
+	dmabuf->ptr = gen_pool_dma_alloc(tt_dev->dma_buf_pool, size, &dmabuf->phys);
+	if (!dmabuf->ptr)
+		return -ENOMEM;
+
+	for (offset = 0; offset < size; offset += MAX_DMA_BUF_SIZE) {
+		memset(dmabuf->ptr + offset, 0, min_t(u64, size - offset, MAX_DMA_BUF_SIZE));
+		cond_resched();
+	}
+
+	return 0;
+}
+
+static void free_dma_buf_memory(struct tenstorrent_device *tt_dev, struct dmabuf *dmabuf)
+{
+	switch (dmabuf->backing) {
+	case DMABUF_COHERENT:
+		if (!dma_buf_cache_put(tt_dev, dmabuf->ptr, dmabuf->phys, dmabuf->size))
+			dma_free_coherent(&tt_dev->pdev->dev, dmabuf->size, dmabuf->ptr, dmabuf->phys);
+		break;
+	case DMABUF_POOL:
+		gen_pool_free(tt_dev->dma_buf_pool, (unsigned long)dmabuf->ptr, dmabuf->size);
+		break;
+	case DMABUF_PAGES:
+		free_dma_buf_pages(tt_dev, dmabuf);
+		break;
+	}
+}
+
+static void release_dmabuf(struct kref *kref)
+{
+	struct dmabuf *dmabuf = container_of(kref, struct dmabuf, kref);
+
+	free_dma_buf_memory(dmabuf->device, dmabuf);
+	kfree(dmabuf);
+}
+
+#ifdef TENSTORRENT_DMA_BUF_PMD_MAPPINGS
+static unsigned long dmabuf_pfn(struct dmabuf *dmabuf, pgoff_t pgoff)
+{
+	if (dmabuf->backing == DMABUF_PAGES)
+		return page_to_pfn(dmabuf->pages[pgoff]);
+
+	return page_to_pfn(virt_to_page(dmabuf->ptr)) + pgoff;
+}
+
+// Userspace can map a buffer with PMD entries if each PMD_SIZE piece of it is
+// naturally aligned and physically contiguous, and the CPU accesses it with
+// default attributes. dma_alloc_coherent memory outside the linear map has
+// been remapped with attributes we don't know, and memory-encrypted systems
+// may share DMA memory decrypted.
+static bool dmabuf_pmd_mappable(struct dmabuf *dmabuf)
+{
+	const unsigned long pmd_pages = PMD_SIZE >> PAGE_SHIFT;
+	unsigned long whole_pages = round_down(dmabuf->size >> PAGE_SHIFT, pmd_pages);
+	unsigned long i;
+
+	if (dmabuf->size < PMD_SIZE || cc_platform_has(CC_ATTR_MEM_ENCRYPT))
+		return false;
+
+	if (dmabuf->backing != DMABUF_PAGES)
+		return virt_addr_valid(dmabuf->ptr) && IS_ALIGNED(dmabuf_pfn(dmabuf, 0), pmd_pages);
+
+	for (i = 0; i < whole_pages; i++) {
+		unsigned long pfn = dmabuf_pfn(dmabuf, i);
+
+		if (i % pmd_pages == 0 ? !IS_ALIGNED(pfn, pmd_pages) : pfn != dmabuf_pfn(dmabuf, i - 1) + 1)
+			return false;
+	}
+
+	return true;
+}
+
+// For pmd_mappable buffers. vma->vm_private_data is the buffer and
+// vma->vm_pgoff the page offset within it.
+static vm_fault_t dmabuf_vma_fault(struct vm_fault *vmf)
+{
+	struct dmabuf *dmabuf = vmf->vma->vm_private_data;
+
+	if (vmf->pgoff >= dmabuf->size >> PAGE_SHIFT)
+		return VM_FAULT_SIGBUS;
+
+	return vmf_insert_pfn(vmf->vma, vmf->address, dmabuf_pfn(dmabuf, vmf->pgoff));
+}
+
+static vm_fault_t dmabuf_vma_huge_fault(struct vm_fault *vmf, unsigned int order)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct dmabuf *dmabuf = vma->vm_private_data;
+	unsigned long addr = vmf->address & PMD_MASK;
+	unsigned long pfn;
+	pgoff_t pgoff;
+
+	if (order != PMD_ORDER || addr < vma->vm_start || addr + PMD_SIZE > vma->vm_end)
+		return VM_FAULT_FALLBACK;
+
+	// Pieces not at a PMD_SIZE offset in the buffer aren't aligned, and a
+	// partial piece at the end needn't be contiguous.
+	pgoff = vma->vm_pgoff + ((addr - vma->vm_start) >> PAGE_SHIFT);
+	if (!IS_ALIGNED(pgoff, PMD_SIZE >> PAGE_SHIFT)
+	    || ((u64)pgoff << PAGE_SHIFT) + PMD_SIZE > dmabuf->size)
+		return VM_FAULT_FALLBACK;
+
+	pfn = dmabuf_pfn(dmabuf, pgoff);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 17, 0)
+	return vmf_insert_pfn_pmd(vmf, pfn, vmf->flags & FAULT_FLAG_WRITE);
+#else
+	return vmf_insert_pfn_pmd(vmf, __pfn_to_pfn_t(pfn, PFN_DEV), vmf->flags & FAULT_FLAG_WRITE);
+#endif
+}
+#else
+static bool dmabuf_pmd_mappable(struct dmabuf *dmabuf)
+{
+	return false;
+}
+#endif
+
+// Mapped on fault. Private mappings would be COW, which PFN maps can't do at
+// PMD level, so those are mapped up front like any other buffer.
+static bool dmabuf_mapped_on_fault(struct dmabuf *dmabuf, struct vm_area_struct *vma)
+{
+#ifdef TENSTORRENT_DMA_BUF_PMD_MAPPINGS
+	return dmabuf->pmd_mappable && !is_cow_mapping(vma->vm_flags);
+#else
+	return false;
+#endif
+}
+
+// vma->vm_pgoff is the page offset within the buffer. If
+// dmabuf_mapped_on_fault, the VMA's ops must include dmabuf_vma_fault and
+// dmabuf_vma_huge_fault, with the buffer as vma->vm_private_data. Other
+// mappings must not have them: vmf_insert_pfn can't refill a VM_MIXEDMAP
+// mapping of struct pages, so such faults (after MADV_DONTNEED, say) are left
+// to raise SIGBUS.
+static int mmap_dmabuf_memory(struct dmabuf *dmabuf, struct vm_area_struct *vma)
+{
+	if (dmabuf_mapped_on_fault(dmabuf, vma)) {
+		vm_flags_set(vma, VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP);
+		return 0;
+	}
+
+	if (dmabuf->backing == DMABUF_PAGES)
+		return vm_map_pages(vma, dmabuf->pages, dmabuf->size >> PAGE_SHIFT);
+
+	// A pool buffer is a piece of one FORCE_CONTIGUOUS allocation, which the
+	// DMA API can map in part.
+	return dma_mmap_attrs(&dmabuf->device->pdev->dev, vma, dmabuf->ptr, dmabuf->phys, dmabuf->size,
+			      dmabuf->backing == DMABUF_POOL ? DMA_ATTR_FORCE_CONTIGUOUS : 0);
+}
+
+long ioctl_allocate_dma_buf(struct chardev_private *priv,
+			    struct tenstorrent_allocate_dma_buf __user *arg)
+{
+	struct dmabuf *dmabuf;
+	long ret = 0;
+	int iatu_region = -1;
+	int node = NUMA_NO_NODE;
+	u32 index = 0;
+	u64 size;
+
+	struct tenstorrent_allocate_dma_buf_in in;
+	struct tenstorrent_allocate_dma_buf_out out;
+	memset(&in, 0, sizeof(in));
+	memset(&out, 0, sizeof(out));
+
+	if (copy_from_user(&in, &arg->in, sizeof(in)) != 0)
+		return -EFAULT;
+
+	if (!priv->device->dma_capable)
+		return -EINVAL;
+
+	if (in.flags & TENSTORRENT_ALLOCATE_DMA_BUF_DYNAMIC_INDEX)
+		in.buf_index = 0;
+	else if (in.buf_index >= TENSTORRENT_MAX_DMA_BUFS)
+		return -EINVAL;
+
+	size = in.requested_size | (u64)in.requested_size_hi << 32;
+	if (size % PAGE_SIZE != 0
+	    || size == 0
+	    || size > U64_C(1) << tenstorrent_max_dma_buf_size_log2(priv->device))
+		return -EINVAL;
+
+	// Placement flags refine NOC_DMA; a fixed address must meet the alignment.
+	if (!(in.flags & TENSTORRENT_ALLOCATE_DMA_BUF_NOC_DMA)
+	    && ((in.flags & (TENSTORRENT_ALLOCATE_DMA_BUF_NOC_BOTTOM_UP | TENSTORRENT_ALLOCATE_DMA_BUF_NOC_FIXED))
+		|| in.noc_align_log2 != 0))
+		return -EINVAL;
+
+	if (in.noc_align_log2 >= 64
+	    || ((in.flags & TENSTORRENT_ALLOCATE_DMA_BUF_NOC_FIXED)
+		&& !IS_ALIGNED(in.noc_address, U64_C(1) << in.noc_align_log2)))
+		return -EINVAL;
+
+	if (in.flags & TENSTORRENT_ALLOCATE_DMA_BUF_NUMA_NODE) {
+		if (in.numa_node >= nr_node_ids || !node_online(in.numa_node))
+			return -EINVAL;
+		node = in.numa_node;
+	}
+
+	mutex_lock(&priv->mutex);
+
+	// Reserve the index; lookups see NULL until the buffer is stored below.
+	mutex_lock(&priv->dmabuf_mutex);
+	if (in.flags & TENSTORRENT_ALLOCATE_DMA_BUF_DYNAMIC_INDEX) {
+		ret = xa_alloc(&priv->dmabufs, &index, NULL, DMA_BUF_HANDLE_LIMIT, GFP_KERNEL);
+		if (ret == -EBUSY)
+			ret = -ENOSPC;
+	} else {
+		index = in.buf_index;
+		ret = xa_insert(&priv->dmabufs, index, NULL, GFP_KERNEL);
+		if (ret == -EBUSY)
+			ret = -EINVAL;
+	}
+	mutex_unlock(&priv->dmabuf_mutex);
+
+	if (ret)
+		goto out;
+
+	dmabuf = kzalloc(sizeof(*dmabuf), GFP_KERNEL);
+	if (!dmabuf) {
+		ret = -ENOMEM;
+		goto out_release_index;
+	}
+
+	dmabuf->size = size;
+	ret = alloc_dma_buf_memory(priv->device, dmabuf, node, in.flags);
+	if (ret) {
+		kfree(dmabuf);
+		goto out_release_index;
+	}
+
+	if (in.flags & TENSTORRENT_ALLOCATE_DMA_BUF_NOC_DMA) {
+		if (in.flags & TENSTORRENT_ALLOCATE_DMA_BUF_NOC_FIXED) {
+			out.noc_address = in.noc_address;
+			ret = setup_noc_dma_fixed(priv, in.noc_address, size, dmabuf->phys);
+		} else {
+			bool top_down = !(in.flags & TENSTORRENT_ALLOCATE_DMA_BUF_NOC_BOTTOM_UP);
+			ret = setup_noc_dma(priv, true, top_down, U64_C(1) << in.noc_align_log2, size, dmabuf->phys,
+					    &out.noc_address);
+		}
+		if (ret < 0) {
+			free_dma_buf_memory(priv->device, dmabuf);
+			kfree(dmabuf);
+			goto out_release_index;
+		}
+		iatu_region = ret;
+		ret = 0;
+	}
+
+	kref_init(&dmabuf->kref);
+	dmabuf->device = priv->device;
+	dmabuf->index = index;
+	dmabuf->outbound_iatu_region = iatu_region;
+	dmabuf->pmd_mappable = dmabuf_pmd_mappable(dmabuf);
+
+	out.physical_address = (u64)dmabuf->phys;
+	out.mapping_offset = dmabuf_mapping_start(index);
+	out.size = lower_32_bits(size);
+	out.size_hi = upper_32_bits(size);
+	out.buf_index = index;
+	out.page_size = dmabuf->pmd_mappable ? PMD_SIZE : PAGE_SIZE;
+
+	if (copy_to_user(&arg->out, &out, sizeof(out)) != 0) {
+		teardown_outbound_iatu(priv, iatu_region);
+		free_dma_buf_memory(priv->device, dmabuf);
+
+		kfree(dmabuf);
+		ret = -EFAULT;
+		goto out_release_index;
+	}
+
+	// Storing into the reserved slot needs no allocation and cannot fail.
+	mutex_lock(&priv->dmabuf_mutex);
+	xa_store(&priv->dmabufs, index, dmabuf, GFP_KERNEL);
+	mutex_unlock(&priv->dmabuf_mutex);
+
+	mutex_unlock(&priv->mutex);
+	return 0;
+
+out_release_index:
+	mutex_lock(&priv->dmabuf_mutex);
+	xa_erase(&priv->dmabufs, index);
+	mutex_unlock(&priv->dmabuf_mutex);
+out:
+	mutex_unlock(&priv->mutex);
+	return ret;
+}
+
+long ioctl_free_dma_buf(struct chardev_private *priv,
+			struct tenstorrent_free_dma_buf __user *arg)
+{
+	struct tenstorrent_free_dma_buf_in in = {0};
+	struct dmabuf *dmabuf;
+	long ret = 0;
+
+	if (copy_from_user(&in, &arg->in, sizeof(in)) != 0)
+		return -EFAULT;
+
+	mutex_lock(&priv->mutex);
+	mutex_lock(&priv->dmabuf_mutex);
+
+	dmabuf = lookup_dmabuf_by_index(priv, in.buf_index);
+	if (!dmabuf) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+
+	// Every VMA mapping the buffer holds a reference, and holding
+	// dmabuf_mutex keeps new mappings out until the buffer is removed.
+	if (kref_read(&dmabuf->kref) > 1) {
+		ret = -EBUSY;
+		goto unlock;
+	}
+
+	xa_erase(&priv->dmabufs, dmabuf->index);
+	mutex_unlock(&priv->dmabuf_mutex);
+
+	teardown_outbound_iatu(priv, dmabuf->outbound_iatu_region);
+	kref_put(&dmabuf->kref, release_dmabuf);
+
+	mutex_unlock(&priv->mutex);
+	return 0;
+
+unlock:
+	mutex_unlock(&priv->dmabuf_mutex);
+	mutex_unlock(&priv->mutex);
+	return ret;
+}
+
+long ioctl_sync_dma_buf(struct chardev_private *priv,
+			struct tenstorrent_sync_dma_buf __user *arg)
+{
+	struct device *dev = &priv->device->pdev->dev;
+	struct tenstorrent_sync_dma_buf data = {0};
+	struct dmabuf *dmabuf;
+
+	if (copy_from_user(&data, arg, sizeof(data)))
+		return -EFAULT;
+
+	if (data.argsz != sizeof(data))
+		return -EINVAL;
+
+	if (data.flags != TENSTORRENT_SYNC_DMA_BUF_FOR_CPU && data.flags != TENSTORRENT_SYNC_DMA_BUF_FOR_DEVICE)
+		return -EINVAL;
+
+	if (data.reserved != 0)
+		return -EINVAL;
+
+	mutex_lock(&priv->dmabuf_mutex);
+	dmabuf = lookup_dmabuf_by_index(priv, data.buf_index);
+	if (dmabuf)
+		kref_get(&dmabuf->kref);
+	mutex_unlock(&priv->dmabuf_mutex);
+
+	if (!dmabuf)
+		return -EINVAL;
+
+	if (data.size == 0 && data.offset < dmabuf->size)
+		data.size = dmabuf->size - data.offset;
+
+	if (data.size == 0 || data.offset > dmabuf->size || data.size > dmabuf->size - data.offset) {
+		kref_put(&dmabuf->kref, release_dmabuf);
+		return -EINVAL;
+	}
+
+	// Only page-backed buffers have a streaming mapping; the rest are coherent.
+	if (dmabuf->backing != DMABUF_PAGES) {
+		kref_put(&dmabuf->kref, release_dmabuf);
+		return 0;
+	}
+
+	// The buffer was mapped with dma_map_sgtable, and the DMA API only syncs
+	// such a mapping as the whole scatterlist it mapped, so the range is
+	// checked but the whole buffer is synced.
+	if (data.flags == TENSTORRENT_SYNC_DMA_BUF_FOR_CPU)
+		dma_sync_sg_for_cpu(dev, dmabuf->dma_mapping.sgl, dmabuf->dma_mapping.orig_nents,
+				    DMA_BIDIRECTIONAL);
+	else
+		dma_sync_sg_for_device(dev, dmabuf->dma_mapping.sgl, dmabuf->dma_mapping.orig_nents,
+				       DMA_BIDIRECTIONAL);
+
+	kref_put(&dmabuf->kref, release_dmabuf);
+	return 0;
+}
+
+
+bool is_iommu_translated(struct device *dev)
+{
+	struct iommu_domain *domain = iommu_get_domain_for_dev(dev);
+	return domain && domain->type != IOMMU_DOMAIN_IDENTITY;
+}
+
+static bool is_pin_pages_size_safe(u64 size)
+{
+	// With IOMMU enabled on 5.4, 2GB pinnings may succeed, but then soft lockup on process exit.
+	// (tt_cdev_release -> unmap_sg -> __unmap_single -> iommu_unmap_page)
+	// This doesn't happen in 5.15, but I don't know exactly when it was fixed.
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(5, 4, 0)
+	return size <= 1 << 30;
+#else
+	return true;
+#endif
+}
+
+// Pin and map one range for PIN_PAGES or PIN_PAGES_BATCH. On success the
+// pinning is in priv->pinnings and pin_cache_put undoes it.
+// Caller must hold priv->mutex.
+static struct pinned_page_range *pin_user_range(struct chardev_private *priv, u32 flags,
+						u64 virtual_address, u64 size,
+						struct tenstorrent_pin_pages_out_extended *out)
+{
+	const u32 valid_flags = TENSTORRENT_PIN_PAGES_CONTIGUOUS | TENSTORRENT_PIN_PAGES_NOC_DMA |
+				TENSTORRENT_PIN_PAGES_NOC_TOP_DOWN | TENSTORRENT_PIN_PAGES_READ_ONLY |
+				TENSTORRENT_PIN_PAGES_CACHE | TENSTORRENT_PIN_PAGES_SEGMENTED;
+	unsigned long nr_pages;
+	struct pinned_page_range *pinning;
+	struct sg_table sgt = {};
+	bool dma_mapped = false;
+	long ret;
+	u64 noc_address = 0;
+	int iatu_region = -1;
+	bool noc_dma = false;
+	bool top_down = false;
+	bool read_only = false;
+	bool cache = false;
+	bool segmented = false;
+	bool discontiguous = false;
+	bool hit;
+	unsigned int gup_flags;
+	enum dma_data_direction dir;
+
+	if (flags & ~valid_flags)
+		return ERR_PTR(-EINVAL);
+
+	if (!PAGE_ALIGNED(virtual_address) || !PAGE_ALIGNED(size) || size == 0)
+		return ERR_PTR(-EINVAL);
+
+	if (!is_pin_pages_size_safe(size))
+		return ERR_PTR(-EINVAL);
+
+	noc_dma = flags & (TENSTORRENT_PIN_PAGES_NOC_DMA | TENSTORRENT_PIN_PAGES_NOC_TOP_DOWN);
+	top_down = flags & TENSTORRENT_PIN_PAGES_NOC_TOP_DOWN;
+	read_only = flags & TENSTORRENT_PIN_PAGES_READ_ONLY;
+	cache = flags & TENSTORRENT_PIN_PAGES_CACHE;
+	segmented = flags & TENSTORRENT_PIN_PAGES_SEGMENTED;
+
+	if (read_only && !is_iommu_translated(&priv->device->pdev->dev))
+		return ERR_PTR(-EOPNOTSUPP);
+
+	gup_flags = read_only ? 0 : FOLL_WRITE;
+	dir = read_only ? DMA_TO_DEVICE : DMA_BIDIRECTIONAL;
+
+	pinning = find_pinning(priv, virtual_address, size);
+
+	// A discontiguous pinning only serves callers that accept segments and
+	// don't need a NOC window over them.
+	hit = pinning && cache && pin_cache_hit(pinning, read_only)
+	      && (!pinning->discontiguous || (segmented && !noc_dma));
+
+	// An idle cached pinning that can't serve this request makes way for it.
+	if (pinning && pinning_is_idle(pinning) && !hit) {
+		unpin_pinned_page_range(priv, pinning);
+		pinning = NULL;
+	}
+
+	if (pinning) {
+		// Block duplicate (VA/size) pinnings. Prevents ambiguity in UNPIN_PAGES
+		// regarding iATU teardown if the same range were pinned multiple times with
+		// different NOC_DMA flags. Cached pinnings are instead shared.
+		if (!hit)
+			return ERR_PTR(-EEXIST);
+
+		pin_cache_get(priv, pinning);
+		out->physical_address = pinning_dma_address(pinning, 0);
+
+		if (noc_dma && pinning->outbound_iatu_region < 0) {
+			ret = setup_pin_pages_noc_dma(priv, false, top_down, size, out->physical_address,
+						      &noc_address);
+			if (ret < 0) {
+				pin_cache_put(priv, pinning);
+				return ERR_PTR(ret);
+			}
+			pinning->outbound_iatu_region = ret;
+			pinning_window_add(priv, pinning);
+		}
+
+		if (noc_dma)
+			out->noc_address = pinning_noc_address(priv->device, pinning, 0);
+
+		return pinning;
+	}
+
+	pinning = kzalloc(sizeof(*pinning), GFP_KERNEL);
+	if (!pinning)
+		return ERR_PTR(-ENOMEM);
+
+	if (cache) {
+		ret = pin_cache_register(priv, pinning, virtual_address, size);
+		if (ret)
+			goto err_free_pinning;
+	}
+
+	nr_pages = PAGE_ALIGN(size) >> PAGE_SHIFT;
+
+	ret = pin_user_pages_sgt(virtual_address, nr_pages, gup_flags, &sgt);
+	if (ret) {
+		dev_warn(&priv->device->pdev->dev, "pinning %lu pages failed: %ld\n", nr_pages, ret);
+		goto err_free_pinning;
+	}
+
+	if (is_iommu_translated(&priv->device->pdev->dev)) {
+		struct scatterlist *sg;
+		unsigned int i;
+		dma_addr_t expected_next_address;
+		unsigned long total_dma_len = 0;
+
+		ret = dma_map_sgtable(&priv->device->pdev->dev, &sgt, dir, 0);
+
+		if (ret != 0) {
+			dev_err(&priv->device->pdev->dev, "dma_map_sg failed\n");
+			goto err_unpin_pages;
+		}
+
+		// This can only happen due to a misconfiguration or a bug.
+		for_each_sgtable_dma_sg((&sgt), sg, i) {
+			if (i > 0 && sg_dma_address(sg) != expected_next_address) {
+				dev_err(&priv->device->pdev->dev, "discontiguous mapping\n");
+				ret = -EINVAL;
+			}
+
+			expected_next_address = sg_dma_address(sg) + sg_dma_len(sg);
+			total_dma_len += sg_dma_len(sg);
+		}
+
+		if (total_dma_len != nr_pages * PAGE_SIZE) {
+			dev_err(&priv->device->pdev->dev, "dma-mapped (%lX) != original length (%lX)\n",
+				total_dma_len, nr_pages * PAGE_SIZE);
+			ret = -EINVAL;
+		}
+
+		if (ret != 0) {
+			debug_print_sgtable(&priv->device->pdev->dev, &sgt);
+			goto err_dma_unmap;
+		}
+
+		dma_mapped = true;
+		out->physical_address = sg_dma_address(sgt.sgl);
+
+		if (noc_dma) {
+			ret = setup_pin_pages_noc_dma(priv, !cache, top_down, size, out->physical_address,
+						      &noc_address);
+
+			if (ret < 0)
+				goto err_dma_unmap;
+			iatu_region = ret;
+		}
+	} else {
+		struct scatterlist *sg;
+		unsigned int i;
+		phys_addr_t expected_next_address;
+
+		// Runs are already merged, so only entries split at the
+		// scatterlist length limit may follow each other.
+		for_each_sg(sgt.sgl, sg, sgt.orig_nents, i) {
+			if (i > 0 && sg_phys(sg) != expected_next_address) {
+				discontiguous = true;
+				break;
+			}
+
+			expected_next_address = sg_phys(sg) + sg->length;
+		}
+
+		// A NOC window can only cover one run.
+		if (discontiguous && (!segmented || noc_dma)) {
+			dev_err(&priv->device->pdev->dev, "pages discontiguous at entry %u\n", i);
+			ret = -EINVAL;
+			goto err_unpin_pages;
+		}
+
+		out->physical_address = sg_phys(sgt.sgl);
+
+		if (noc_dma) {
+			ret = setup_pin_pages_noc_dma(priv, !cache, top_down, size, out->physical_address,
+						      &noc_address);
+
+			if (ret < 0)
+				goto err_unpin_pages;
+			iatu_region = ret;
+		}
+	}
+
+	out->noc_address = noc_address;
+
+	pinning->page_count = nr_pages;
+	pinning->sgt = sgt;
+	pinning->dma_mapped = dma_mapped;
+	pinning->discontiguous = discontiguous;
+	pinning->virtual_address = virtual_address;
+	pinning->outbound_iatu_region = iatu_region;
+	pinning->read_only = read_only;
+
+	INIT_LIST_HEAD(&pinning->window_link);
+	pinning_window_add(priv, pinning);
+	pinning_tree_insert(pinning, &priv->pinnings);
+
+	return pinning;
+
+err_dma_unmap:
+	dma_unmap_sgtable(&priv->device->pdev->dev, &sgt, dir, 0);
+err_unpin_pages:
+	unpin_sgt_pages(&sgt, false);
+	free_chained_sgt(&sgt);
+err_free_pinning:
+	pin_cache_unregister(priv, pinning);
+	kfree(pinning);
+	return ERR_PTR(ret);
+}
+
+long ioctl_pin_pages(struct chardev_private *priv,
+		     struct tenstorrent_pin_pages __user *arg)
+{
+	struct pinned_page_range *pinning;
+	u32 bytes_to_copy;
+
+	struct tenstorrent_pin_pages_in in;
+	struct tenstorrent_pin_pages_out_extended out;
+	memset(&in, 0, sizeof(in));
+	memset(&out, 0, sizeof(out));
+
+	if (copy_from_user(&in, &arg->in, sizeof(in)) != 0)
+		return -EFAULT;
+
+	if (clear_user(&arg->out, in.output_size_bytes) != 0)
+		return -EFAULT;
+
+	mutex_lock(&priv->mutex);
+
+	pinning = pin_user_range(priv, in.flags, in.virtual_address, in.size, &out);
+	if (IS_ERR(pinning)) {
+		mutex_unlock(&priv->mutex);
+		return PTR_ERR(pinning);
+	}
+
+	bytes_to_copy = min(in.output_size_bytes, (u32)sizeof(out));
+	if (copy_to_user(&arg->out, &out, bytes_to_copy) != 0) {
+		pin_cache_put(priv, pinning);
+		mutex_unlock(&priv->mutex);
+		return -EFAULT;
+	}
+
+	mutex_unlock(&priv->mutex);
+	return 0;
+}
+
+long ioctl_pin_pages_batch(struct chardev_private *priv,
+			   struct tenstorrent_pin_pages_batch __user *arg)
+{
+	struct tenstorrent_pin_pages_batch batch = {0};
+	struct tenstorrent_pin_pages_batch_entry *entries;
+	struct pinned_page_range **pinnings;
+	size_t entries_size;
+	long ret = 0;
+	u32 i;
+
+	if (copy_from_user(&batch, arg, sizeof(batch)))
+		return -EFAULT;
+
+	if (batch.argsz != sizeof(batch))
+		return -EINVAL;
+
+	if (batch.flags != 0 || batch.reserved != 0)
+		return -EINVAL;
+
+	if (batch.count == 0 || batch.count > TENSTORRENT_PIN_PAGES_BATCH_MAX)
+		return -EINVAL;
+
+	entries_size = array_size(batch.count, sizeof(*entries));
+	entries = kvmalloc(entries_size, GFP_KERNEL);
+	pinnings = kvcalloc(batch.count, sizeof(*pinnings), GFP_KERNEL);
+	if (!entries || !pinnings) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	if (copy_from_user(entries, u64_to_user_ptr(batch.entries), entries_size)) {
+		ret = -EFAULT;
+		goto out_free;
+	}
+
+	mutex_lock(&priv->mutex);
+
+	for (i = 0; i < batch.count; i++) {
+		struct tenstorrent_pin_pages_batch_entry *e = &entries[i];
+		struct tenstorrent_pin_pages_out_extended out = {0};
+		struct pinned_page_range *pinning;
+
+		pinning = pin_user_range(priv, e->flags, e->virtual_address, e->size, &out);
+		if (IS_ERR(pinning)) {
+			e->status = PTR_ERR(pinning);
+			e->physical_address = 0;
+			e->noc_address = 0;
+			continue;
+		}
+
+		pinnings[i] = pinning;
+		e->status = 0;
+		e->physical_address = out.physical_address;
+		e->noc_address = out.noc_address;
+	}
+
+	// Userspace can't learn about pinnings it wasn't told of, so undo them.
+	if (copy_to_user(u64_to_user_ptr(batch.entries), entries, entries_size)) {
+		for (i = batch.count; i-- > 0;)
+			if (pinnings[i])
+				pin_cache_put(priv, pinnings[i]);
+		ret = -EFAULT;
+	}
+
+	mutex_unlock(&priv->mutex);
+
+out_free:
+	kvfree(pinnings);
+	kvfree(entries);
+	return ret;
+}
+
+// A PIN_PAGES_ASYNC request, on chardev_private.async_pins until collected.
+struct async_pin {
+	struct list_head list;
+	struct work_struct work;
+	struct chardev_private *priv;
+	struct mm_struct *mm;	// mmget reference, dropped by the work
+
+	u64 ticket;
+	u32 flags;
+	u64 virtual_address;
+	u64 size;
+
+	// Written by the work before it sets done under async_pin_lock.
+	bool done;
+	int status;
+	struct tenstorrent_pin_pages_out_extended out;
+
+	bool collecting;	// a PIN_PAGES_COMPLETE is copying it out
+};
+
+static void async_pin_work_fn(struct work_struct *work)
+{
+	struct async_pin *req = container_of(work, struct async_pin, work);
+	struct chardev_private *priv = req->priv;
+	struct tenstorrent_device *tt_dev = priv->device;
+	struct pinned_page_range *pinning;
+	int ret = 0;
+
+	// Same rules as an ioctl: no reset or removal while the pinning is set
+	// up, and an fd invalidated by reset can't pin anything.
+	down_read(&tt_dev->reset_rwsem);
+
+	if (tt_dev->detached || atomic_long_read(&tt_dev->reset_gen) != priv->open_reset_gen) {
+		ret = -ENODEV;
+	} else {
+		kthread_use_mm(req->mm);
+		mutex_lock(&priv->mutex);
+
+		pinning = pin_user_range(priv, req->flags, req->virtual_address, req->size, &req->out);
+		if (IS_ERR(pinning))
+			ret = PTR_ERR(pinning);
+
+		mutex_unlock(&priv->mutex);
+		kthread_unuse_mm(req->mm);
+	}
+
+	up_read(&tt_dev->reset_rwsem);
+
+	mmput(req->mm);
+
+	// Wake under the lock: once it's dropped the request can be collected
+	// and the fd closed, freeing priv. Nothing may touch priv after this.
+	spin_lock(&priv->async_pin_lock);
+	req->status = ret;
+	req->done = true;
+	wake_up_interruptible(&priv->async_pin_wait);
+	spin_unlock(&priv->async_pin_lock);
+}
+
+long ioctl_pin_pages_async(struct chardev_private *priv,
+			   struct tenstorrent_pin_pages_async __user *arg)
+{
+	struct tenstorrent_pin_pages_async data = {0};
+	struct async_pin *req;
+	u64 ticket;
+
+	if (copy_from_user(&data, arg, sizeof(data)))
+		return -EFAULT;
+
+	if (data.argsz != sizeof(data))
+		return -EINVAL;
+
+	req = kzalloc(sizeof(*req), GFP_KERNEL);
+	if (!req)
+		return -ENOMEM;
+
+	INIT_WORK(&req->work, async_pin_work_fn);
+	req->priv = priv;
+	req->flags = data.flags;
+	req->virtual_address = data.virtual_address;
+	req->size = data.size;
+
+	spin_lock(&priv->async_pin_lock);
+
+	if (priv->async_pin_count >= TENSTORRENT_MAX_ASYNC_PINS) {
+		spin_unlock(&priv->async_pin_lock);
+		kfree(req);
+		return -EBUSY;
+	}
+
+	mmget(current->mm);
+	req->mm = current->mm;
+	ticket = req->ticket = ++priv->async_pin_last_ticket;
+	priv->async_pin_count++;
+	list_add_tail(&req->list, &priv->async_pins);
+	queue_work(system_unbound_wq, &req->work);
+
+	spin_unlock(&priv->async_pin_lock);
+
+	// req may already be collected and freed by another thread. It runs
+	// regardless, so a caller that loses the ticket can still use ticket 0.
+	if (put_user(ticket, &arg->ticket))
+		return -EFAULT;
+
+	return 0;
+}
+
+// Requests being collected are as good as gone. Caller holds async_pin_lock.
+static struct async_pin *find_async_pin(struct chardev_private *priv, u64 ticket)
+{
+	struct async_pin *req;
+
+	list_for_each_entry(req, &priv->async_pins, list) {
+		if (req->collecting)
+			continue;
+
+		if (ticket == 0 ? req->done : req->ticket == ticket)
+			return req;
+	}
+
+	return NULL;
+}
+
+// Whether PIN_PAGES_COMPLETE of this ticket would not wait.
+static bool async_pin_ready(struct chardev_private *priv, u64 ticket)
+{
+	struct async_pin *req;
+	bool ready;
+
+	spin_lock(&priv->async_pin_lock);
+	req = find_async_pin(priv, ticket);
+	if (ticket == 0)
+		ready = req || list_empty(&priv->async_pins);
+	else
+		ready = !req || req->done;
+	spin_unlock(&priv->async_pin_lock);
+
+	return ready;
+}
+
+// Caller (tt_cdev_ioctl) holds reset_rwsem shared.
+long ioctl_pin_pages_complete(struct chardev_private *priv,
+			      struct tenstorrent_pin_pages_complete __user *arg)
+{
+	struct tenstorrent_device *tt_dev = priv->device;
+	struct tenstorrent_pin_pages_complete data = {0};
+	struct async_pin *req;
+	long ret;
+
+	if (copy_from_user(&data, arg, sizeof(data)))
+		return -EFAULT;
+
+	if (data.argsz != sizeof(data))
+		return -EINVAL;
+
+	if (data.flags & ~TENSTORRENT_PIN_PAGES_COMPLETE_NONBLOCK)
+		return -EINVAL;
+
+	spin_lock(&priv->async_pin_lock);
+	req = find_async_pin(priv, data.ticket);
+
+	if (!req && (data.ticket != 0 || list_empty(&priv->async_pins))) {
+		spin_unlock(&priv->async_pin_lock);
+		return -ENOENT;
+	}
+
+	if (!req || !req->done) {
+		spin_unlock(&priv->async_pin_lock);
+
+		if (data.flags & TENSTORRENT_PIN_PAGES_COMPLETE_NONBLOCK)
+			return -EAGAIN;
+
+		// The work takes reset_rwsem, so waiting with it held deadlocks
+		// against a queued RESET_DEVICE. See acquire_resource_lock_blocking.
+		up_read(&tt_dev->reset_rwsem);
+		ret = wait_event_interruptible(priv->async_pin_wait, async_pin_ready(priv, data.ticket));
+		down_read(&tt_dev->reset_rwsem);
+
+		if (ret)
+			return -ERESTARTSYS;
+
+		if (tt_dev->detached || atomic_long_read(&tt_dev->reset_gen) != priv->open_reset_gen)
+			return -ENODEV;
+
+		spin_lock(&priv->async_pin_lock);
+		req = find_async_pin(priv, data.ticket);
+
+		// Another thread collected it while we slept.
+		if (!req) {
+			spin_unlock(&priv->async_pin_lock);
+			return -ENOENT;
+		}
+	}
+
+	// Other callers skip req from here, and close waits for this ioctl,
+	// so req outlives the copy.
+	req->collecting = true;
+	spin_unlock(&priv->async_pin_lock);
+
+	data.ticket = req->ticket;
+	data.status = req->status;
+	data.physical_address = req->out.physical_address;
+	data.noc_address = req->out.noc_address;
+
+	// A result userspace never saw stays to be collected again.
+	if (copy_to_user(arg, &data, sizeof(data))) {
+		spin_lock(&priv->async_pin_lock);
+		req->collecting = false;
+		wake_up_interruptible(&priv->async_pin_wait);
+		spin_unlock(&priv->async_pin_lock);
+		return -EFAULT;
+	}
+
+	// Waiters for any request may have been waiting on this one.
+	spin_lock(&priv->async_pin_lock);
+	list_del(&req->list);
+	priv->async_pin_count--;
+	wake_up_interruptible(&priv->async_pin_wait);
+	spin_unlock(&priv->async_pin_lock);
+	kfree(req);
+
+	return 0;
+}
+
+// For poll(): whether PIN_PAGES_COMPLETE has a result to collect.
+bool tenstorrent_async_pin_completed(struct chardev_private *priv)
+{
+	bool completed;
+
+	spin_lock(&priv->async_pin_lock);
+	completed = find_async_pin(priv, 0) != NULL;
+	spin_unlock(&priv->async_pin_lock);
+
+	return completed;
+}
+
+// Wait for this fd's async pins and free the requests. Pinnings they made are
+// released with the rest by tenstorrent_memory_cleanup. Called from release,
+// where no ioctl can add requests, before it takes reset_rwsem: the work takes
+// reset_rwsem too, so cancel_work_sync under it could deadlock against a
+// queued RESET_DEVICE.
+void tenstorrent_async_pin_cleanup(struct chardev_private *priv)
+{
+	struct async_pin *req, *tmp;
+
+	list_for_each_entry_safe(req, tmp, &priv->async_pins, list) {
+		// Didn't run, so the mm reference is still ours.
+		if (cancel_work_sync(&req->work))
+			mmput(req->mm);
+
+		list_del(&req->list);
+		kfree(req);
+	}
+}
+
+// A pinning in use that contains [virtual_address, virtual_address + size).
+static struct pinned_page_range *find_pinning_containing(struct chardev_private *priv,
+							 u64 virtual_address, u64 size)
+{
+	u64 last = virtual_address + size - 1;
+	struct pinned_page_range *pinning;
+
+	if (last < virtual_address)
+		return NULL;
+
+	for (pinning = pinning_tree_iter_first(&priv->pinnings, virtual_address, last);
+	     pinning;
+	     pinning = pinning_tree_iter_next(pinning, virtual_address, last)) {
+		if (!pinning_is_idle(pinning)
+		    && PINNING_START(pinning) <= virtual_address && last <= PINNING_LAST(pinning))
+			return pinning;
+	}
+
+	return NULL;
+}
+
+// Split the runs of a pinning's table at byte offsets offset and end into
+// three new tables. The pages stay pinned; src is left alone.
+static int split_pinning_sgt(struct sg_table *src, u64 offset, u64 end,
+			     struct sg_table *parts)
+{
+	struct chained_sgt_builder builders[3];
+	u64 bounds[4] = { 0, offset, end, U64_MAX };
+	struct scatterlist *sg;
+	u64 pos = 0;
+	unsigned int i;
+	int part;
+
+	for (part = 0; part < 3; part++)
+		chained_sgt_builder_init(&builders[part], &parts[part]);
+
+	for_each_sg(src->sgl, sg, src->orig_nents, i) {
+		for (part = 0; part < 3; part++) {
+			u64 start = max(pos, bounds[part]);
+			u64 stop = min(pos + sg->length, bounds[part + 1]);
+
+			if (start >= stop)
+				continue;
 
-	dma_addr_t mapped_address;
-	size_t size;
-};
+			if (!chained_sgt_append(&builders[part], nth_page(sg_page(sg), (start - pos) >> PAGE_SHIFT),
+						(stop - start) >> PAGE_SHIFT)) {
+				for (part = 0; part < 3; part++)
+					free_chained_sgt(&parts[part]);
+				return -ENOMEM;
+			}
+		}
 
-// This replaces tenstorrent_query_mappings from ioctl.h with a version
-// that uses a flexible array member rather than a zero-length array.
-// This keeps UBSAN from triggering when we write the output mappings.
-struct tenstorrent_query_mappings_flex {
-	struct tenstorrent_query_mappings_in in;
-	struct tenstorrent_mapping out_mappings[];
-};
+		pos += sg->length;
+	}
 
-long ioctl_query_mappings(struct chardev_private *priv,
-			  struct tenstorrent_query_mappings __user *arg_)
+	for (part = 0; part < 3; part++)
+		chained_sgt_builder_finish(&builders[part]);
+
+	return 0;
+}
+
+// Narrow a pinning's NOC window to its head [0, offset) and give the tail
+// [end, total) a window of its own, so both keep their NOC addresses. One of
+// them may be empty. *tail_region is set to the tail's region, or -1.
+static int split_pinning_iatu(struct chardev_private *priv, int iatu_region, u64 offset, u64 end, u64 total,
+			      int *tail_region)
 {
-	struct tenstorrent_query_mappings_flex __user *arg = (struct tenstorrent_query_mappings_flex __user *)arg_;
+	struct tenstorrent_device *tt_dev = priv->device;
+	struct tenstorrent_outbound_iatu_region *head = &tt_dev->outbound_iatus[iatu_region];
+	struct tenstorrent_outbound_iatu_region *tail;
+	int region;
+	int ret = 0;
 
-	struct tenstorrent_mapping mappings[6];
-	struct tenstorrent_mapping *next_mapping;
+	*tail_region = -1;
 
-	u32 valid_mappings_to_copy;
-	u32 extra_mappings_to_clear;
-	u32 valid_mappings;
+	mutex_lock(&tt_dev->iatu_mutex);
 
-	resource_size_t resource_len;
+	// The tail gets its own window before the old one changes. Where they
+	// overlap both map to the same pages, so DMA to pages that stay pinned
+	// is never misdirected, whatever order the hardware matches them in.
+	if (end < total) {
+		region = find_free_outbound_iatu(tt_dev, priv);
+		if (region < 0) {
+			ret = region;
+			goto out;
+		}
+
+		ret = tt_dev->dev_class->configure_outbound_atu(tt_dev, region, head->base + end, head->limit,
+								head->target + end);
+		if (ret)
+			goto out;
+
+		// The old window's range hands the tail's part over.
+		tail = &tt_dev->outbound_iatus[region];
+		WARN_ON(range_alloc_resize(head->space, &head->range, head->base, head->base + end - 1));
+		tail->space = head->space;
+		WARN_ON(range_alloc_insert_at(tail->space, &tail->range, head->base + end, head->limit));
+
+		tail->priv = priv;
+		tail->base = head->base + end;
+		tail->limit = head->limit;
+		tail->target = head->target + end;
+		head->limit = head->base + end - 1;
+		*tail_region = region;
+	}
+
+	if (offset > 0) {
+		// Only the limit changes, so the head stays mapped throughout.
+		WARN_ON(range_alloc_resize(head->space, &head->range, head->base, head->base + offset - 1));
+		head->limit = head->base + offset - 1;
+
+		if (!tt_dev->detached)
+			tt_dev->dev_class->configure_outbound_atu(tt_dev, iatu_region, head->base, head->limit,
+								  head->target);
+	} else {
+		if (!tt_dev->detached)
+			tt_dev->dev_class->configure_outbound_atu(tt_dev, iatu_region, 0, 0, 0);
+
+		release_outbound_iatu_slot(tt_dev, iatu_region);
+	}
+
+out:
+	mutex_unlock(&tt_dev->iatu_mutex);
+	return ret;
+}
+
+// Unpin [offset, end) of a pinning, leaving the pages on either side pinned
+// as up to two pinnings with unchanged physical and NOC addresses. The DMA
+// API can't unmap part of a mapping, so this is only for pinnings without
+// an IOMMU mapping. Caller holds priv->mutex.
+static int unpin_pinning_subrange(struct chardev_private *priv, struct pinned_page_range *pinning,
+				  u64 offset, u64 end)
+{
+	struct tenstorrent_device *tt_dev = priv->device;
+	u64 total = (u64)pinning->page_count << PAGE_SHIFT;
+	struct pinned_page_range *tail_pinning = NULL;
+	struct sg_table parts[3];	// head, unpinned, tail
+	int iatu_region = pinning->outbound_iatu_region;
+	int tail_region = -1;
+	int ret;
+
+	// The pieces of a window other pinnings share would need windows of
+	// their own at the same NOC addresses.
+	if (iatu_region >= 0 && pinning_window_shared(priv, pinning))
+		return -EBUSY;
+
+	ret = split_pinning_sgt(&pinning->sgt, offset, end, parts);
+	if (ret)
+		return ret;
+
+	if (offset > 0 && end < total) {
+		tail_pinning = kzalloc(sizeof(*tail_pinning), GFP_KERNEL);
+		if (!tail_pinning) {
+			ret = -ENOMEM;
+			goto err_free_parts;
+		}
+	}
+
+	if (iatu_region >= 0) {
+		ret = split_pinning_iatu(priv, iatu_region, offset, end, total, &tail_region);
+		if (ret)
+			goto err_free_tail;
+	}
+
+	unpin_sgt_pages(&parts[1], !pinning->read_only);
+	free_chained_sgt(&parts[1]);
+	free_chained_sgt(&pinning->sgt);
+
+	list_del_init(&pinning->window_link);
+	pinning_tree_remove(pinning, &priv->pinnings);
+
+	if (offset == 0) {
+		// Only the tail is left; it takes over the pinning.
+		free_chained_sgt(&parts[0]);
+		tail_pinning = pinning;
+	} else {
+		pinning->sgt = parts[0];
+		pinning->page_count = offset >> PAGE_SHIFT;
+		pinning_window_add(priv, pinning);
+		pinning_tree_insert(pinning, &priv->pinnings);
+	}
+
+	if (tail_pinning) {
+		tail_pinning->sgt = parts[2];
+		tail_pinning->page_count = (total - end) >> PAGE_SHIFT;
+		tail_pinning->virtual_address = pinning->virtual_address + end;
+		tail_pinning->outbound_iatu_region = tail_region;
+		tail_pinning->read_only = pinning->read_only;
+		tail_pinning->discontiguous = pinning->discontiguous;
+		INIT_LIST_HEAD(&tail_pinning->window_link);
+		pinning_window_add(priv, tail_pinning);
+		pinning_tree_insert(tail_pinning, &priv->pinnings);
+	} else {
+		free_chained_sgt(&parts[2]);
+	}
+
+	return 0;
+
+err_free_tail:
+	kfree(tail_pinning);
+err_free_parts:
+	free_chained_sgt(&parts[0]);
+	free_chained_sgt(&parts[1]);
+	free_chained_sgt(&parts[2]);
+	return ret;
+}
+
+long ioctl_unpin_pages(struct chardev_private *priv,
+		       struct tenstorrent_unpin_pages __user *arg)
+{
+	struct tenstorrent_unpin_pages_in in = {0};
+	struct pinned_page_range *pinning;
+	unsigned long nr_pages;
+	long ret = -EINVAL;
 
-	struct tenstorrent_query_mappings_in in;
 	if (copy_from_user(&in, &arg->in, sizeof(in)) != 0)
 		return -EFAULT;
 
-	memset(mappings, 0, sizeof(mappings));
-	next_mapping = mappings;
+	nr_pages = in.size >> PAGE_SHIFT;
 
-	resource_len = pci_resource_len(priv->device->pdev, 0);
-	if (resource_len > 0) {
-		next_mapping->mapping_id = TENSTORRENT_MAPPING_RESOURCE0_UC;
-		next_mapping->mapping_base = MMAP_OFFSET_RESOURCE0_UC;
-		next_mapping->mapping_size = resource_len;
-		next_mapping++;
+	if (in.reserved != 0 || in.size == 0 || nr_pages == 0)
+		return -EINVAL;
 
-		next_mapping->mapping_id = TENSTORRENT_MAPPING_RESOURCE0_WC;
-		next_mapping->mapping_base = MMAP_OFFSET_RESOURCE0_WC;
-		next_mapping->mapping_size = resource_len;
-		next_mapping++;
+	mutex_lock(&priv->mutex);
+
+	pinning = find_pinning(priv, in.virtual_address, (u64)nr_pages << PAGE_SHIFT);
+	if (pinning && !pinning_is_idle(pinning)) {
+		// Only uncached pinnings share windows, see coalesce_pinning_noc_dma.
+		if (pinning_is_cached(pinning)) {
+			pin_cache_put(priv, pinning);
+			ret = 0;
+		} else {
+			ret = release_pinned_page_range(priv, pinning, false);
+		}
+	} else if (PAGE_ALIGNED(in.virtual_address)) {
+		// Part of a larger pinning.
+		pinning = find_pinning_containing(priv, in.virtual_address, (u64)nr_pages << PAGE_SHIFT);
+		if (pinning && (pinning->dma_mapped || pinning_is_cached(pinning))) {
+			ret = -EOPNOTSUPP;
+		} else if (pinning) {
+			u64 offset = in.virtual_address - pinning->virtual_address;
+
+			ret = unpin_pinning_subrange(priv, pinning, offset, offset + ((u64)nr_pages << PAGE_SHIFT));
+		}
 	}
 
-	resource_len = pci_resource_len(priv->device->pdev, 2);
-	if (resource_len > 0) {
-		next_mapping->mapping_id = TENSTORRENT_MAPPING_RESOURCE1_UC;
-		next_mapping->mapping_base = MMAP_OFFSET_RESOURCE1_UC;
-		next_mapping->mapping_size = resource_len;
-		next_mapping++;
+	mutex_unlock(&priv->mutex);
+	return ret;
+}
 
-		next_mapping->mapping_id = TENSTORRENT_MAPPING_RESOURCE1_WC;
-		next_mapping->mapping_base = MMAP_OFFSET_RESOURCE1_WC;
-		next_mapping->mapping_size = resource_len;
-		next_mapping++;
-	}
+// The lowest pinning containing virtual_address. Caller holds priv->mutex.
+static struct pinned_page_range *lookup_pinning(struct chardev_private *priv, u64 virtual_address)
+{
+	struct pinned_page_range *pinning;
 
-	resource_len = pci_resource_len(priv->device->pdev, 4);
-	if (resource_len > 0) {
-		next_mapping->mapping_id = TENSTORRENT_MAPPING_RESOURCE2_UC;
-		next_mapping->mapping_base = MMAP_OFFSET_RESOURCE2_UC;
-		next_mapping->mapping_size = resource_len;
-		next_mapping++;
+	// Idle cached pinnings are unpinned as far as userspace knows.
+	for (pinning = pinning_tree_iter_first(&priv->pinnings, virtual_address, virtual_address);
+	     pinning && pinning_is_idle(pinning);
+	     pinning = pinning_tree_iter_next(pinning, virtual_address, virtual_address))
+		;
 
-		next_mapping->mapping_id = TENSTORRENT_MAPPING_RESOURCE2_WC;
-		next_mapping->mapping_base = MMAP_OFFSET_RESOURCE2_WC;
-		next_mapping->mapping_size = resource_len;
-		next_mapping++;
+	return pinning;
+}
+
+long ioctl_lookup_pinning(struct chardev_private *priv,
+			  struct tenstorrent_lookup_pinning __user *arg)
+{
+	struct tenstorrent_lookup_pinning data = {0};
+	struct pinned_page_range *pinning;
+	u64 offset;
+
+	if (copy_from_user(&data, arg, sizeof(data)) != 0)
+		return -EFAULT;
+
+	if (data.argsz != sizeof(data) || data.flags != 0)
+		return -EINVAL;
+
+	mutex_lock(&priv->mutex);
+
+	pinning = lookup_pinning(priv, data.virtual_address);
+	if (!pinning) {
+		mutex_unlock(&priv->mutex);
+		return -ENOENT;
 	}
 
-	valid_mappings = next_mapping - mappings;
+	offset = data.virtual_address - pinning->virtual_address;
 
-	valid_mappings_to_copy = min(in.output_mapping_count, valid_mappings);
-	extra_mappings_to_clear = (in.output_mapping_count > valid_mappings)
-		? in.output_mapping_count - valid_mappings : 0;
+	data.pinned_address = pinning->virtual_address;
+	data.pinned_size = (u64)pinning->page_count << PAGE_SHIFT;
 
-	if (U32_MAX / sizeof(struct tenstorrent_mapping) < extra_mappings_to_clear)
+	data.physical_address = pinning_dma_address(pinning, offset);
+
+	if (pinning->outbound_iatu_region >= 0)
+		data.noc_address = pinning_noc_address(priv->device, pinning, offset);
+
+	mutex_unlock(&priv->mutex);
+
+	if (copy_to_user(arg, &data, sizeof(data)) != 0)
 		return -EFAULT;
 
-	if (copy_to_user(&arg->out_mappings, &mappings,
-			 valid_mappings_to_copy * sizeof(struct tenstorrent_mapping)))
+	return 0;
+}
+
+// Store the next segment if the array has room, and count it regardless.
+static long put_pin_segment(struct tenstorrent_pin_segment __user *segments, u32 capacity,
+			    u32 *count, struct tenstorrent_pin_segment *segment)
+{
+	if (*count < capacity && copy_to_user(&segments[*count], segment, sizeof(*segment)))
 		return -EFAULT;
 
-	if (clear_user(&arg->out_mappings[valid_mappings_to_copy],
-		       extra_mappings_to_clear * sizeof(struct tenstorrent_mapping)))
+	(*count)++;
+	return 0;
+}
+
+long ioctl_get_pin_segments(struct chardev_private *priv,
+			    struct tenstorrent_get_pin_segments __user *arg)
+{
+	struct tenstorrent_get_pin_segments data = {0};
+	struct tenstorrent_pin_segment __user *segments;
+	struct tenstorrent_pin_segment segment = {0};
+	struct pinned_page_range *pinning;
+	struct scatterlist *sg;
+	unsigned int nents;
+	unsigned int i;
+	u32 count = 0;
+	long ret = 0;
+
+	if (copy_from_user(&data, arg, sizeof(data)) != 0)
+		return -EFAULT;
+
+	if (data.argsz != sizeof(data) || data.flags != 0 || data.reserved != 0)
+		return -EINVAL;
+
+	segments = u64_to_user_ptr(data.segments);
+
+	mutex_lock(&priv->mutex);
+
+	pinning = lookup_pinning(priv, data.virtual_address);
+	if (!pinning) {
+		mutex_unlock(&priv->mutex);
+		return -ENOENT;
+	}
+
+	// Merge entries that are only split by the scatterlist length limit.
+	nents = pinning->dma_mapped ? pinning->sgt.nents : pinning->sgt.orig_nents;
+	for_each_sg(pinning->sgt.sgl, sg, nents, i) {
+		u64 address = pinning->dma_mapped ? sg_dma_address(sg) : sg_phys(sg);
+		u64 length = pinning->dma_mapped ? sg_dma_len(sg) : sg->length;
+
+		if (segment.size && segment.address + segment.size == address) {
+			segment.size += length;
+			continue;
+		}
+
+		if (segment.size) {
+			ret = put_pin_segment(segments, data.count, &count, &segment);
+			if (ret)
+				break;
+		}
+
+		segment.address = address;
+		segment.size = length;
+	}
+
+	if (!ret)
+		ret = put_pin_segment(segments, data.count, &count, &segment);
+
+	mutex_unlock(&priv->mutex);
+
+	if (ret)
+		return ret;
+
+	if (put_user(count, &arg->count))
 		return -EFAULT;
 
 	return 0;
 }
 
-static struct dmabuf *lookup_dmabuf_by_index(struct chardev_private *priv, u8 buf_index) {
-	struct dmabuf *dmabuf;
+#ifdef TENSTORRENT_PIN_MEMFD
 
-	hash_for_each_possible(priv->dmabufs, dmabuf, hash_chain, buf_index)
-		if (dmabuf->index == buf_index)
-			return dmabuf;
+static void unpin_memfd_folio(struct folio *folio, bool make_dirty)
+{
+	if (make_dirty) {
+		folio_lock(folio);
+		folio_mark_dirty(folio);
+		folio_unlock(folio);
+	}
 
-	return NULL;
+	unpin_folio(folio);
+}
+
+// Unpin the folios of a table built by pin_memfd_sgt, even a partly built
+// one. memfd_pin_folios pins each folio once however many of its pages are
+// used, and runs may merge folios or split one, so walk the folios and
+// unpin each once we are past it.
+static void unpin_memfd_sgt(struct sg_table *sgt, bool make_dirty)
+{
+	struct folio *folio = NULL;
+	struct scatterlist *sg;
+	unsigned int i;
+
+	for_each_sg(sgt->sgl, sg, sgt->orig_nents, i) {
+		unsigned long n_pages = sg->length >> PAGE_SHIFT;
+		unsigned long j = 0;
+
+		while (j < n_pages) {
+			struct page *page = nth_page(sg_page(sg), j);
+			struct folio *next = page_folio(page);
+
+			if (next != folio) {
+				if (folio)
+					unpin_memfd_folio(folio, make_dirty);
+				folio = next;
+			}
+
+			j += folio_nr_pages(next) - folio_page_idx(next, page);
+		}
+	}
+
+	if (folio)
+		unpin_memfd_folio(folio, make_dirty);
+}
+
+// Pin size bytes at offset of memfd into a chained sg_table with one entry
+// per physically contiguous run. On failure nothing stays pinned.
+static int pin_memfd_sgt(struct file *memfd, u64 offset, u64 size, struct sg_table *sgt)
+{
+	struct chained_sgt_builder builder;
+	struct folio **batch;
+	u64 end = offset + size;
+	u64 pos = offset;
+	int ret = 0;
+
+	batch = kvmalloc_array(PIN_BATCH_PAGES, sizeof(*batch), GFP_KERNEL);
+	if (!batch)
+		return -ENOMEM;
+
+	chained_sgt_builder_init(&builder, sgt);
+
+	// Each call returns whole folios from pos, entering the first at
+	// first_offset, so the next call starts where the last folio ends.
+	while (pos < end && ret == 0) {
+		pgoff_t first_offset;
+		long n = memfd_pin_folios(memfd, pos, end - 1, batch, PIN_BATCH_PAGES, &first_offset);
+		long i;
+
+		if (n <= 0) {
+			ret = n ? n : -EFAULT;
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			u64 skip = i == 0 ? first_offset : 0;
+			u64 len = min_t(u64, folio_size(batch[i]) - skip, end - pos);
+
+			if (!chained_sgt_append(&builder, folio_page(batch[i], skip >> PAGE_SHIFT), len >> PAGE_SHIFT)) {
+				unpin_folios(batch + i, n - i);
+				ret = -ENOMEM;
+				break;
+			}
+
+			pos += len;
+		}
+	}
+
+	kvfree(batch);
+
+	if (ret) {
+		unpin_memfd_sgt(sgt, false);
+		free_chained_sgt(sgt);
+		return ret;
+	}
+
+	chained_sgt_builder_finish(&builder);
+	return 0;
+}
+
+// Whether every pinned folio is still in the file's page cache. Truncating
+// the file or punching a hole in it drops folios even while they are pinned,
+// after which the pinning no longer holds the file's contents.
+static bool memfd_pinning_is_current(struct memfd_pinning *pinning)
+{
+	struct address_space *mapping = pinning->file->f_mapping;
+	struct scatterlist *sg;
+	unsigned int i;
+
+	for_each_sg(pinning->sgt.sgl, sg, pinning->sgt.orig_nents, i) {
+		unsigned long n_pages = sg->length >> PAGE_SHIFT;
+		unsigned long j = 0;
+
+		while (j < n_pages) {
+			struct page *page = nth_page(sg_page(sg), j);
+			struct folio *folio = page_folio(page);
+
+			if (READ_ONCE(folio->mapping) != mapping)
+				return false;
+
+			j += folio_nr_pages(folio) - folio_page_idx(folio, page);
+		}
+	}
+
+	return true;
 }
 
-static u64 dmabuf_mapping_start(u8 buf_index) {
-	return MMAP_OFFSET_DMA_BUF + buf_index * MMAP_SIZE_DMA_BUF;
+// A pinning found not to be current is marked stale and never shared again;
+// the fds holding it keep it until they drop it.
+// Caller holds tt_dev->memfd_pin_mutex.
+static struct memfd_pinning *find_memfd_pinning(struct tenstorrent_device *tt_dev, struct inode *inode,
+						u64 offset, u64 size)
+{
+	struct memfd_pinning *pinning;
+
+	list_for_each_entry(pinning, &tt_dev->memfd_pinnings, list) {
+		if (pinning->stale || file_inode(pinning->file) != inode
+		    || pinning->offset != offset || pinning->size != size)
+			continue;
+
+		if (memfd_pinning_is_current(pinning))
+			return pinning;
+
+		pinning->stale = true;
+	}
+
+	return NULL;
 }
 
-long ioctl_allocate_dma_buf(struct chardev_private *priv,
-			    struct tenstorrent_allocate_dma_buf __user *arg)
+// Pin and map a range of file for the device, with no references yet.
+// Caller holds tt_dev->memfd_pin_mutex.
+static struct memfd_pinning *create_memfd_pinning(struct tenstorrent_device *tt_dev, struct file *file,
+						  u64 offset, u64 size)
 {
-	dma_addr_t dma_handle = 0;
-	void *dma_buf_kernel_ptr;
-	struct dmabuf *dmabuf;
-	long ret = 0;
-	int iatu_region = -1;
+	struct device *dev = &tt_dev->pdev->dev;
+	struct memfd_pinning *pinning;
+	int ret;
 
-	struct tenstorrent_allocate_dma_buf_in in;
-	struct tenstorrent_allocate_dma_buf_out out;
-	memset(&in, 0, sizeof(in));
-	memset(&out, 0, sizeof(out));
+	pinning = kzalloc(sizeof(*pinning), GFP_KERNEL);
+	if (!pinning)
+		return ERR_PTR(-ENOMEM);
 
-	if (copy_from_user(&in, &arg->in, sizeof(in)) != 0)
-		return -EFAULT;
+	ret = pin_memfd_sgt(file, offset, size, &pinning->sgt);
+	if (ret) {
+		dev_warn(dev, "pinning %llu bytes of memfd failed: %d\n", size, ret);
+		goto err_free;
+	}
 
-	if (!priv->device->dma_capable)
-		return -EINVAL;
+	if (is_iommu_translated(dev)) {
+		ret = dma_map_sgtable(dev, &pinning->sgt, DMA_BIDIRECTIONAL, 0);
+		if (ret)
+			goto err_unpin;
 
-	if (in.buf_index >= TENSTORRENT_MAX_DMA_BUFS)
-		return -EINVAL;
+		pinning->dma_mapped = true;
 
-	if (in.requested_size % PAGE_SIZE != 0
-	    || in.requested_size == 0
-	    || in.requested_size > MAX_DMA_BUF_SIZE)
-		return -EINVAL;
+		ret = sgt_dma_range(&pinning->sgt, size, &pinning->dma_address);
+		if (ret) {
+			dev_err(dev, "discontiguous mapping\n");
+			debug_print_sgtable(dev, &pinning->sgt);
+			goto err_unmap;
+		}
+	} else {
+		struct scatterlist *sg;
+		phys_addr_t expected_next_address = sg_phys(pinning->sgt.sgl);
+		unsigned int i;
 
-	mutex_lock(&priv->mutex);
+		for_each_sg(pinning->sgt.sgl, sg, pinning->sgt.orig_nents, i) {
+			if (sg_phys(sg) != expected_next_address) {
+				ret = -EINVAL;
+				goto err_unpin;
+			}
 
-	if (lookup_dmabuf_by_index(priv, in.buf_index)) {
-		ret = -EINVAL;
-		goto out;
-	}
+			expected_next_address += sg->length;
+		}
 
-	dmabuf = kzalloc(sizeof(*dmabuf), GFP_KERNEL);
-	if (!dmabuf) {
-		ret = -ENOMEM;
-		goto out;
+		pinning->dma_address = sg_phys(pinning->sgt.sgl);
 	}
 
-	dma_buf_kernel_ptr = dma_alloc_coherent(&priv->device->pdev->dev,
-						in.requested_size,
-						&dma_handle, GFP_KERNEL);
+	pinning->file = get_file(file);
+	pinning->offset = offset;
+	pinning->size = size;
+	pinning->outbound_iatu_region = -1;
+	INIT_LIST_HEAD(&pinning->refs);
+	list_add(&pinning->list, &tt_dev->memfd_pinnings);
+
+	return pinning;
+
+err_unmap:
+	dma_unmap_sgtable(dev, &pinning->sgt, DMA_BIDIRECTIONAL, 0);
+err_unpin:
+	unpin_memfd_sgt(&pinning->sgt, false);
+	free_chained_sgt(&pinning->sgt);
+err_free:
+	kfree(pinning);
+	return ERR_PTR(ret);
+}
 
-	if (dma_buf_kernel_ptr == NULL) {
-		kfree(dmabuf);
-		ret = -ENOMEM;
-		goto out;
-	}
+// Caller holds priv->mutex and tt_dev->memfd_pin_mutex.
+static void free_memfd_pinning(struct chardev_private *priv, struct memfd_pinning *pinning)
+{
+	teardown_outbound_iatu(priv, pinning->outbound_iatu_region);
 
-	if (in.flags & TENSTORRENT_ALLOCATE_DMA_BUF_NOC_DMA) {
-		bool top_down = true;
-		ret = setup_noc_dma(priv, top_down, in.requested_size, dma_handle, &out.noc_address);
-		if (ret < 0) {
-			dma_free_coherent(&priv->device->pdev->dev, in.requested_size, dma_buf_kernel_ptr, dma_handle);
-			kfree(dmabuf);
-			goto out;
-		}
-		iatu_region = ret;
-		ret = 0;
-	}
+	if (pinning->dma_mapped)
+		dma_unmap_sgtable(&priv->device->pdev->dev, &pinning->sgt, DMA_BIDIRECTIONAL, 0);
 
-	dmabuf->index = in.buf_index;
-	dmabuf->ptr = dma_buf_kernel_ptr;
-	dmabuf->phys = dma_handle;
-	dmabuf->size = in.requested_size;
-	dmabuf->outbound_iatu_region = iatu_region;
+	unpin_memfd_sgt(&pinning->sgt, true);
+	free_chained_sgt(&pinning->sgt);
+	fput(pinning->file);
 
-	out.physical_address = (u64)dmabuf->phys;
-	out.mapping_offset = dmabuf_mapping_start(in.buf_index);
-	out.size = in.requested_size;
+	list_del(&pinning->list);
+	kfree(pinning);
+}
 
-	if (copy_to_user(&arg->out, &out, sizeof(out)) != 0) {
-		teardown_outbound_iatu(priv, iatu_region);
-		dma_free_coherent(&priv->device->pdev->dev, dmabuf->size,
-				  dmabuf->ptr, dmabuf->phys);
+// Caller holds priv->mutex and tt_dev->memfd_pin_mutex.
+static void put_memfd_pin_ref(struct chardev_private *priv, struct memfd_pin_ref *ref)
+{
+	struct tenstorrent_device *tt_dev = priv->device;
+	struct memfd_pinning *pinning = ref->pinning;
+	struct memfd_pin_ref *heir;
 
-		kfree(dmabuf);
-		ret = -EFAULT;
-		goto out;
+	list_del(&ref->list);
+	list_del(&ref->pinning_list);
+	kfree(ref);
+
+	if (list_empty(&pinning->refs)) {
+		free_memfd_pinning(priv, pinning);
+		return;
 	}
 
-	hash_add(priv->dmabufs, &dmabuf->hash_chain, dmabuf->index);
+	// The NOC window's iATU region records an owning fd, which may be
+	// about to close. Hand it to one that still holds the pinning.
+	if (pinning->outbound_iatu_region >= 0 && pinning->outbound_iatu_region != tt_dev->identity_iatu_region) {
+		heir = list_first_entry(&pinning->refs, struct memfd_pin_ref, pinning_list);
 
-out:
-	mutex_unlock(&priv->mutex);
-	return ret;
+		mutex_lock(&tt_dev->iatu_mutex);
+		tt_dev->outbound_iatus[pinning->outbound_iatu_region].priv = heir->priv;
+		mutex_unlock(&tt_dev->iatu_mutex);
+	}
 }
 
-long ioctl_free_dma_buf(struct chardev_private *priv,
-			struct tenstorrent_free_dma_buf __user *arg)
+static void release_memfd_pins(struct chardev_private *priv)
 {
-	// This is unsupported until I figure out how to block freeing as long
-	// as a mapping exists. Otherwise the dma buffer is freed when the
-	// struct file is destroyed, and that's safe because the mapping
-	// refcounts the file.
-	return -EINVAL;
+	struct tenstorrent_device *tt_dev = priv->device;
+	struct memfd_pin_ref *ref, *tmp;
+
+	mutex_lock(&tt_dev->memfd_pin_mutex);
+	list_for_each_entry_safe(ref, tmp, &priv->memfd_pins, list)
+		put_memfd_pin_ref(priv, ref);
+	mutex_unlock(&tt_dev->memfd_pin_mutex);
 }
 
+// The F_SEAL_* seals of a shmem or hugetlbfs file, which are all that
+// memfd_pin_folios accepts.
+static unsigned int memfd_seals(struct file *file)
+{
+	struct inode *inode = file_inode(file);
 
-bool is_iommu_translated(struct device *dev)
+	if (shmem_file(file))
+		return SHMEM_I(inode)->seals;
+#ifdef CONFIG_HUGETLBFS
+	if (inode->i_sb->s_magic == HUGETLBFS_MAGIC)
+		return HUGETLBFS_I(inode)->seals;
+#endif
+	return 0;
+}
+
+// The device may write the pinning, so the caller must be able to as well.
+static int check_memfd_writable(struct file *file)
 {
-	struct iommu_domain *domain = iommu_get_domain_for_dev(dev);
-	return domain && domain->type != IOMMU_DOMAIN_IDENTITY;
+	if (!(file->f_mode & FMODE_WRITE))
+		return -EBADF;
+
+	if (memfd_seals(file) & (F_SEAL_WRITE | F_SEAL_FUTURE_WRITE))
+		return -EPERM;
+
+	return 0;
 }
 
-static bool is_pin_pages_size_safe(u64 size)
+static bool is_memfd_range_valid(u64 offset, u64 size)
 {
-	// With IOMMU enabled on 5.4, 2GB pinnings may succeed, but then soft lockup on process exit.
-	// (tt_cdev_release -> unmap_sg -> __unmap_single -> iommu_unmap_page)
-	// This doesn't happen in 5.15, but I don't know exactly when it was fixed.
-#if LINUX_VERSION_CODE <= KERNEL_VERSION(5, 4, 0)
-	return size <= 1 << 30;
-#else
-	return true;
-#endif
+	return PAGE_ALIGNED(offset) && PAGE_ALIGNED(size) && size != 0
+	       && is_pin_pages_size_safe(size) && offset + size > offset;
 }
 
-long ioctl_pin_pages(struct chardev_private *priv,
-		     struct tenstorrent_pin_pages __user *arg)
+long ioctl_pin_memfd(struct chardev_private *priv, struct tenstorrent_pin_memfd __user *arg)
 {
-	const u32 valid_flags = TENSTORRENT_PIN_PAGES_CONTIGUOUS | TENSTORRENT_PIN_PAGES_NOC_DMA |
-				TENSTORRENT_PIN_PAGES_NOC_TOP_DOWN | TENSTORRENT_PIN_PAGES_READ_ONLY;
-	unsigned long nr_pages;
-	struct page **pages;
-	int pages_pinned;
-	struct pinned_page_range *pinning;
-	struct sg_table dma_mapping = {};
+	const u32 valid_flags = TENSTORRENT_PIN_MEMFD_NOC_DMA | TENSTORRENT_PIN_MEMFD_NOC_TOP_DOWN;
+	struct tenstorrent_device *tt_dev = priv->device;
+	struct tenstorrent_pin_memfd data = {0};
+	struct memfd_pinning *pinning;
+	struct memfd_pin_ref *ref;
+	bool created = false;
+	struct file *file;
+	u64 noc_address;
 	long ret;
-	u32 bytes_to_copy;
-	u64 noc_address = 0;
-	int iatu_region = -1;
-	bool noc_dma = false;
-	bool top_down = false;
-	bool read_only = false;
-	unsigned int gup_flags;
-	enum dma_data_direction dir;
-
-	struct tenstorrent_pin_pages_in in;
-	struct tenstorrent_pin_pages_out_extended out;
-	memset(&in, 0, sizeof(in));
-	memset(&out, 0, sizeof(out));
-
-	if (copy_from_user(&in, &arg->in, sizeof(in)) != 0)
-		return -EFAULT;
 
-	if (clear_user(&arg->out, in.output_size_bytes) != 0)
+	if (copy_from_user(&data, arg, sizeof(data)))
 		return -EFAULT;
 
-	if (in.flags & ~valid_flags)
+	if (data.argsz != sizeof(data))
 		return -EINVAL;
 
-	if (!PAGE_ALIGNED(in.virtual_address) || !PAGE_ALIGNED(in.size) || in.size == 0)
+	if ((data.flags & ~valid_flags) || data.reserved != 0)
 		return -EINVAL;
 
-	if (!is_pin_pages_size_safe(in.size))
+	if (!is_memfd_range_valid(data.offset, data.size))
 		return -EINVAL;
 
-	noc_dma = in.flags & (TENSTORRENT_PIN_PAGES_NOC_DMA | TENSTORRENT_PIN_PAGES_NOC_TOP_DOWN);
-	top_down = in.flags & TENSTORRENT_PIN_PAGES_NOC_TOP_DOWN;
-	read_only = in.flags & TENSTORRENT_PIN_PAGES_READ_ONLY;
+	file = fget(data.fd);
+	if (!file)
+		return -EBADF;
 
-	if (read_only && !is_iommu_translated(&priv->device->pdev->dev))
-		return -EOPNOTSUPP;
+	ret = check_memfd_writable(file);
+	if (ret)
+		goto out_fput;
 
-	gup_flags = read_only ? 0 : FOLL_WRITE;
-	dir = read_only ? DMA_TO_DEVICE : DMA_BIDIRECTIONAL;
+	ref = kzalloc(sizeof(*ref), GFP_KERNEL);
+	if (!ref) {
+		ret = -ENOMEM;
+		goto out_fput;
+	}
 
 	mutex_lock(&priv->mutex);
+	mutex_lock(&tt_dev->memfd_pin_mutex);
 
-	// Block duplicate (VA/size) pinnings. Prevents ambiguity in UNPIN_PAGES
-	// regarding iATU teardown if the same range were pinned multiple times with
-	// different NOC_DMA flags.
-	list_for_each_entry(pinning, &priv->pinnings, list) {
-		if (pinning->virtual_address == in.virtual_address &&
-		    pinning->page_count == PAGE_ALIGN(in.size) >> PAGE_SHIFT) {
-			mutex_unlock(&priv->mutex);
-			return -EEXIST;
-		}
-	}
-
-	pinning = kmalloc(sizeof(*pinning), GFP_KERNEL);
+	pinning = find_memfd_pinning(tt_dev, file_inode(file), data.offset, data.size);
 	if (!pinning) {
-		mutex_unlock(&priv->mutex);
-		return -ENOMEM;
-	}
-
-	nr_pages = PAGE_ALIGN(in.size) >> PAGE_SHIFT;
-	pages = vzalloc(nr_pages * sizeof(struct page *));
-	if (!pages) {
-		dev_err(&priv->device->pdev->dev, "vzalloc failed for %lu page pointers\n", nr_pages);
-		ret = -ENOMEM;
-		goto err_free_pinning;
+		pinning = create_memfd_pinning(tt_dev, file, data.offset, data.size);
+		if (IS_ERR(pinning)) {
+			ret = PTR_ERR(pinning);
+			goto out_unlock;
+		}
+		created = true;
 	}
 
-	pages_pinned = pin_user_pages_fast_longterm(in.virtual_address, nr_pages, gup_flags, pages);
-	if (pages_pinned < 0) {
-		dev_warn(&priv->device->pdev->dev, "pin_user_pages_longterm failed: %d\n", pages_pinned);
-		ret = pages_pinned;
-		goto err_vfree_pages;
-	}
+	if ((data.flags & TENSTORRENT_PIN_MEMFD_NOC_DMA) && pinning->outbound_iatu_region < 0) {
+		bool top_down = data.flags & TENSTORRENT_PIN_MEMFD_NOC_TOP_DOWN;
 
-	if (pages_pinned != nr_pages) {
-		dev_err(&priv->device->pdev->dev, "could only pin %d of %lu pages\n", pages_pinned, nr_pages);
-		ret = -EINVAL;
-		goto err_unpin_pages;
+		// Shared with other fds, so never in this one's reservation.
+		ret = setup_pinning_noc_dma(priv, false, top_down, data.size, pinning->dma_address, &noc_address);
+		if (ret < 0)
+			goto out_free_created;
+		pinning->outbound_iatu_region = ret;
 	}
 
-	if (is_iommu_translated(&priv->device->pdev->dev)) {
-		struct scatterlist *sg;
-		unsigned int i;
-		dma_addr_t expected_next_address;
-		unsigned long total_dma_len = 0;
-
-		if (!alloc_chained_sgt_for_pages(&dma_mapping, pages, nr_pages)) {
-			dev_warn(&priv->device->pdev->dev,
-				 "alloc_chained_sgt_for_pages failed for %lu pages, probably out of memory\n", nr_pages);
-			ret = -ENOMEM;
-			goto err_unpin_pages;
-		}
-
-		ret = dma_map_sgtable(&priv->device->pdev->dev, &dma_mapping, dir, 0);
-
-		if (ret != 0) {
-			dev_err(&priv->device->pdev->dev, "dma_map_sg failed\n");
-			goto err_unlock_priv;
-		}
-
-		// This can only happen due to a misconfiguration or a bug.
-		for_each_sgtable_dma_sg((&dma_mapping), sg, i) {
-			if (i > 0 && sg_dma_address(sg) != expected_next_address) {
-				dev_err(&priv->device->pdev->dev, "discontiguous mapping\n");
-				ret = -EINVAL;
-			}
-
-			expected_next_address = sg_dma_address(sg) + sg_dma_len(sg);
-			total_dma_len += sg_dma_len(sg);
-		}
-
-		if (total_dma_len != nr_pages * PAGE_SIZE) {
-			dev_err(&priv->device->pdev->dev, "dma-mapped (%lX) != original length (%lX)\n",
-				total_dma_len, nr_pages * PAGE_SIZE);
-			ret = -EINVAL;
-		}
-
-		if (ret != 0) {
-			debug_print_sgtable(&priv->device->pdev->dev, &dma_mapping);
-			goto err_dma_unmap;
-		}
-
-		out.physical_address = sg_dma_address(dma_mapping.sgl);
-
-		if (noc_dma) {
-			ret = setup_noc_dma(priv, top_down, in.size, out.physical_address, &noc_address);
+	data.physical_address = pinning->dma_address;
+	data.noc_address = 0;
+	if (data.flags & TENSTORRENT_PIN_MEMFD_NOC_DMA) {
+		struct tenstorrent_outbound_iatu_region *region = &tt_dev->outbound_iatus[pinning->outbound_iatu_region];
 
-			if (ret < 0)
-				goto err_dma_unmap;
-			iatu_region = ret;
-		}
-	} else {
-		int i;
-
-		for (i = 1; i < pages_pinned; i++) {
-			if (page_to_pfn(pages[i]) != page_to_pfn(pages[i-1]) + 1) {
-				dev_err(&priv->device->pdev->dev, "pages discontiguous at %d\n", i);
-				ret = -EINVAL;
-				goto err_unpin_pages;
-			}
-		}
-
-		out.physical_address = page_to_phys(pages[0]);
-
-		if (noc_dma) {
-			ret = setup_noc_dma(priv, top_down, in.size, out.physical_address, &noc_address);
-
-			if (ret < 0)
-				goto err_unpin_pages;
-			iatu_region = ret;
-		}
+		// The window may be the identity window rather than its own.
+		data.noc_address = tt_dev->dev_class->noc_pcie_offset + region->base
+				   + (pinning->dma_address - region->target);
 	}
 
-	out.noc_address = noc_address;
-	bytes_to_copy = min(in.output_size_bytes, (u32)sizeof(out));
-
-	if (copy_to_user(&arg->out, &out, bytes_to_copy) != 0) {
+	// Under the locks, so the reference can't be dropped before it's reported.
+	if (copy_to_user(arg, &data, sizeof(data))) {
 		ret = -EFAULT;
-		goto err_teardown_iatu;
+		goto out_free_created;
 	}
 
-	pinning->page_count = nr_pages;
-	pinning->pages = pages;
-	pinning->dma_mapping = dma_mapping;
-	pinning->virtual_address = in.virtual_address;
-	pinning->outbound_iatu_region = iatu_region;
-	pinning->read_only = read_only;
-
-	list_add(&pinning->list, &priv->pinnings);
-	mutex_unlock(&priv->mutex);
+	ref->priv = priv;
+	ref->pinning = pinning;
+	list_add(&ref->list, &priv->memfd_pins);
+	list_add_tail(&ref->pinning_list, &pinning->refs);
+	ref = NULL;
+	ret = 0;
 
-	return 0;
+	goto out_unlock;
 
-err_teardown_iatu:
-	// teardown_outbound_iatu is a no-op when iatu_region == -1.
-	// dma_unmap_sgtable and free_chained_sgt are no-ops on the
-	// zero-initialized dma_mapping from the non-IOMMU path.
-	teardown_outbound_iatu(priv, iatu_region);
-err_dma_unmap:
-	dma_unmap_sgtable(&priv->device->pdev->dev, &dma_mapping, dir, 0);
-err_unlock_priv:
-	free_chained_sgt(&dma_mapping);
-err_unpin_pages:
-	unpin_user_pages_dirty_lock(pages, pages_pinned, false);
-err_vfree_pages:
-	vfree(pages);
-err_free_pinning:
-	kfree(pinning);
+out_free_created:
+	if (created)
+		free_memfd_pinning(priv, pinning);
+out_unlock:
+	mutex_unlock(&tt_dev->memfd_pin_mutex);
 	mutex_unlock(&priv->mutex);
+	kfree(ref);
+out_fput:
+	fput(file);
 	return ret;
 }
 
-long ioctl_unpin_pages(struct chardev_private *priv,
-		       struct tenstorrent_unpin_pages __user *arg)
+long ioctl_unpin_memfd(struct chardev_private *priv, struct tenstorrent_unpin_memfd __user *arg)
 {
-	struct tenstorrent_unpin_pages_in in = {0};
-	struct pinned_page_range *pinning, *tmp_pinning;
-	unsigned long nr_pages;
+	struct tenstorrent_device *tt_dev = priv->device;
+	struct tenstorrent_unpin_memfd data = {0};
+	struct memfd_pin_ref *ref;
+	struct file *file;
 	long ret = -EINVAL;
 
-	if (copy_from_user(&in, &arg->in, sizeof(in)) != 0)
+	if (copy_from_user(&data, arg, sizeof(data)))
 		return -EFAULT;
 
-	nr_pages = in.size >> PAGE_SHIFT;
+	if (data.argsz != sizeof(data))
+		return -EINVAL;
 
-	if (in.reserved != 0 || in.size == 0 || nr_pages == 0)
+	if (data.flags != 0 || data.reserved != 0)
 		return -EINVAL;
 
+	file = fget(data.fd);
+	if (!file)
+		return -EBADF;
+
 	mutex_lock(&priv->mutex);
+	mutex_lock(&tt_dev->memfd_pin_mutex);
 
-	list_for_each_entry_safe(pinning, tmp_pinning, &priv->pinnings, list) {
-		if (pinning->virtual_address != in.virtual_address)
-			continue;
+	list_for_each_entry(ref, &priv->memfd_pins, list) {
+		struct memfd_pinning *pinning = ref->pinning;
 
-		if (pinning->page_count != nr_pages) {
-			ret = -EINVAL;
+		if (file_inode(pinning->file) == file_inode(file)
+		    && pinning->offset == data.offset && pinning->size == data.size) {
+			put_memfd_pin_ref(priv, ref);
+			ret = 0;
 			break;
 		}
-
-		unpin_pinned_page_range(priv, pinning);
-		ret = 0;
-		break;
 	}
 
+	mutex_unlock(&tt_dev->memfd_pin_mutex);
 	mutex_unlock(&priv->mutex);
+
+	fput(file);
 	return ret;
 }
 
+#else /* !TENSTORRENT_PIN_MEMFD */
+
+static void release_memfd_pins(struct chardev_private *priv)
+{
+}
+
+long ioctl_pin_memfd(struct chardev_private *priv, struct tenstorrent_pin_memfd __user *arg)
+{
+	return -EOPNOTSUPP;
+}
+
+long ioctl_unpin_memfd(struct chardev_private *priv, struct tenstorrent_unpin_memfd __user *arg)
+{
+	return -EOPNOTSUPP;
+}
+
+#endif /* TENSTORRENT_PIN_MEMFD */
+
 long ioctl_map_peer_bar(struct chardev_private *priv,
 			struct tenstorrent_map_peer_bar __user *arg) {
 
@@ -955,19 +3823,19 @@ long ioctl_allocate_tlb(struct chardev_private *priv,
 	if (copy_from_user(&in, &arg->in, sizeof(in)))
 		return -EFAULT;
 
-	id = tenstorrent_device_allocate_tlb(tt_dev, in.size);
+	id = tenstorrent_device_allocate_tlb(tt_dev, &priv->tlb_quota, in.size);
 
 	if (id < 0)
 		return id;
 
 	if (tt_dev->dev_class->describe_tlb(tt_dev, id, &tlb_desc)) {
-		tenstorrent_device_free_tlb(tt_dev, id);
+		tenstorrent_device_free_tlb(tt_dev, &priv->tlb_quota, id);
 		return -EINVAL;
 	}
 
 	// TLB windows only exist in BAR0 (GS/WH/BH) and BAR4 (BH).
 	if (tlb_desc.bar != 0 && tlb_desc.bar != 4) {
-		tenstorrent_device_free_tlb(tt_dev, id);
+		tenstorrent_device_free_tlb(tt_dev, &priv->tlb_quota, id);
 		return -EINVAL;
 	}
 
@@ -984,7 +3852,7 @@ long ioctl_allocate_tlb(struct chardev_private *priv,
 	out.mmap_offset_wc = MMAP_OFFSET_TLB_WC + encoded_id;
 
 	if (copy_to_user(&arg->out, &out, sizeof(out))) {
-		tenstorrent_device_free_tlb(tt_dev, id);
+		tenstorrent_device_free_tlb(tt_dev, &priv->tlb_quota, id);
 		return -EFAULT;
 	}
 
@@ -1026,13 +3894,45 @@ long ioctl_free_tlb(struct chardev_private *priv, struct tenstorrent_free_tlb __
 	mutex_unlock(&priv->vma_lock);
 
 	clear_bit(in.id, priv->tlbs);
-	ret = tenstorrent_device_free_tlb(tt_dev, in.id);
+	ret = tenstorrent_device_free_tlb(tt_dev, &priv->tlb_quota, in.id);
 
 unlock:
 	mutex_unlock(&priv->tlb_mutex);
 	return ret;
 }
 
+long ioctl_set_tlb_quota(struct chardev_private *priv, struct tenstorrent_set_tlb_quota __user *arg)
+{
+	struct tenstorrent_device *tt_dev = priv->device;
+	struct tenstorrent_set_tlb_quota data = {0};
+	u32 limit;
+	int kind;
+
+	if (copy_from_user(&data, arg, sizeof(data)))
+		return -EFAULT;
+
+	if (data.argsz != sizeof(data))
+		return -EINVAL;
+
+	if (data.flags != 0)
+		return -EINVAL;
+
+	kind = tenstorrent_tlb_kind_for_size(tt_dev, data.size);
+	if (kind < 0)
+		return kind;
+
+	limit = data.limit ? data.limit : tenstorrent_tlb_default_limit(tt_dev, kind);
+
+	if (limit > tt_dev->tlb_counts[kind] || data.reserve > limit)
+		return -EINVAL;
+
+	if ((data.reserve > 0 || limit > tenstorrent_tlb_default_limit(tt_dev, kind)) &&
+	    !capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	return tenstorrent_tlb_set_quota(tt_dev, &priv->tlb_quota, kind, data.limit, data.reserve);
+}
+
 long ioctl_configure_tlb(struct chardev_private *priv,
 			 struct tenstorrent_configure_tlb __user *arg) {
 	struct tenstorrent_device *tt_dev = priv->device;
@@ -1058,7 +3958,7 @@ long ioctl_configure_tlb(struct chardev_private *priv,
 	return ret;
 }
 
-// On kernels older than 5.8.0, EXPORT_TLB_DMABUF is unsupported.
+// On kernels older than 5.8.0, EXPORT_TLB_DMABUF and EXPORT_DMA_BUF are unsupported.
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
 
 // dma_buf_export() and friends live in the DMA_BUF symbol namespace.
@@ -1338,6 +4238,368 @@ unlock:
 	return ret;
 }
 
+// An exported ALLOCATE_DMA_BUF buffer. The dma-buf's priv is the struct dmabuf
+// itself; the dma-buf holds a reference on it and on the device, so the buffer
+// survives close() of the owning fd and device removal, and FREE_DMA_BUF fails
+// with -EBUSY until the dma-buf is released.
+
+// Describe the buffer's memory with a page-backed sg_table for the importer.
+static int host_dmabuf_pages_sgt(struct dmabuf *buf, struct sg_table *sgt)
+{
+	struct scatterlist *sg;
+	struct page *first;
+	u64 off = 0;
+	int ret;
+	int i;
+
+	switch (buf->backing) {
+	case DMABUF_COHERENT:
+		return dma_get_sgtable(&buf->device->pdev->dev, sgt, buf->ptr, buf->phys, buf->size);
+
+	case DMABUF_PAGES:
+		return sg_alloc_table_from_pages(sgt, buf->pages, buf->size >> PAGE_SHIFT, 0,
+						 buf->size, GFP_KERNEL);
+
+	case DMABUF_POOL:
+		// Physically contiguous, but may exceed the 32-bit sg length.
+		first = is_vmalloc_addr(buf->ptr) ? vmalloc_to_page(buf->ptr) : virt_to_page(buf->ptr);
+
+		ret = sg_alloc_table(sgt, DIV_ROUND_UP(buf->size, TT_TLB_DMABUF_SG_CHUNK), GFP_KERNEL);
+		if (ret)
+			return ret;
+
+		for_each_sg(sgt->sgl, sg, sgt->orig_nents, i) {
+			u64 len = min_t(u64, TT_TLB_DMABUF_SG_CHUNK, buf->size - off);
+
+			sg_set_page(sg, nth_page(first, off >> PAGE_SHIFT), len, 0);
+			off += len;
+		}
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+static struct sg_table *host_dmabuf_map(struct dma_buf_attachment *attach, enum dma_data_direction dir)
+{
+	struct dmabuf *buf = attach->dmabuf->priv;
+	struct sg_table *sgt;
+	int ret;
+
+	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	if (!sgt)
+		return ERR_PTR(-ENOMEM);
+
+	ret = host_dmabuf_pages_sgt(buf, sgt);
+	if (ret) {
+		kfree(sgt);
+		return ERR_PTR(ret);
+	}
+
+	// attach->dev is the importing device (e.g. the NIC).
+	ret = dma_map_sgtable(attach->dev, sgt, dir, 0);
+	if (ret) {
+		sg_free_table(sgt);
+		kfree(sgt);
+		return ERR_PTR(ret);
+	}
+
+	return sgt;
+}
+
+static void host_dmabuf_unmap(struct dma_buf_attachment *attach, struct sg_table *sgt, enum dma_data_direction dir)
+{
+	dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+static const struct vm_operations_struct host_dmabuf_fault_vm_ops = {
+#ifdef TENSTORRENT_DMA_BUF_PMD_MAPPINGS
+	.fault = dmabuf_vma_fault,
+	.huge_fault = dmabuf_vma_huge_fault,
+#endif
+};
+
+static int host_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+	// The dma-buf file, referenced by the VMA, keeps the buffer alive.
+	if (dmabuf_mapped_on_fault(dmabuf->priv, vma))
+		vma->vm_ops = &host_dmabuf_fault_vm_ops;
+	vma->vm_private_data = dmabuf->priv;
+
+	return mmap_dmabuf_memory(dmabuf->priv, vma);
+}
+
+// Cacheable buffers need the same ownership handoff as SYNC_DMA_BUF when the
+// CPU accesses them through the dma-buf.
+static int host_dmabuf_begin_cpu_access(struct dma_buf *dmabuf, enum dma_data_direction dir)
+{
+	struct dmabuf *buf = dmabuf->priv;
+
+	if (buf->backing == DMABUF_PAGES)
+		dma_sync_sg_for_cpu(&buf->device->pdev->dev, buf->dma_mapping.sgl,
+				    buf->dma_mapping.orig_nents, DMA_BIDIRECTIONAL);
+	return 0;
+}
+
+static int host_dmabuf_end_cpu_access(struct dma_buf *dmabuf, enum dma_data_direction dir)
+{
+	struct dmabuf *buf = dmabuf->priv;
+
+	if (buf->backing == DMABUF_PAGES)
+		dma_sync_sg_for_device(&buf->device->pdev->dev, buf->dma_mapping.sgl,
+				       buf->dma_mapping.orig_nents, DMA_BIDIRECTIONAL);
+	return 0;
+}
+
+static void host_dmabuf_release(struct dma_buf *dmabuf)
+{
+	struct dmabuf *buf = dmabuf->priv;
+	struct tenstorrent_device *tt_dev = buf->device;
+
+	kref_put(&buf->kref, release_dmabuf);
+	put_device(&tt_dev->dev);
+}
+
+static const struct dma_buf_ops host_dmabuf_ops = {
+	.map_dma_buf = host_dmabuf_map,
+	.unmap_dma_buf = host_dmabuf_unmap,
+	.mmap = host_dmabuf_mmap,
+	.begin_cpu_access = host_dmabuf_begin_cpu_access,
+	.end_cpu_access = host_dmabuf_end_cpu_access,
+	.release = host_dmabuf_release,
+};
+
+long ioctl_export_dma_buf(struct chardev_private *priv, struct tenstorrent_export_dma_buf __user *arg)
+{
+	struct tenstorrent_device *tt_dev = priv->device;
+	struct tenstorrent_export_dma_buf in = {0};
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+	struct dma_buf *dmabuf;
+	struct dmabuf *buf;
+	int fd;
+
+	if (copy_from_user(&in, arg, sizeof(in)))
+		return -EFAULT;
+
+	if (in.argsz != sizeof(in))
+		return -EINVAL;
+
+	if (in.flags != 0)
+		return -EINVAL;
+
+	mutex_lock(&priv->dmabuf_mutex);
+	buf = lookup_dmabuf_by_index(priv, in.buf_index);
+	if (buf)
+		kref_get(&buf->kref);
+	mutex_unlock(&priv->dmabuf_mutex);
+
+	if (!buf)
+		return -EINVAL;
+
+	// Both references are dropped in host_dmabuf_release().
+	get_device(&tt_dev->dev);
+
+	exp_info.ops = &host_dmabuf_ops;
+	exp_info.size = buf->size;
+	exp_info.flags = O_RDWR | O_CLOEXEC;
+	exp_info.priv = buf;
+
+	dmabuf = dma_buf_export(&exp_info);
+	if (IS_ERR(dmabuf)) {
+		kref_put(&buf->kref, release_dmabuf);
+		put_device(&tt_dev->dev);
+		return PTR_ERR(dmabuf);
+	}
+
+	fd = get_unused_fd_flags(O_CLOEXEC);
+	if (fd < 0) {
+		dma_buf_put(dmabuf);
+		return fd;
+	}
+
+	in.fd = fd;
+	if (copy_to_user(arg, &in, sizeof(in))) {
+		put_unused_fd(fd);
+		dma_buf_put(dmabuf);
+		return -EFAULT;
+	}
+
+	// Transfer the dma_buf's file reference to the new fd.
+	fd_install(fd, dmabuf->file);
+
+	return 0;
+}
+
+// dma_buf_map_attachment() expects the reservation lock held from 6.2.
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 2, 0)
+#define dma_buf_map_attachment_unlocked dma_buf_map_attachment
+#define dma_buf_unmap_attachment_unlocked dma_buf_unmap_attachment
+#endif
+
+static struct dmabuf_import *find_dmabuf_import(struct chardev_private *priv, u32 handle)
+{
+	struct dmabuf_import *import;
+
+	list_for_each_entry(import, &priv->dmabuf_imports, list) {
+		if (import->handle == handle)
+			return import;
+	}
+
+	return NULL;
+}
+
+// Caller holds priv->mutex.
+static void release_dmabuf_import(struct chardev_private *priv, struct dmabuf_import *import)
+{
+	struct dma_buf *dmabuf = import->attachment->dmabuf;
+
+	teardown_outbound_iatu(priv, import->outbound_iatu_region);
+	dma_buf_unmap_attachment_unlocked(import->attachment, import->sgt, DMA_BIDIRECTIONAL);
+	dma_buf_detach(dmabuf, import->attachment);
+	dma_buf_put(dmabuf);
+
+	list_del(&import->list);
+	kfree(import);
+}
+
+static void release_dmabuf_imports(struct chardev_private *priv)
+{
+	struct dmabuf_import *import, *tmp;
+
+	list_for_each_entry_safe(import, tmp, &priv->dmabuf_imports, list)
+		release_dmabuf_import(priv, import);
+}
+
+long ioctl_import_dma_buf(struct chardev_private *priv, struct tenstorrent_import_dma_buf __user *arg)
+{
+	struct tenstorrent_device *tt_dev = priv->device;
+	struct tenstorrent_import_dma_buf in = {0};
+	struct dma_buf_attachment *attachment;
+	struct dmabuf_import *import;
+	struct dma_buf *dmabuf;
+	struct sg_table *sgt;
+	dma_addr_t dma_address;
+	u64 noc_address = 0;
+	int iatu_region = -1;
+	long ret;
+
+	if (copy_from_user(&in, arg, sizeof(in)))
+		return -EFAULT;
+
+	if (in.argsz != sizeof(in))
+		return -EINVAL;
+
+	if (in.flags & ~(TENSTORRENT_IMPORT_DMA_BUF_NOC_DMA | TENSTORRENT_IMPORT_DMA_BUF_NOC_TOP_DOWN))
+		return -EINVAL;
+
+	dmabuf = dma_buf_get(in.fd);
+	if (IS_ERR(dmabuf))
+		return PTR_ERR(dmabuf);
+
+	import = kzalloc(sizeof(*import), GFP_KERNEL);
+	if (!import) {
+		ret = -ENOMEM;
+		goto err_put;
+	}
+
+	// A static attachment: the exporter pins the buffer for as long as it
+	// is mapped, so the address we hand out stays valid.
+	attachment = dma_buf_attach(dmabuf, &tt_dev->pdev->dev);
+	if (IS_ERR(attachment)) {
+		ret = PTR_ERR(attachment);
+		goto err_free;
+	}
+
+	sgt = dma_buf_map_attachment_unlocked(attachment, DMA_BIDIRECTIONAL);
+	if (IS_ERR(sgt)) {
+		ret = PTR_ERR(sgt);
+		goto err_detach;
+	}
+
+	ret = sgt_dma_range(sgt, dmabuf->size, &dma_address);
+	if (ret)
+		goto err_unmap;
+
+	mutex_lock(&priv->mutex);
+
+	if (in.flags & TENSTORRENT_IMPORT_DMA_BUF_NOC_DMA) {
+		bool top_down = in.flags & TENSTORRENT_IMPORT_DMA_BUF_NOC_TOP_DOWN;
+
+		iatu_region = setup_noc_dma(priv, true, top_down, 1, dmabuf->size, dma_address, &noc_address);
+		if (iatu_region < 0) {
+			ret = iatu_region;
+			goto err_unlock;
+		}
+	}
+
+	do {
+		import->handle = ++priv->dmabuf_import_last_handle;
+	} while (import->handle == 0 || find_dmabuf_import(priv, import->handle));
+
+	import->attachment = attachment;
+	import->sgt = sgt;
+	import->outbound_iatu_region = iatu_region;
+
+	in.handle = import->handle;
+	in.size = dmabuf->size;
+	in.dma_address = dma_address;
+	in.noc_address = noc_address;
+
+	if (copy_to_user(arg, &in, sizeof(in))) {
+		ret = -EFAULT;
+		goto err_teardown;
+	}
+
+	list_add_tail(&import->list, &priv->dmabuf_imports);
+
+	mutex_unlock(&priv->mutex);
+
+	// The attachment holds the dma-buf reference from dma_buf_get().
+	return 0;
+
+err_teardown:
+	teardown_outbound_iatu(priv, iatu_region);
+err_unlock:
+	mutex_unlock(&priv->mutex);
+err_unmap:
+	dma_buf_unmap_attachment_unlocked(attachment, sgt, DMA_BIDIRECTIONAL);
+err_detach:
+	dma_buf_detach(dmabuf, attachment);
+err_free:
+	kfree(import);
+err_put:
+	dma_buf_put(dmabuf);
+	return ret;
+}
+
+long ioctl_release_dma_buf_import(struct chardev_private *priv,
+				  struct tenstorrent_release_dma_buf_import __user *arg)
+{
+	struct tenstorrent_release_dma_buf_import in = {0};
+	struct dmabuf_import *import;
+
+	if (copy_from_user(&in, arg, sizeof(in)))
+		return -EFAULT;
+
+	if (in.argsz != sizeof(in))
+		return -EINVAL;
+
+	if (in.flags != 0 || in.reserved != 0)
+		return -EINVAL;
+
+	mutex_lock(&priv->mutex);
+
+	import = find_dmabuf_import(priv, in.handle);
+	if (import)
+		release_dmabuf_import(priv, import);
+
+	mutex_unlock(&priv->mutex);
+
+	return import ? 0 : -EINVAL;
+}
+
 void tenstorrent_revoke_tlb_dmabufs(struct tenstorrent_device *tt_dev)
 {
 	struct tt_tlb_dmabuf *exp;
@@ -1374,6 +4636,26 @@ long ioctl_export_tlb_dmabuf(struct chardev_private *priv, struct tenstorrent_ex
 	return -EOPNOTSUPP;
 }
 
+long ioctl_export_dma_buf(struct chardev_private *priv, struct tenstorrent_export_dma_buf __user *arg)
+{
+	return -EOPNOTSUPP;
+}
+
+long ioctl_import_dma_buf(struct chardev_private *priv, struct tenstorrent_import_dma_buf __user *arg)
+{
+	return -EOPNOTSUPP;
+}
+
+long ioctl_release_dma_buf_import(struct chardev_private *priv,
+				  struct tenstorrent_release_dma_buf_import __user *arg)
+{
+	return -EOPNOTSUPP;
+}
+
+static void release_dmabuf_imports(struct chardev_private *priv)
+{
+}
+
 void tenstorrent_revoke_tlb_dmabufs(struct tenstorrent_device *tt_dev)
 {
 }
@@ -1410,8 +4692,12 @@ static struct dmabuf *vma_dmabuf_target(struct chardev_private *priv,
 		// Not in DMA buffer offset range (too low).
 		return NULL;
 
-	dmabuf_index = (vma->vm_pgoff - (MMAP_OFFSET_DMA_BUF >> PAGE_SHIFT)) / (MMAP_SIZE_DMA_BUF >> PAGE_SHIFT);
-	if (dmabuf_index >= TENSTORRENT_MAX_DMA_BUFS)
+	if (vma->vm_pgoff < MMAP_OFFSET_DMA_BUF_HANDLE >> PAGE_SHIFT)
+		dmabuf_index = (vma->vm_pgoff - (MMAP_OFFSET_DMA_BUF >> PAGE_SHIFT)) / (MMAP_SIZE_DMA_BUF >> PAGE_SHIFT);
+	else
+		dmabuf_index = (vma->vm_pgoff - (MMAP_OFFSET_DMA_BUF_HANDLE >> PAGE_SHIFT)) / (MMAP_SIZE_DMA_BUF >> PAGE_SHIFT);
+
+	if (dmabuf_index > U32_MAX)
 		// Not in DMA buffer offset range (too high).
 		return NULL;
 
@@ -1645,6 +4931,63 @@ unlock:
 	return ret;
 }
 
+static void dmabuf_vma_open(struct vm_area_struct *vma)
+{
+	struct dmabuf *dmabuf = vma->vm_private_data;
+
+	kref_get(&dmabuf->kref);
+}
+
+static void dmabuf_vma_close(struct vm_area_struct *vma)
+{
+	struct dmabuf *dmabuf = vma->vm_private_data;
+
+	kref_put(&dmabuf->kref, release_dmabuf);
+}
+
+static const struct vm_operations_struct dmabuf_vm_ops = {
+	.open = dmabuf_vma_open,
+	.close = dmabuf_vma_close,
+};
+
+static const struct vm_operations_struct dmabuf_fault_vm_ops = {
+	.open = dmabuf_vma_open,
+	.close = dmabuf_vma_close,
+#ifdef TENSTORRENT_DMA_BUF_PMD_MAPPINGS
+	.fault = dmabuf_vma_fault,
+	.huge_fault = dmabuf_vma_huge_fault,
+#endif
+};
+
+static int map_dmabuf(struct chardev_private *priv, struct vm_area_struct *vma)
+{
+	struct dmabuf *dmabuf;
+	int ret;
+
+	mutex_lock(&priv->dmabuf_mutex);
+
+	dmabuf = vma_dmabuf_target(priv, vma);
+	if (!dmabuf) {
+		mutex_unlock(&priv->dmabuf_mutex);
+		return -EINVAL;
+	}
+
+	// The VMA's reference keeps FREE_DMA_BUF from freeing the buffer.
+	kref_get(&dmabuf->kref);
+	mutex_unlock(&priv->dmabuf_mutex);
+
+	ret = mmap_dmabuf_memory(dmabuf, vma);
+	if (ret) {
+		kref_put(&dmabuf->kref, release_dmabuf);
+		return ret;
+	}
+
+	vma->vm_ops = dmabuf_mapped_on_fault(dmabuf, vma) ? &dmabuf_fault_vm_ops : &dmabuf_vm_ops;
+	vma->vm_private_data = dmabuf;
+
+	return 0;
+}
+
 int tenstorrent_mmap(struct chardev_private *priv, struct vm_area_struct *vma)
 {
 	struct pci_dev *pdev = priv->device->pdev;
@@ -1697,37 +5040,42 @@ int tenstorrent_mmap(struct chardev_private *priv, struct vm_area_struct *vma)
 		return map_tlb_window(priv, vma, BAR_MAPPING_WC);
 
 	} else {
-		struct dmabuf *dmabuf = vma_dmabuf_target(priv, vma);
-		if (dmabuf != NULL)
-			return dma_mmap_coherent(&pdev->dev, vma, dmabuf->ptr,
-						 dmabuf->phys, dmabuf->size);
-		else
-			return -EINVAL;
+		return map_dmabuf(priv, vma);
 	}
 }
 
 void tenstorrent_memory_cleanup(struct chardev_private *priv)
 {
-	struct tenstorrent_device *tt_dev = priv->device;
 	struct pinned_page_range *pinning, *tmp_pinning;
-	struct hlist_node *tmp_dmabuf;
 	struct dmabuf *dmabuf;
-	unsigned int i;
+	struct rb_node *node;
+	unsigned long index;
 	struct peer_resource_mapping *peer_mapping, *tmp_peer_mapping;
 
 	mutex_lock(&priv->mutex);
 
-	hash_for_each_safe(priv->dmabufs, i, tmp_dmabuf, dmabuf, hash_chain) {
-		dma_free_coherent(&tt_dev->pdev->dev, dmabuf->size, dmabuf->ptr, dmabuf->phys);
+	// On close no VMA can remain, but if the device is being removed the
+	// buffers may still be mapped; those are freed on the final munmap.
+	mutex_lock(&priv->dmabuf_mutex);
+	xa_for_each(&priv->dmabufs, index, dmabuf) {
 		teardown_outbound_iatu(priv, dmabuf->outbound_iatu_region);
-		hash_del(&dmabuf->hash_chain);
-		kfree(dmabuf);
+		xa_erase(&priv->dmabufs, index);
+		kref_put(&dmabuf->kref, release_dmabuf);
 	}
+	mutex_unlock(&priv->dmabuf_mutex);
 
-	list_for_each_entry_safe(pinning, tmp_pinning, &priv->pinnings, list) {
+	while ((node = rb_first_cached(&priv->pinnings))) {
+		pinning = rb_entry(node, struct pinned_page_range, rb);
 		unpin_pinned_page_range(priv, pinning);
 	}
 
+	// Only pinnings whose window a reset reclaimed can be left retired.
+	list_for_each_entry_safe(pinning, tmp_pinning, &priv->noc_retired_pinnings, noc_retired)
+		free_retired_pinning(priv, pinning);
+
+	release_dmabuf_imports(priv);
+	release_memfd_pins(priv);
+
 	list_for_each_entry_safe(peer_mapping, tmp_peer_mapping, &priv->peer_mappings, list) {
 		dma_unmap_resource(&priv->device->pdev->dev, peer_mapping->mapped_address, peer_mapping->size, DMA_BIDIRECTIONAL, 0);
 
@@ -1735,7 +5083,14 @@ void tenstorrent_memory_cleanup(struct chardev_private *priv)
 		kfree(peer_mapping);
 	}
 
+	mutex_lock(&priv->device->iatu_mutex);
+	release_iatu_reservation(priv);
+	mutex_unlock(&priv->device->iatu_mutex);
+
 	mutex_unlock(&priv->mutex);
+
+	// With no pinnings left no notifier can queue it again.
+	cancel_work_sync(&priv->pin_cache_work);
 }
 
 // Compatibility for kernels < 5.8 (mmap_sem vs mmap_lock)
@@ -6,31 +6,85 @@
 
 #include <linux/compiler.h>
 #include <linux/scatterlist.h>
+#include <linux/rbtree.h>
+#include <linux/version.h>
+#include <linux/mmu_notifier.h>
+
+#include "range_alloc.h"
 
 #define MAX_DMA_BUF_SIZE_LOG2 28
+#define MAX_POOL_DMA_BUF_SIZE_LOG2 32
+
+// Userspace mappings of DMA buffers may use PMD entries where the kernel
+// supports huge PFN mappings (6.12+).
+#ifdef CONFIG_ARCH_SUPPORTS_PMD_PFNMAP
+#define TENSTORRENT_DMA_BUF_PMD_MAPPINGS
+#endif
+
+// TENSTORRENT_PIN_PAGES_CACHE needs interval notifiers to learn when a cached
+// VA range stops referring to the pinned pages.
+#if IS_ENABLED(CONFIG_MMU_NOTIFIER) && LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+#define TENSTORRENT_PIN_CACHE
+#endif
+
+// PIN_MEMFD pins through memfd_pin_folios (6.11+).
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+#define TENSTORRENT_PIN_MEMFD
+#endif
 
 struct chardev_private;
 struct tenstorrent_device;
 struct tenstorrent_query_mappings;
 struct tenstorrent_allocate_dma_buf;
 struct tenstorrent_free_dma_buf;
+struct tenstorrent_sync_dma_buf;
+struct tenstorrent_export_dma_buf;
+struct tenstorrent_import_dma_buf;
+struct tenstorrent_release_dma_buf_import;
 struct tenstorrent_pin_pages;
+struct tenstorrent_pin_pages_batch;
+struct tenstorrent_pin_pages_async;
+struct tenstorrent_pin_pages_complete;
+struct tenstorrent_lookup_pinning;
+struct tenstorrent_get_pin_segments;
+struct tenstorrent_pin_memfd;
+struct tenstorrent_unpin_memfd;
 struct tenstorrent_map_peer_bar;
 struct tenstorrent_export_tlb_dmabuf;
+struct tenstorrent_set_tlb_quota;
 struct vm_area_struct;
 
 struct pinned_page_range {
-	struct list_head list;
+	// In chardev_private.pinnings, an interval tree over the pinned VAs.
+	struct rb_node rb;
+	u64 subtree_last;
 
 	unsigned long page_count;
-	struct page **pages;	// vmalloc/vfree
 
-	struct sg_table dma_mapping;	// alloc_chained_sgt_for_pages / free_chained_sgt
+	// The pinned pages, one entry per physically contiguous run
+	// (chained_sgt_builder / free_chained_sgt). DMA-mapped if dma_mapped.
+	struct sg_table sgt;
+	bool dma_mapped;
+	bool discontiguous;	// physically, without an IOMMU (SEGMENTED)
 	u64 virtual_address;
 
-	int outbound_iatu_region;
+	int outbound_iatu_region;	// possibly shared, see coalesce_pinning_noc_dma
+	struct list_head window_link;	// in chardev_private.pinning_windows while live
+	struct list_head noc_retired;	// in chardev_private.noc_retired_pinnings once retired
 
 	bool read_only;	// IOMMU forbids device writes
+
+#ifdef TENSTORRENT_PIN_CACHE
+	// TENSTORRENT_PIN_PAGES_CACHE only. Once every PIN_PAGES is matched by an
+	// UNPIN_PAGES the pinning is idle and waits on priv->pin_cache_lru for
+	// reuse. The notifier marks it stale when the VA range is unmapped.
+	struct chardev_private *priv;
+	struct mmu_interval_notifier notifier;
+	struct list_head cache_lru;
+	unsigned int cache_users;
+	bool cached;
+	bool cache_stale;
+#endif
 };
 
 
@@ -40,10 +94,34 @@ long ioctl_allocate_dma_buf(struct chardev_private *priv,
 			    struct tenstorrent_allocate_dma_buf __user *arg);
 long ioctl_free_dma_buf(struct chardev_private *priv,
 			struct tenstorrent_free_dma_buf __user *arg);
+long ioctl_sync_dma_buf(struct chardev_private *priv,
+			struct tenstorrent_sync_dma_buf __user *arg);
+long ioctl_export_dma_buf(struct chardev_private *priv,
+			  struct tenstorrent_export_dma_buf __user *arg);
+long ioctl_import_dma_buf(struct chardev_private *priv,
+			  struct tenstorrent_import_dma_buf __user *arg);
+long ioctl_release_dma_buf_import(struct chardev_private *priv,
+				  struct tenstorrent_release_dma_buf_import __user *arg);
 long ioctl_pin_pages(struct chardev_private *priv,
 		     struct tenstorrent_pin_pages __user *arg);
+long ioctl_pin_pages_batch(struct chardev_private *priv,
+			   struct tenstorrent_pin_pages_batch __user *arg);
+long ioctl_pin_pages_async(struct chardev_private *priv,
+			   struct tenstorrent_pin_pages_async __user *arg);
+long ioctl_pin_pages_complete(struct chardev_private *priv,
+			      struct tenstorrent_pin_pages_complete __user *arg);
 long ioctl_unpin_pages(struct chardev_private *priv,
 		     struct tenstorrent_unpin_pages __user *arg);
+long ioctl_lookup_pinning(struct chardev_private *priv,
+			  struct tenstorrent_lookup_pinning __user *arg);
+long ioctl_get_pin_segments(struct chardev_private *priv,
+			    struct tenstorrent_get_pin_segments __user *arg);
+long ioctl_pin_memfd(struct chardev_private *priv,
+		     struct tenstorrent_pin_memfd __user *arg);
+long ioctl_unpin_memfd(struct chardev_private *priv,
+		       struct tenstorrent_unpin_memfd __user *arg);
+long ioctl_reserve_outbound_iatu(struct chardev_private *priv,
+				 struct tenstorrent_reserve_outbound_iatu __user *arg);
 long ioctl_map_peer_bar(struct chardev_private *priv,
 			struct tenstorrent_map_peer_bar __user *arg);
 long ioctl_allocate_tlb(struct chardev_private *priv,
@@ -54,14 +132,28 @@ long ioctl_configure_tlb(struct chardev_private *priv,
 			struct tenstorrent_configure_tlb __user *arg);
 long ioctl_export_tlb_dmabuf(struct chardev_private *priv,
 			struct tenstorrent_export_tlb_dmabuf __user *arg);
+long ioctl_set_tlb_quota(struct chardev_private *priv,
+			 struct tenstorrent_set_tlb_quota __user *arg);
 
 int tenstorrent_mmap(struct chardev_private *priv, struct vm_area_struct *vma);
+void tenstorrent_pin_cache_init(struct chardev_private *priv);
+bool tenstorrent_async_pin_completed(struct chardev_private *priv);
+void tenstorrent_async_pin_cleanup(struct chardev_private *priv);
 void tenstorrent_memory_cleanup(struct chardev_private *priv);
+int tenstorrent_memory_init(void);
+void tenstorrent_memory_exit(void);
 void tenstorrent_vma_zap(struct tenstorrent_device *tt_dev);
+void tenstorrent_iatu_init(struct tenstorrent_device *tt_dev);
+void tenstorrent_identity_noc_window_init(struct tenstorrent_device *tt_dev, u64 last);
 void tenstorrent_reset_reclaim_iatus(struct tenstorrent_device *tt_dev);
 void tenstorrent_revoke_tlb_dmabufs(struct tenstorrent_device *tt_dev);
 bool tenstorrent_has_tlb_dmabuf_exports(struct tenstorrent_device *tt_dev);
 bool is_iommu_translated(struct device *dev);
+void tenstorrent_dma_buf_pool_init(struct tenstorrent_device *tt_dev);
+void tenstorrent_dma_buf_pool_destroy(struct tenstorrent_device *tt_dev);
+void tenstorrent_dma_buf_cache_init(struct tenstorrent_device *tt_dev);
+void tenstorrent_dma_buf_cache_flush(struct tenstorrent_device *tt_dev);
+unsigned int tenstorrent_max_dma_buf_size_log2(struct tenstorrent_device *tt_dev);
 
 #define TENSTORRENT_MAX_OUTBOUND_IATU_REGIONS 16
 struct tenstorrent_outbound_iatu_region {
@@ -69,6 +161,9 @@ struct tenstorrent_outbound_iatu_region {
 	u64 base;
 	u64 limit;
 	u64 target;
+	struct range_alloc_node range;	// [base, limit] in space
+	struct range_alloc *space;	// noc_dma_space, or an fd's noc_space
+	struct chardev_private *reserved_for;	// RESERVE_OUTBOUND_IATU, even while free
 };
 
 #endif
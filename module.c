@@ -13,6 +13,7 @@
 
 #include "chardev.h"
 #include "enumerate.h"
+#include "memory.h"
 
 #include "module.h"
 
@@ -61,6 +62,45 @@ MODULE_PARM_DESC(idle_power_down_grace_ms,
 		 "synchronously at close.  Only honored by device classes "
 		 "that opt in via defer_idle_powerdown.");
 
+uint tlb_quota_percent = 100;
+module_param(tlb_quota_percent, uint, 0644);
+MODULE_PARM_DESC(tlb_quota_percent,
+		 "Percentage of each TLB window kind a single fd may own unless "
+		 "raised with SET_TLB_QUOTA (default=100).");
+
+uint dma_buf_pool_mb = 0;
+module_param(dma_buf_pool_mb, uint, 0444);
+MODULE_PARM_DESC(dma_buf_pool_mb,
+		 "Size in MiB of a per-device physically contiguous pool, reserved "
+		 "at probe, for DMA buffers larger than 256 MiB. Usually needs a "
+		 "cma= boot parameter (default=0, no pool).");
+
+uint dma_buf_cache_mb = 0;
+module_param(dma_buf_cache_mb, uint, 0444);
+MODULE_PARM_DESC(dma_buf_cache_mb,
+		 "MiB of freed DMA buffers each device keeps for reuse by later "
+		 "ALLOCATE_DMA_BUF calls (default=0, no cache).");
+
+uint pin_cache_mb = 256;
+module_param(pin_cache_mb, uint, 0644);
+MODULE_PARM_DESC(pin_cache_mb,
+		 "MiB of unpinned TENSTORRENT_PIN_PAGES_CACHE registrations each fd "
+		 "keeps pinned for reuse by later PIN_PAGES calls (default=256).");
+
+bool identity_noc_window = false;
+module_param(identity_noc_window, bool, 0444);
+MODULE_PARM_DESC(identity_noc_window,
+		 "On Blackhole with an IOMMU, map the first 1 TiB of DMA addresses to "
+		 "the same NOC DMA addresses with one outbound iATU region, so that "
+		 "NOC DMA buffers there need no region of their own. Any fd's device "
+		 "code can then reach any buffer mapped there (default=off).");
+
+uint pin_threads = 8;
+module_param(pin_threads, uint, 0644);
+MODULE_PARM_DESC(pin_threads,
+		 "Maximum number of kernel workers pinning one PIN_PAGES range of "
+		 "1 GiB or more (default=8, 1 to pin in the calling thread).");
+
 const struct pci_device_id tenstorrent_ids[] = {
 	{ PCI_DEVICE(PCI_VENDOR_ID_TENSTORRENT, PCI_DEVICE_ID_GRAYSKULL),
 	  .driver_data=(kernel_ulong_t)NULL}, // Deprecated
@@ -87,6 +127,10 @@ static int __init ttdriver_init(void)
 		goto fail_procfs;
 	}
 
+	err = tenstorrent_memory_init();
+	if (err != 0)
+		goto fail_memory;
+
 	err = init_char_driver(max_devices);
 	if (err != 0)
 		goto fail_char_driver;
@@ -100,6 +144,8 @@ static int __init ttdriver_init(void)
 fail_pci_register:
 	cleanup_char_driver();
 fail_char_driver:
+	tenstorrent_memory_exit();
+fail_memory:
 	proc_remove(tt_procfs_root);
 fail_procfs:
 	debugfs_remove(tt_debugfs_root);
@@ -113,6 +159,7 @@ static void __exit ttdriver_cleanup(void)
 
 	tenstorrent_pci_unregister_driver();
 	cleanup_char_driver();
+	tenstorrent_memory_exit();
 	debugfs_remove(tt_debugfs_root);
 	proc_remove(tt_procfs_root);
 }
@@ -27,6 +27,12 @@ extern uint reset_limit;
 extern unsigned char auto_reset_timeout;
 extern bool power_policy;
 extern uint idle_power_down_grace_ms;
+extern uint tlb_quota_percent;
+extern uint dma_buf_pool_mb;
+extern uint dma_buf_cache_mb;
+extern uint pin_cache_mb;
+extern uint pin_threads;
+extern bool identity_noc_window;
 
 extern struct tenstorrent_device_class wormhole_class;
 extern struct tenstorrent_device_class blackhole_class;
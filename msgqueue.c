@@ -8,6 +8,7 @@
 #include <linux/pci.h>
 
 #include "device.h"
+#include "interrupt.h"
 
 bool arc_msg_push(struct tenstorrent_device *tt_dev, const struct arc_msg *msg, u32 queue_base, u32 num_entries)
 {
@@ -89,6 +90,7 @@ bool arc_msg_pop(struct tenstorrent_device *tt_dev, struct arc_msg *msg, u32 que
 
 	timeout = jiffies + msecs_to_jiffies(ARC_MSG_TIMEOUT_MS);
 	for (;;) {
+		u32 irq_seq = tenstorrent_arc_irq_seq(tt_dev);
 		u32 wptr;
 		u32 num_occupied;
 
@@ -109,7 +111,7 @@ bool arc_msg_pop(struct tenstorrent_device *tt_dev, struct arc_msg *msg, u32 que
 			return false;
 		}
 
-		usleep_range(100, 200);
+		tenstorrent_wait_arc_irq(tt_dev, irq_seq, 100, 200);
 	}
 
 	slot = rptr % num_entries;
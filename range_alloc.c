@@ -0,0 +1,262 @@
+// SPDX-FileCopyrightText: © 2025 Tenstorrent Inc.
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/bug.h>
+#include <linux/math64.h>
+#include <linux/seq_file.h>
+
+#include "range_alloc.h"
+
+void range_alloc_init(struct range_alloc *ra, u64 start, u64 last)
+{
+	WARN_ON(start > last);
+
+	ra->used = RB_ROOT;
+	ra->start = start;
+	ra->last = last;
+	ra->nr_used = 0;
+	ra->used_bytes = 0;
+	ra->alloc_count = 0;
+	ra->alloc_failures = 0;
+}
+
+// A node must be initialized once before use; it is again after removal.
+void range_alloc_node_init(struct range_alloc_node *node)
+{
+	RB_CLEAR_NODE(&node->rb);
+	node->start = 0;
+	node->last = 0;
+}
+
+// Highest (top_down) or lowest base for an align-aligned range of size bytes
+// within [lo, hi], or U64_MAX if it doesn't fit.
+static u64 fit_range(u64 lo, u64 hi, u64 size, u64 align, bool top_down)
+{
+	u64 base;
+
+	if (hi < lo || hi - lo < size - 1)
+		return U64_MAX;
+
+	if (top_down) {
+		base = round_down(hi - (size - 1), align);
+		return base >= lo ? base : U64_MAX;
+	}
+
+	base = round_up(lo, align);
+	return (base >= lo && base <= hi - (size - 1)) ? base : U64_MAX;
+}
+
+struct range_fit {
+	u64 size;
+	u64 align;
+	bool top_down;
+
+	bool found;
+	u64 base;
+	u64 gap;	// size - 1 of the gap base is in
+};
+
+// Best fit: the smallest gap that can hold the range. Between equal gaps
+// the highest wins top-down and the lowest bottom-up, and within the gap
+// the range goes to that end too.
+static void consider_gap(struct range_fit *fit, u64 lo, u64 hi)
+{
+	u64 base = fit_range(lo, hi, fit->size, fit->align, fit->top_down);
+
+	if (base == U64_MAX)
+		return;
+
+	if (!fit->found || hi - lo < fit->gap || (hi - lo == fit->gap && fit->top_down)) {
+		fit->found = true;
+		fit->base = base;
+		fit->gap = hi - lo;
+	}
+}
+
+static void link_node(struct range_alloc *ra, struct range_alloc_node *node)
+{
+	struct rb_node **link = &ra->used.rb_node;
+	struct rb_node *parent = NULL;
+
+	while (*link) {
+		parent = *link;
+		if (node->start < rb_entry(parent, struct range_alloc_node, rb)->start)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+
+	rb_link_node(&node->rb, parent, link);
+	rb_insert_color(&node->rb, &ra->used);
+
+	ra->nr_used++;
+	ra->used_bytes += node->last - node->start + 1;
+	ra->alloc_count++;
+}
+
+// Place node as an align-aligned range of size bytes, align a power of two.
+// Returns -ENOMEM if no gap can hold it.
+int range_alloc_insert(struct range_alloc *ra, struct range_alloc_node *node, u64 size, u64 align,
+		       bool top_down)
+{
+	struct range_fit fit = { .size = size, .align = align, .top_down = top_down };
+	struct range_alloc_node *used;
+	struct rb_node *rb;
+	u64 lo = ra->start;
+	bool tail = true;	// whether a gap may follow the last used range
+
+	if (WARN_ON(!RB_EMPTY_NODE(&node->rb)) || size == 0)
+		return -EINVAL;
+
+	for (rb = rb_first(&ra->used); rb; rb = rb_next(rb)) {
+		used = rb_entry(rb, struct range_alloc_node, rb);
+
+		if (used->start > lo)
+			consider_gap(&fit, lo, used->start - 1);
+
+		if (used->last == ra->last)
+			tail = false;
+		else
+			lo = used->last + 1;
+	}
+
+	if (tail)
+		consider_gap(&fit, lo, ra->last);
+
+	if (!fit.found) {
+		ra->alloc_failures++;
+		return -ENOMEM;
+	}
+
+	node->start = fit.base;
+	node->last = fit.base + size - 1;
+	link_node(ra, node);
+
+	return 0;
+}
+
+// Place node at [start, last]. Returns -EBUSY if any of it is allocated.
+int range_alloc_insert_at(struct range_alloc *ra, struct range_alloc_node *node, u64 start, u64 last)
+{
+	struct range_alloc_node *below = NULL;	// the used range starting last at or before last
+	struct rb_node *rb = ra->used.rb_node;
+
+	if (WARN_ON(!RB_EMPTY_NODE(&node->rb)) || start > last || start < ra->start || last > ra->last)
+		return -EINVAL;
+
+	while (rb) {
+		struct range_alloc_node *used = rb_entry(rb, struct range_alloc_node, rb);
+
+		if (used->start <= last) {
+			below = used;
+			rb = rb->rb_right;
+		} else {
+			rb = rb->rb_left;
+		}
+	}
+
+	if (below && below->last >= start) {
+		ra->alloc_failures++;
+		return -EBUSY;
+	}
+
+	node->start = start;
+	node->last = last;
+	link_node(ra, node);
+
+	return 0;
+}
+
+// Move node's range to [start, last], growing only into free space. Its
+// order among the other ranges can't change. Returns -EBUSY if the growth
+// would overlap another range.
+int range_alloc_resize(struct range_alloc *ra, struct range_alloc_node *node, u64 start, u64 last)
+{
+	struct rb_node *prev, *next;
+
+	if (WARN_ON(RB_EMPTY_NODE(&node->rb)) || start > last || start < ra->start || last > ra->last)
+		return -EINVAL;
+
+	prev = rb_prev(&node->rb);
+	next = rb_next(&node->rb);
+
+	if ((prev && rb_entry(prev, struct range_alloc_node, rb)->last >= start)
+	    || (next && rb_entry(next, struct range_alloc_node, rb)->start <= last)) {
+		ra->alloc_failures++;
+		return -EBUSY;
+	}
+
+	ra->used_bytes -= node->last - node->start;
+	ra->used_bytes += last - start;
+	node->start = start;
+	node->last = last;
+
+	return 0;
+}
+
+// Release node's range. Does nothing if node is not allocated.
+void range_alloc_remove(struct range_alloc *ra, struct range_alloc_node *node)
+{
+	if (RB_EMPTY_NODE(&node->rb))
+		return;
+
+	rb_erase(&node->rb, &ra->used);
+	ra->nr_used--;
+	ra->used_bytes -= node->last - node->start + 1;
+	range_alloc_node_init(node);
+}
+
+static void show_gap(struct seq_file *s, u64 lo, u64 hi, bool show_ranges, unsigned int *nr_free,
+		     u64 *largest)
+{
+	(*nr_free)++;
+	*largest = max(*largest, hi - lo + 1);
+
+	if (show_ranges)
+		seq_printf(s, "  free 0x%llx-0x%llx (size=0x%llx)\n", lo, hi, hi - lo + 1);
+}
+
+// Fragmentation is the share of free space outside the largest free range,
+// so 0% means any range that fits in the free space can be allocated.
+void range_alloc_show(struct seq_file *s, struct range_alloc *ra, bool show_ranges)
+{
+	u64 free_bytes = ra->last - ra->start + 1 - ra->used_bytes;
+	unsigned int nr_free = 0;
+	u64 largest = 0;
+	u64 lo = ra->start;
+	bool tail = true;
+	u64 fragmentation = 0;
+	struct rb_node *rb;
+
+	if (show_ranges)
+		seq_printf(s, "space 0x%llx-0x%llx\n", ra->start, ra->last);
+
+	for (rb = rb_first(&ra->used); rb; rb = rb_next(rb)) {
+		struct range_alloc_node *used = rb_entry(rb, struct range_alloc_node, rb);
+
+		if (used->start > lo)
+			show_gap(s, lo, used->start - 1, show_ranges, &nr_free, &largest);
+
+		if (show_ranges)
+			seq_printf(s, "  used 0x%llx-0x%llx (size=0x%llx)\n", used->start, used->last,
+				   used->last - used->start + 1);
+
+		if (used->last == ra->last)
+			tail = false;
+		else
+			lo = used->last + 1;
+	}
+
+	if (tail)
+		show_gap(s, lo, ra->last, show_ranges, &nr_free, &largest);
+
+	if (free_bytes >= 100)
+		fragmentation = 100 - min_t(u64, 100, div64_u64(largest, div64_u64(free_bytes, 100)));
+
+	seq_printf(s, "used: %u ranges, 0x%llx bytes\n", ra->nr_used, ra->used_bytes);
+	seq_printf(s, "free: %u ranges, 0x%llx bytes, largest 0x%llx\n", nr_free, free_bytes, largest);
+	seq_printf(s, "fragmentation: %llu%%\n", fragmentation);
+	seq_printf(s, "allocations: %llu, failed: %llu\n", ra->alloc_count, ra->alloc_failures);
+}
@@ -0,0 +1,43 @@
+// SPDX-FileCopyrightText: © 2025 Tenstorrent Inc.
+// SPDX-License-Identifier: GPL-2.0-only
+
+#ifndef TENSTORRENT_RANGE_ALLOC_H_INCLUDED
+#define TENSTORRENT_RANGE_ALLOC_H_INCLUDED
+
+#include <linux/types.h>
+#include <linux/rbtree.h>
+
+struct seq_file;
+
+// One allocated range, embedded in whatever owns it, so that neither
+// allocating nor freeing needs memory.
+struct range_alloc_node {
+	struct rb_node rb;
+	u64 start;
+	u64 last;	// inclusive
+};
+
+// Places ranges in the address space [start, last], such as the NOC DMA
+// window space. The allocated ranges are kept sorted and never overlap; the
+// free ranges are the gaps between them. Callers serialize.
+struct range_alloc {
+	struct rb_root used;	// struct range_alloc_node, by start
+	u64 start;
+	u64 last;
+
+	unsigned int nr_used;
+	u64 used_bytes;
+	u64 alloc_count;	// successful allocations, ever
+	u64 alloc_failures;	// allocations refused for lack of room or overlap
+};
+
+void range_alloc_init(struct range_alloc *ra, u64 start, u64 last);
+void range_alloc_node_init(struct range_alloc_node *node);
+int range_alloc_insert(struct range_alloc *ra, struct range_alloc_node *node, u64 size, u64 align,
+		       bool top_down);
+int range_alloc_insert_at(struct range_alloc *ra, struct range_alloc_node *node, u64 start, u64 last);
+int range_alloc_resize(struct range_alloc *ra, struct range_alloc_node *node, u64 start, u64 last);
+void range_alloc_remove(struct range_alloc *ra, struct range_alloc_node *node);
+void range_alloc_show(struct seq_file *s, struct range_alloc *ra, bool show_ranges);
+
+#endif
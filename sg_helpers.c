@@ -12,73 +12,105 @@
 // scatterlist length is unsigned int, so we may have to split based on size alone.
 #define MAX_PAGES_PER_SCL (UINT_MAX / PAGE_SIZE)
 
-// This is very similar to sg_alloc_table_from_pages, but we need to go big so
-// we use single-page allocations and scatterlist chaining for unlimited scaling.
-bool alloc_chained_sgt_for_pages(struct sg_table *table, struct page **pages, unsigned int n_pages)
+void chained_sgt_builder_init(struct chained_sgt_builder *builder, struct sg_table *table)
 {
-	struct page **pages_end = pages + n_pages;
+	memset(table, 0, sizeof(*table));
+	builder->table = table;
+	builder->page_first = NULL;
+	builder->last = NULL;
+}
 
-	struct scatterlist *current_scl = NULL; // last entry of previous page of scatterlists
+// Append n_pages physically contiguous pages starting at page, extending the
+// last entry where they continue it.
+bool chained_sgt_append(struct chained_sgt_builder *builder, struct page *page, unsigned long n_pages)
+{
+	struct sg_table *table = builder->table;
+	struct scatterlist *last = builder->last;
 
-	memset(table, 0, sizeof(*table));
+	if (last) {
+		unsigned long last_pages = last->length >> PAGE_SHIFT;
+		unsigned long extend = min(n_pages, MAX_PAGES_PER_SCL - last_pages);
 
-	if (n_pages == 0)
-		return true;
+		if (extend && page_to_pfn(sg_page(last)) + last_pages == page_to_pfn(page)) {
+			last->length += extend << PAGE_SHIFT;
+			page = nth_page(page, extend);
+			n_pages -= extend;
+		}
+	}
+
+	while (n_pages) {
+		unsigned long len = min(n_pages, MAX_PAGES_PER_SCL);
 
-	while (pages < pages_end) {
-		// Zeroed because sg_set_page preserves the page_link chain/end bits.
-		struct page *new_page = alloc_page(GFP_KERNEL | __GFP_ZERO);
-		struct scatterlist *page_first_scl;
+		if (!last || last - builder->page_first == SCL_PER_PAGE - 1) {
+			// Zeroed because sg_set_page preserves the page_link chain/end bits.
+			struct page *new_page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+			struct scatterlist *page_first_scl;
 
-		if (!new_page)
-			goto out_free;
+			if (!new_page)
+				return false;
 
-		// Attach the new page to the chain.
-		page_first_scl = page_address(new_page);
+			// Attach the new page to the chain. Note that the last entry of
+			// each page is reserved for chaining and not included in nents.
+			page_first_scl = page_address(new_page);
 
-		if (current_scl) {
-			sg_chain(current_scl, 1, page_first_scl);
+			if (builder->page_first)
+				sg_chain(builder->page_first + SCL_PER_PAGE, 1, page_first_scl);
+			else
+				table->sgl = page_first_scl;
+
+			builder->page_first = page_first_scl;
+			last = page_first_scl;
 		} else {
-			table->sgl = page_first_scl;
+			last++;
 		}
 
-		current_scl = page_first_scl;
+		sg_set_page(last, page, len << PAGE_SHIFT, 0);
+		table->nents++;
+		table->orig_nents++;
+		builder->last = last;
 
-		// Measure out contiguous page ranges and write each into a scatterlist entry in the
-		// current scatterlist page.
-		while (pages < pages_end && current_scl - page_first_scl < SCL_PER_PAGE) {
-			struct page **contig_start = pages++;
+		page = nth_page(page, len);
+		n_pages -= len;
+	}
 
-			for (; pages < pages_end && pages - contig_start < MAX_PAGES_PER_SCL; pages++)
-				if (page_to_pfn(pages[-1]) + 1 != page_to_pfn(pages[0]))
-					break;
+	return true;
+}
 
-			sg_set_page(current_scl++, *contig_start, (pages - contig_start) * PAGE_SIZE, 0);
-		}
+void chained_sgt_builder_finish(struct chained_sgt_builder *builder)
+{
+	if (builder->last)
+		sg_mark_end(builder->last);
+}
+
+// This is very similar to sg_alloc_table_from_pages, but we need to go big so
+// we use single-page allocations and scatterlist chaining for unlimited scaling.
+bool alloc_chained_sgt_for_pages(struct sg_table *table, struct page **pages, unsigned int n_pages)
+{
+	struct chained_sgt_builder builder;
+	unsigned int i;
 
-		table->nents += current_scl - page_first_scl;
+	chained_sgt_builder_init(&builder, table);
 
-		// Note that current_scl points to the extra entry reserved for chaining.
-		// Chaining entries are not included in table->nents. sg_next() just skips over them.
+	for (i = 0; i < n_pages; i++) {
+		if (!chained_sgt_append(&builder, pages[i], 1)) {
+			free_chained_sgt(table);
+			return false;
+		}
 	}
 
-	table->orig_nents = table->nents;
-	sg_mark_end(current_scl);
+	chained_sgt_builder_finish(&builder);
 	return true;
-
-out_free:
-	free_chained_sgt(table);
-	return false;
 }
 
 // Free a chained scatterlist created by alloc_chained_sgt_for_pages.
 // Doesn't check each scatterlist entry if it's chain/end, rather asssumes that there are always
 // SCL_PER_PAGE except for the last page.
-// Also, alloc_chained_sgt_for_pages calls this on failure, in which case there's no SG_END marker.
+// Also safe on a partly built table, in which case there's no SG_END marker.
+// Uses orig_nents because dma_map_sgtable may have reduced nents.
 void free_chained_sgt(struct sg_table *table)
 {
 	struct scatterlist *next_page = table->sgl;
-	unsigned int num_entries = table->nents;
+	unsigned int num_entries = table->orig_nents;
 
 	while (next_page) {
 		struct scatterlist *current_page = next_page;
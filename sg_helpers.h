@@ -26,13 +26,31 @@ static inline int dma_map_sgtable(struct device *dev, struct sg_table *dma_mappi
 
 static inline void dma_unmap_sgtable(struct device *dev, struct sg_table *dma_mapping, enum dma_data_direction dir, unsigned long attrs)
 {
-	dma_unmap_sg_attrs(dev, dma_mapping->sgl, dma_mapping->nents, dir, attrs);
+	dma_unmap_sg_attrs(dev, dma_mapping->sgl, dma_mapping->orig_nents, dir, attrs);
 }
 
 #define for_each_sgtable_dma_sg(sgt, tmp_scl, tmp_idx) for_each_sg((sgt)->sgl, tmp_scl, (sgt)->nents, tmp_idx)
 
 #endif
 
+// nth_page() was removed once the struct pages of any folio became
+// contiguous, which also made it a plain addition.
+#ifndef nth_page
+#define nth_page(page, n) ((page) + (n))
+#endif
+
+// Builds a chained sg_table incrementally, one physically contiguous run at
+// a time. The table is freed with free_chained_sgt, also if building fails.
+struct chained_sgt_builder {
+	struct sg_table *table;
+	struct scatterlist *page_first;	// first entry of the newest scatterlist page
+	struct scatterlist *last;	// last entry written, NULL if none
+};
+
+void chained_sgt_builder_init(struct chained_sgt_builder *builder, struct sg_table *table);
+bool chained_sgt_append(struct chained_sgt_builder *builder, struct page *page, unsigned long n_pages);
+void chained_sgt_builder_finish(struct chained_sgt_builder *builder);
+
 bool alloc_chained_sgt_for_pages(struct sg_table *table, struct page **pages, unsigned int n_pages);
 void free_chained_sgt(struct sg_table *table); // Safe to pass zero-intialized sg_table.
 
@@ -4,6 +4,8 @@
 #include <limits>
 #include <variant>
 #include <cerrno>
+#include <csetjmp>
+#include <csignal>
 #include <cstdint>
 
 #include <sys/ioctl.h>
@@ -33,13 +35,19 @@ std::size_t MaxDmaBufSize(int dev_fd)
     return (std::size_t)1 << GetDeviceInfo(dev_fd).max_dma_buf_size_log2;
 }
 
+std::uint64_t DmaBufSize(const tenstorrent_allocate_dma_buf_out &buf)
+{
+    return buf.size | (std::uint64_t)buf.size_hi << 32;
+}
+
 std::variant<tenstorrent_allocate_dma_buf_out, int>
-AllocateDmaBuf(int dev_fd, std::uint32_t size, std::uint32_t index, std::uint8_t flags)
+AllocateDmaBuf(int dev_fd, std::uint64_t size, std::uint32_t index, std::uint8_t flags)
 {
     tenstorrent_allocate_dma_buf allocate_dma_buf;
     zero(&allocate_dma_buf);
 
-    allocate_dma_buf.in.requested_size = size;
+    allocate_dma_buf.in.requested_size = size & 0xFFFFFFFF;
+    allocate_dma_buf.in.requested_size_hi = size >> 32;
     allocate_dma_buf.in.buf_index = index;
     allocate_dma_buf.in.flags = flags;
 
@@ -50,13 +58,13 @@ AllocateDmaBuf(int dev_fd, std::uint32_t size, std::uint32_t index, std::uint8_t
 }
 
 std::variant<tenstorrent_allocate_dma_buf_out, int>
-AllocateDmaBuf(int dev_fd, std::uint32_t size, std::uint32_t index)
+AllocateDmaBuf(int dev_fd, std::uint64_t size, std::uint32_t index)
 {
     return AllocateDmaBuf(dev_fd, size, index, 0);
 }
 
 std::variant<tenstorrent_allocate_dma_buf_out, int>
-AllocateDmaBufUpTo(int dev_fd, std::uint32_t size, std::uint8_t index)
+AllocateDmaBufUpTo(int dev_fd, std::uint64_t size, std::uint8_t index)
 {
     while (true)
     {
@@ -76,6 +84,19 @@ AllocateDmaBufUpTo(int dev_fd, std::uint32_t size, std::uint8_t index)
     }
 }
 
+int FreeDmaBuf(int dev_fd, std::uint32_t index)
+{
+    tenstorrent_free_dma_buf free_dma_buf;
+    zero(&free_dma_buf);
+
+    free_dma_buf.in.buf_index = index;
+
+    if (ioctl(dev_fd, TENSTORRENT_IOCTL_FREE_DMA_BUF, &free_dma_buf) != 0)
+        return errno;
+
+    return 0;
+}
+
 void VerifyTooLargeIndexFails(int dev_fd)
 {
     if (TENSTORRENT_MAX_DMA_BUFS <= std::numeric_limits<decltype(tenstorrent_allocate_dma_buf_in::buf_index)>::max()) {
@@ -96,13 +117,13 @@ void VerifyBufferMapping(int dev_fd, const std::vector<tenstorrent_allocate_dma_
     {
         const auto &b = buffers[i];
 
-        void *p = mmap(nullptr, b.size, PROT_READ | PROT_WRITE, MAP_SHARED, dev_fd, b.mapping_offset);
+        void *p = mmap(nullptr, DmaBufSize(b), PROT_READ | PROT_WRITE, MAP_SHARED, dev_fd, b.mapping_offset);
         if (p == MAP_FAILED)
             THROW_TEST_FAILURE("DMA buffer mapping failed.");
 
         pointers.push_back(p);
 
-        std::memset(p, i, b.size);
+        std::memset(p, i, DmaBufSize(b));
     }
 
     for (unsigned i = 0; i < pointers.size(); i++)
@@ -111,7 +132,7 @@ void VerifyBufferMapping(int dev_fd, const std::vector<tenstorrent_allocate_dma_
         if (p[0] != i)
             THROW_TEST_FAILURE("Wrong value in DMA buffer mapping.");
 
-        munmap(p, buffers[i].size);
+        munmap(p, DmaBufSize(buffers[i]));
     }
 }
 
@@ -126,6 +147,516 @@ void VerifyMultipleNocMappedBuffers(int dev_fd)
         THROW_TEST_FAILURE("Second NOC-mapped DMA buffer allocation failed.");
 }
 
+int AllocateNocDmaBuf(int dev_fd, std::uint32_t index, std::uint8_t flags, std::uint32_t noc_align_log2,
+                      std::uint64_t &noc_address)
+{
+    tenstorrent_allocate_dma_buf allocate_dma_buf;
+    zero(&allocate_dma_buf);
+
+    allocate_dma_buf.in.requested_size = page_size();
+    allocate_dma_buf.in.buf_index = index;
+    allocate_dma_buf.in.flags = flags;
+    allocate_dma_buf.in.noc_align_log2 = noc_align_log2;
+    allocate_dma_buf.in.noc_address = noc_address;
+
+    if (ioctl(dev_fd, TENSTORRENT_IOCTL_ALLOCATE_DMA_BUF, &allocate_dma_buf) != 0)
+        return errno;
+
+    noc_address = allocate_dma_buf.out.noc_address;
+    return 0;
+}
+
+// NOC placement: aligned bottom-up allocation, then a fixed address that is
+// free and one that is taken.
+void VerifyNocPlacement(int dev_fd)
+{
+    constexpr std::uint32_t align_log2 = 20;
+    constexpr std::uint64_t align = std::uint64_t(1) << align_log2;
+    std::uint64_t noc_address = 0;
+
+    if (AllocateNocDmaBuf(dev_fd, 0, TENSTORRENT_ALLOCATE_DMA_BUF_NOC_BOTTOM_UP, 0, noc_address) != EINVAL)
+        THROW_TEST_FAILURE("NOC placement flag without NOC_DMA was not rejected.");
+
+    if (AllocateNocDmaBuf(dev_fd, 0, TENSTORRENT_ALLOCATE_DMA_BUF_NOC_DMA | TENSTORRENT_ALLOCATE_DMA_BUF_NOC_BOTTOM_UP,
+                          align_log2, noc_address) != 0)
+        THROW_TEST_FAILURE("Aligned bottom-up NOC DMA buffer allocation failed.");
+
+    if (noc_address % align != 0)
+        THROW_TEST_FAILURE("NOC DMA buffer address does not have the requested alignment.");
+
+    std::uint64_t taken = noc_address;
+    if (AllocateNocDmaBuf(dev_fd, 1, TENSTORRENT_ALLOCATE_DMA_BUF_NOC_DMA | TENSTORRENT_ALLOCATE_DMA_BUF_NOC_FIXED,
+                          0, taken) != EBUSY)
+        THROW_TEST_FAILURE("Fixed NOC address overlapping another buffer was not refused with EBUSY.");
+
+    FreeDmaBuf(dev_fd, 0);
+
+    std::uint64_t fixed = noc_address;
+    if (AllocateNocDmaBuf(dev_fd, 1, TENSTORRENT_ALLOCATE_DMA_BUF_NOC_DMA | TENSTORRENT_ALLOCATE_DMA_BUF_NOC_FIXED,
+                          0, fixed) != 0)
+        THROW_TEST_FAILURE("Fixed NOC address allocation failed.");
+
+    if (fixed != noc_address)
+        THROW_TEST_FAILURE("Fixed NOC DMA buffer is not at the requested address.");
+
+    FreeDmaBuf(dev_fd, 1);
+}
+
+// Reserve an outbound iATU region on a fresh fd and check that the fd's NOC
+// DMA buffers land inside the reserved span.
+void VerifyReserveOutboundIatu(const EnumeratedDevice &dev)
+{
+    // The identity window takes the NOC DMA address space, and buffers use
+    // it before any reserved window.
+    if (read_file("/sys/module/tenstorrent/parameters/identity_noc_window")[0] == 'Y')
+        return;
+
+    DevFd dev_fd(dev.path);
+
+    tenstorrent_reserve_outbound_iatu reserve;
+    zero(&reserve);
+    reserve.argsz = sizeof(reserve);
+    reserve.flags = 1;
+    reserve.count = 1;
+    reserve.noc_size = 16 * page_size();
+
+    if (ioctl(dev_fd.get(), TENSTORRENT_IOCTL_RESERVE_OUTBOUND_IATU, &reserve) == 0 || errno != EINVAL)
+        THROW_TEST_FAILURE("RESERVE_OUTBOUND_IATU with unknown flags was not rejected.");
+
+    reserve.flags = 0;
+    if (ioctl(dev_fd.get(), TENSTORRENT_IOCTL_RESERVE_OUTBOUND_IATU, &reserve) != 0)
+    {
+        if (errno == EPERM)
+            return; // Reservations require CAP_SYS_ADMIN.
+        THROW_TEST_FAILURE("RESERVE_OUTBOUND_IATU failed.");
+    }
+
+    std::uint64_t span = reserve.noc_address;
+
+    if (ioctl(dev_fd.get(), TENSTORRENT_IOCTL_RESERVE_OUTBOUND_IATU, &reserve) == 0 || errno != EBUSY)
+        THROW_TEST_FAILURE("Second RESERVE_OUTBOUND_IATU on one fd was not refused with EBUSY.");
+
+    std::uint64_t noc_address = 0;
+    if (AllocateNocDmaBuf(dev_fd.get(), 0, TENSTORRENT_ALLOCATE_DMA_BUF_NOC_DMA, 0, noc_address) != 0)
+        THROW_TEST_FAILURE("NOC DMA buffer allocation with a reservation failed.");
+
+    if (noc_address < span || noc_address + page_size() > span + 16 * page_size())
+        THROW_TEST_FAILURE("NOC DMA buffer is outside the reserved iATU span.");
+
+    FreeDmaBuf(dev_fd.get(), 0);
+}
+
+// A mapped buffer cannot be freed; once unmapped it can, and its index is reusable.
+void VerifyFreeDmaBuf(int dev_fd)
+{
+    auto buf = AllocateDmaBuf(dev_fd, page_size(), 0);
+    if (std::holds_alternative<int>(buf))
+        THROW_TEST_FAILURE("DMA buffer allocation failed.");
+
+    const auto &b = std::get<tenstorrent_allocate_dma_buf_out>(buf);
+
+    void *p = mmap(nullptr, DmaBufSize(b), PROT_READ | PROT_WRITE, MAP_SHARED, dev_fd, b.mapping_offset);
+    if (p == MAP_FAILED)
+        THROW_TEST_FAILURE("DMA buffer mapping failed.");
+
+    if (FreeDmaBuf(dev_fd, 0) != EBUSY)
+        THROW_TEST_FAILURE("Mapped DMA buffer was not refused with EBUSY.");
+
+    munmap(p, DmaBufSize(b));
+
+    if (FreeDmaBuf(dev_fd, 0) != 0)
+        THROW_TEST_FAILURE("Unmapped DMA buffer could not be freed.");
+
+    if (FreeDmaBuf(dev_fd, 0) != EINVAL)
+        THROW_TEST_FAILURE("Freeing an already-freed DMA buffer did not fail with EINVAL.");
+
+    auto realloc = AllocateDmaBuf(dev_fd, 2 * page_size(), 0);
+    if (std::holds_alternative<int>(realloc))
+        THROW_TEST_FAILURE("Freed DMA buffer index could not be reused.");
+
+    if (FreeDmaBuf(dev_fd, 0) != 0)
+        THROW_TEST_FAILURE("Reallocated DMA buffer could not be freed.");
+}
+
+// A freed buffer may be handed out again (dma_buf_cache_mb), but never with
+// its old contents.
+void VerifyRecycledDmaBufZeroed(int dev_fd)
+{
+    for (int pass = 0; pass < 2; pass++)
+    {
+        auto buf = AllocateDmaBuf(dev_fd, page_size(), 0);
+        if (std::holds_alternative<int>(buf))
+            THROW_TEST_FAILURE("DMA buffer allocation failed.");
+
+        const auto &b = std::get<tenstorrent_allocate_dma_buf_out>(buf);
+
+        void *p = mmap(nullptr, DmaBufSize(b), PROT_READ | PROT_WRITE, MAP_SHARED, dev_fd, b.mapping_offset);
+        if (p == MAP_FAILED)
+            THROW_TEST_FAILURE("DMA buffer mapping failed.");
+
+        const unsigned char *bytes = static_cast<const unsigned char *>(p);
+        for (std::size_t i = 0; i < DmaBufSize(b); i++)
+            if (bytes[i] != 0)
+                THROW_TEST_FAILURE("Newly allocated DMA buffer was not zeroed.");
+
+        std::memset(p, 0xA5, DmaBufSize(b));
+        munmap(p, DmaBufSize(b));
+
+        if (FreeDmaBuf(dev_fd, 0) != 0)
+            THROW_TEST_FAILURE("DMA buffer could not be freed.");
+    }
+}
+
+// A buffer can be placed on an explicit NUMA node, which must exist.
+void VerifyNumaNodeDmaBuf(int dev_fd)
+{
+    std::uint16_t node = GetDeviceInfo(dev_fd).numa_node;
+    if (node == std::numeric_limits<std::uint16_t>::max())
+        node = 0;
+
+    tenstorrent_allocate_dma_buf allocate_dma_buf;
+    zero(&allocate_dma_buf);
+    allocate_dma_buf.in.requested_size = page_size();
+    allocate_dma_buf.in.flags = TENSTORRENT_ALLOCATE_DMA_BUF_NUMA_NODE;
+    allocate_dma_buf.in.numa_node = std::numeric_limits<std::uint16_t>::max() - 1;
+
+    if (ioctl(dev_fd, TENSTORRENT_IOCTL_ALLOCATE_DMA_BUF, &allocate_dma_buf) == 0 || errno != EINVAL)
+        THROW_TEST_FAILURE("DMA buffer allocation on a nonexistent NUMA node did not fail with EINVAL.");
+
+    allocate_dma_buf.in.numa_node = node;
+    if (ioctl(dev_fd, TENSTORRENT_IOCTL_ALLOCATE_DMA_BUF, &allocate_dma_buf) != 0) {
+        // Platforms that need CPU cache maintenance for streaming DMA.
+        if (errno == EOPNOTSUPP)
+            return;
+        THROW_TEST_FAILURE("DMA buffer allocation on the device's NUMA node failed.");
+    }
+
+    const auto &b = allocate_dma_buf.out;
+
+    void *p = mmap(nullptr, DmaBufSize(b), PROT_READ | PROT_WRITE, MAP_SHARED, dev_fd, b.mapping_offset);
+    if (p == MAP_FAILED)
+        THROW_TEST_FAILURE("NUMA node DMA buffer mapping failed.");
+
+    std::memset(p, 0xA5, DmaBufSize(b));
+    munmap(p, DmaBufSize(b));
+
+    if (FreeDmaBuf(dev_fd, 0) != 0)
+        THROW_TEST_FAILURE("NUMA node DMA buffer could not be freed.");
+}
+
+int SyncDmaBuf(int dev_fd, std::uint32_t index, std::uint32_t flags, std::uint64_t offset, std::uint64_t size)
+{
+    tenstorrent_sync_dma_buf sync_dma_buf;
+    zero(&sync_dma_buf);
+
+    sync_dma_buf.argsz = sizeof(sync_dma_buf);
+    sync_dma_buf.flags = flags;
+    sync_dma_buf.buf_index = index;
+    sync_dma_buf.offset = offset;
+    sync_dma_buf.size = size;
+
+    if (ioctl(dev_fd, TENSTORRENT_IOCTL_SYNC_DMA_BUF, &sync_dma_buf) != 0)
+        return errno;
+
+    return 0;
+}
+
+// A cacheable buffer can be handed back and forth with SYNC_DMA_BUF, which
+// validates its range and direction.
+void VerifyCacheableDmaBuf(int dev_fd)
+{
+    auto buf = AllocateDmaBuf(dev_fd, 2 * page_size(), 0, TENSTORRENT_ALLOCATE_DMA_BUF_CACHEABLE);
+    if (std::holds_alternative<int>(buf))
+        THROW_TEST_FAILURE("Cacheable DMA buffer allocation failed.");
+
+    const auto &b = std::get<tenstorrent_allocate_dma_buf_out>(buf);
+
+    void *p = mmap(nullptr, DmaBufSize(b), PROT_READ | PROT_WRITE, MAP_SHARED, dev_fd, b.mapping_offset);
+    if (p == MAP_FAILED)
+        THROW_TEST_FAILURE("Cacheable DMA buffer mapping failed.");
+
+    std::memset(p, 0xA5, DmaBufSize(b));
+
+    if (SyncDmaBuf(dev_fd, 0, TENSTORRENT_SYNC_DMA_BUF_FOR_DEVICE, 0, 0) != 0)
+        THROW_TEST_FAILURE("Syncing a cacheable DMA buffer for the device failed.");
+
+    if (SyncDmaBuf(dev_fd, 0, TENSTORRENT_SYNC_DMA_BUF_FOR_CPU, page_size(), page_size()) != 0)
+        THROW_TEST_FAILURE("Syncing part of a cacheable DMA buffer for the CPU failed.");
+
+    if (SyncDmaBuf(dev_fd, 0, TENSTORRENT_SYNC_DMA_BUF_FOR_CPU, page_size(), 2 * page_size()) != EINVAL)
+        THROW_TEST_FAILURE("Syncing past the end of a DMA buffer did not fail with EINVAL.");
+
+    if (SyncDmaBuf(dev_fd, 0, TENSTORRENT_SYNC_DMA_BUF_FOR_CPU | TENSTORRENT_SYNC_DMA_BUF_FOR_DEVICE, 0, 0) != EINVAL)
+        THROW_TEST_FAILURE("Syncing a DMA buffer in both directions did not fail with EINVAL.");
+
+    if (SyncDmaBuf(dev_fd, 1, TENSTORRENT_SYNC_DMA_BUF_FOR_CPU, 0, 0) != EINVAL)
+        THROW_TEST_FAILURE("Syncing an unallocated DMA buffer did not fail with EINVAL.");
+
+    munmap(p, DmaBufSize(b));
+
+    if (FreeDmaBuf(dev_fd, 0) != 0)
+        THROW_TEST_FAILURE("Cacheable DMA buffer could not be freed.");
+}
+
+static sigjmp_buf sigbus_jmp;
+
+static void SigbusHandler(int)
+{
+    siglongjmp(sigbus_jmp, 1);
+}
+
+// True if reading p raised SIGBUS.
+static bool ReadFaults(const volatile std::uint8_t *p)
+{
+    struct sigaction sa = {}, old_sa;
+    sa.sa_handler = SigbusHandler;
+    sigaction(SIGBUS, &sa, &old_sa);
+
+    bool faulted = true;
+    if (sigsetjmp(sigbus_jmp, 1) == 0) {
+        (void)*p;
+        faulted = false;
+    }
+
+    sigaction(SIGBUS, &old_sa, nullptr);
+    return faulted;
+}
+
+// Zapping a mapping made of struct pages and touching it again must raise
+// SIGBUS, not try to insert a PFN into it. Checked for a cacheable buffer and
+// for a private mapping of a large huge-page buffer.
+void VerifyDmaBufDontNeed(int dev_fd)
+{
+    constexpr std::uint64_t large_size = 4 << 20;
+
+    auto buf = AllocateDmaBuf(dev_fd, 2 * page_size(), 0, TENSTORRENT_ALLOCATE_DMA_BUF_CACHEABLE);
+    if (std::holds_alternative<int>(buf))
+        THROW_TEST_FAILURE("Cacheable DMA buffer allocation failed.");
+
+    const auto &b = std::get<tenstorrent_allocate_dma_buf_out>(buf);
+
+    auto p = static_cast<std::uint8_t *>(mmap(nullptr, DmaBufSize(b), PROT_READ | PROT_WRITE, MAP_SHARED, dev_fd, b.mapping_offset));
+    if (p == MAP_FAILED)
+        THROW_TEST_FAILURE("Cacheable DMA buffer mapping failed.");
+
+    p[0] = 0xA5;
+
+    if (madvise(p, DmaBufSize(b), MADV_DONTNEED) != 0)
+        THROW_TEST_FAILURE("MADV_DONTNEED on a cacheable DMA buffer mapping failed.");
+
+    if (!ReadFaults(p))
+        THROW_TEST_FAILURE("Touching a zapped cacheable DMA buffer mapping did not raise SIGBUS.");
+
+    munmap(p, DmaBufSize(b));
+    FreeDmaBuf(dev_fd, 0);
+
+    auto large = AllocateDmaBuf(dev_fd, large_size, 0, TENSTORRENT_ALLOCATE_DMA_BUF_HUGE_PAGES);
+    if (std::holds_alternative<int>(large))
+        return;
+
+    const auto &l = std::get<tenstorrent_allocate_dma_buf_out>(large);
+
+    p = static_cast<std::uint8_t *>(mmap(nullptr, large_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, dev_fd, l.mapping_offset));
+    if (p == MAP_FAILED)
+        THROW_TEST_FAILURE("Private mapping of a large DMA buffer failed.");
+
+    // PFN maps refuse MADV_DONTNEED; only page-backed mappings can be zapped.
+    if (madvise(p, large_size, MADV_DONTNEED) == 0 && !ReadFaults(p))
+        THROW_TEST_FAILURE("Touching a zapped private DMA buffer mapping did not raise SIGBUS.");
+
+    munmap(p, large_size);
+    FreeDmaBuf(dev_fd, 0);
+}
+
+// An exported buffer can be mapped through the dma-buf, and cannot be freed
+// until the dma-buf is closed.
+void VerifyExportDmaBuf(int dev_fd)
+{
+    auto buf = AllocateDmaBuf(dev_fd, page_size(), 0);
+    if (std::holds_alternative<int>(buf))
+        THROW_TEST_FAILURE("DMA buffer allocation failed.");
+
+    tenstorrent_export_dma_buf export_dma_buf;
+    zero(&export_dma_buf);
+    export_dma_buf.argsz = sizeof(export_dma_buf);
+    export_dma_buf.buf_index = 0;
+
+    if (ioctl(dev_fd, TENSTORRENT_IOCTL_EXPORT_DMA_BUF, &export_dma_buf) != 0) {
+        // dma-buf export needs Linux 5.8.
+        if (errno == EOPNOTSUPP) {
+            FreeDmaBuf(dev_fd, 0);
+            return;
+        }
+        THROW_TEST_FAILURE("DMA buffer export failed.");
+    }
+
+    if (FreeDmaBuf(dev_fd, 0) != EBUSY)
+        THROW_TEST_FAILURE("Exported DMA buffer was not refused with EBUSY.");
+
+    void *p = mmap(nullptr, page_size(), PROT_READ | PROT_WRITE, MAP_SHARED, export_dma_buf.fd, 0);
+    if (p == MAP_FAILED)
+        THROW_TEST_FAILURE("Exported DMA buffer mapping failed.");
+
+    std::memset(p, 0xA5, page_size());
+    munmap(p, page_size());
+    close(export_dma_buf.fd);
+
+    if (FreeDmaBuf(dev_fd, 0) != 0)
+        THROW_TEST_FAILURE("DMA buffer could not be freed after its export was closed.");
+}
+
+int ReleaseDmaBufImport(int dev_fd, std::uint32_t handle)
+{
+    tenstorrent_release_dma_buf_import release;
+    zero(&release);
+    release.argsz = sizeof(release);
+    release.handle = handle;
+
+    if (ioctl(dev_fd, TENSTORRENT_IOCTL_RELEASE_DMA_BUF_IMPORT, &release) != 0)
+        return errno;
+
+    return 0;
+}
+
+// A dma-buf can be imported for device DMA, here one we exported ourselves,
+// and the import keeps the exported buffer alive until it is released.
+void VerifyImportDmaBuf(int dev_fd)
+{
+    auto buf = AllocateDmaBuf(dev_fd, page_size(), 0);
+    if (std::holds_alternative<int>(buf))
+        THROW_TEST_FAILURE("DMA buffer allocation failed.");
+
+    tenstorrent_export_dma_buf export_dma_buf;
+    zero(&export_dma_buf);
+    export_dma_buf.argsz = sizeof(export_dma_buf);
+    export_dma_buf.buf_index = 0;
+
+    if (ioctl(dev_fd, TENSTORRENT_IOCTL_EXPORT_DMA_BUF, &export_dma_buf) != 0) {
+        // dma-buf export and import need Linux 5.8.
+        if (errno == EOPNOTSUPP) {
+            FreeDmaBuf(dev_fd, 0);
+            return;
+        }
+        THROW_TEST_FAILURE("DMA buffer export failed.");
+    }
+
+    tenstorrent_import_dma_buf import_dma_buf;
+    zero(&import_dma_buf);
+    import_dma_buf.argsz = sizeof(import_dma_buf);
+    import_dma_buf.flags = TENSTORRENT_IMPORT_DMA_BUF_NOC_DMA;
+    import_dma_buf.fd = export_dma_buf.fd;
+
+    if (ioctl(dev_fd, TENSTORRENT_IOCTL_IMPORT_DMA_BUF, &import_dma_buf) != 0)
+        THROW_TEST_FAILURE("DMA buffer import failed.");
+
+    close(export_dma_buf.fd);
+
+    if (import_dma_buf.handle == 0 || import_dma_buf.size != page_size()
+        || import_dma_buf.dma_address == 0 || import_dma_buf.noc_address == 0)
+        THROW_TEST_FAILURE("DMA buffer import returned an unexpected result.");
+
+    if (FreeDmaBuf(dev_fd, 0) != EBUSY)
+        THROW_TEST_FAILURE("Imported DMA buffer was not refused with EBUSY.");
+
+    if (ReleaseDmaBufImport(dev_fd, import_dma_buf.handle) != 0)
+        THROW_TEST_FAILURE("RELEASE_DMA_BUF_IMPORT failed.");
+
+    if (ReleaseDmaBufImport(dev_fd, import_dma_buf.handle) != EINVAL)
+        THROW_TEST_FAILURE("RELEASE_DMA_BUF_IMPORT of a released import did not fail with EINVAL.");
+
+    if (FreeDmaBuf(dev_fd, 0) != 0)
+        THROW_TEST_FAILURE("DMA buffer could not be freed after its import was released.");
+
+    zero(&import_dma_buf);
+    import_dma_buf.argsz = sizeof(import_dma_buf);
+    import_dma_buf.fd = -1;
+
+    if (ioctl(dev_fd, TENSTORRENT_IOCTL_IMPORT_DMA_BUF, &import_dma_buf) != -1 || errno != EBADF)
+        THROW_TEST_FAILURE("DMA buffer import of an invalid fd did not fail with EBADF.");
+}
+
+// Small buffers use base pages; larger ones may use huge pages, which must
+// still map the whole buffer.
+void VerifyDmaBufPageSize(int dev_fd)
+{
+    constexpr std::uint64_t large_size = 4 << 20;
+
+    auto small = AllocateDmaBuf(dev_fd, page_size(), 0);
+    if (std::holds_alternative<int>(small))
+        THROW_TEST_FAILURE("DMA buffer allocation failed.");
+
+    if (std::get<tenstorrent_allocate_dma_buf_out>(small).page_size != page_size())
+        THROW_TEST_FAILURE("Single-page DMA buffer reports a page size other than the base page size.");
+
+    FreeDmaBuf(dev_fd, 0);
+
+    auto large = AllocateDmaBuf(dev_fd, large_size, 0, TENSTORRENT_ALLOCATE_DMA_BUF_HUGE_PAGES);
+    if (std::holds_alternative<int>(large))
+        return;
+
+    const auto &b = std::get<tenstorrent_allocate_dma_buf_out>(large);
+    std::uint64_t mapping_page_size = b.page_size;
+
+    if (mapping_page_size < page_size() || mapping_page_size > large_size
+        || (mapping_page_size & (mapping_page_size - 1)) != 0)
+        THROW_TEST_FAILURE("DMA buffer reports an invalid page size.");
+
+    auto p = static_cast<std::uint32_t *>(mmap(nullptr, large_size, PROT_READ | PROT_WRITE, MAP_SHARED, dev_fd, b.mapping_offset));
+    if (p == MAP_FAILED)
+        THROW_TEST_FAILURE("Large DMA buffer mapping failed.");
+
+    for (std::size_t i = 0; i < large_size / sizeof(*p); i++)
+        p[i] = i;
+
+    for (std::size_t i = 0; i < large_size / sizeof(*p); i++)
+        if (p[i] != i)
+            THROW_TEST_FAILURE("Large DMA buffer did not read back what was written.");
+
+    munmap(p, large_size);
+    FreeDmaBuf(dev_fd, 0);
+}
+
+// Kernel-assigned handles lift the 256 buffer limit and are usable like
+// caller-chosen indices.
+void VerifyDynamicDmaBufIndex(int dev_fd)
+{
+    constexpr unsigned count = 4 * TENSTORRENT_MAX_DMA_BUFS;
+    std::vector<std::uint32_t> handles;
+
+    for (unsigned i = 0; i < count; i++)
+    {
+        auto buf = AllocateDmaBuf(dev_fd, page_size(), 0, TENSTORRENT_ALLOCATE_DMA_BUF_DYNAMIC_INDEX);
+        if (std::holds_alternative<int>(buf))
+            THROW_TEST_FAILURE("Dynamic-index DMA buffer allocation failed.");
+
+        std::uint32_t handle = std::get<tenstorrent_allocate_dma_buf_out>(buf).buf_index;
+        if (handle < TENSTORRENT_MAX_DMA_BUFS)
+            THROW_TEST_FAILURE("Dynamic DMA buffer handle overlaps caller-chosen indices.");
+
+        for (auto h : handles)
+            if (h == handle)
+                THROW_TEST_FAILURE("Dynamic DMA buffer handle was handed out twice.");
+
+        handles.push_back(handle);
+
+        if (i == count - 1)
+        {
+            const auto &b = std::get<tenstorrent_allocate_dma_buf_out>(buf);
+
+            void *p = mmap(nullptr, DmaBufSize(b), PROT_READ | PROT_WRITE, MAP_SHARED, dev_fd, b.mapping_offset);
+            if (p == MAP_FAILED)
+                THROW_TEST_FAILURE("Dynamic-index DMA buffer mapping failed.");
+
+            std::memset(p, 0xA5, DmaBufSize(b));
+            munmap(p, DmaBufSize(b));
+        }
+    }
+
+    for (auto h : handles)
+        if (FreeDmaBuf(dev_fd, h) != 0)
+            THROW_TEST_FAILURE("Dynamic-index DMA buffer could not be freed.");
+}
+
 // Allocate TENSTORRENT_MAX_DMA_BUFS tiny buffers.
 // Allocate two buffers both for the same buf_index.
 // Allocate for buf_index = TENSTORRENT_MAX_DMA_BUFS.
@@ -134,6 +665,18 @@ void TestDmaBuf(const EnumeratedDevice &dev)
 {
     DevFd dev_fd(dev.path);
 
+    VerifyFreeDmaBuf(dev_fd.get());
+    VerifyRecycledDmaBufZeroed(dev_fd.get());
+    VerifyNumaNodeDmaBuf(dev_fd.get());
+    VerifyCacheableDmaBuf(dev_fd.get());
+    VerifyDmaBufDontNeed(dev_fd.get());
+    VerifyExportDmaBuf(dev_fd.get());
+    VerifyImportDmaBuf(dev_fd.get());
+    VerifyDynamicDmaBufIndex(dev_fd.get());
+    VerifyDmaBufPageSize(dev_fd.get());
+    VerifyNocPlacement(dev_fd.get());
+    VerifyReserveOutboundIatu(dev);
+
     std::size_t max_dma_buf_size = MaxDmaBufSize(dev_fd.get());
 
     // Verify we can allocate a buffer.
@@ -133,8 +133,20 @@ void TestAllocateDmaBufOverrun(int fd)
 
 void TestFreeDmaBufOverrun(int fd)
 {
+    tenstorrent_allocate_dma_buf alloc_buf{};
+
+    alloc_buf.in.requested_size = page_size();
+    alloc_buf.in.buf_index = 1;
+
+    if (ioctl(fd, TENSTORRENT_IOCTL_ALLOCATE_DMA_BUF, &alloc_buf) != 0)
+        THROW_TEST_FAILURE("DMA buffer allocation for FREE_DMA_BUF overrun check failed.");
+
     tenstorrent_free_dma_buf free_buf{};
+    free_buf.in.buf_index = 1;
+
+    CHECK_IOCTL_OVERRUN(fd, TENSTORRENT_IOCTL_FREE_DMA_BUF, free_buf);
 
+    // Nothing left to free at that index.
     CHECK_IOCTL_OVERRUN_ERROR(fd, TENSTORRENT_IOCTL_FREE_DMA_BUF, free_buf, EINVAL);
 }
 
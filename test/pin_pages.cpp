@@ -9,13 +9,25 @@
 // Verify that pin pages can simultaneously pin many ranges.
 // Verify that pin pages can pin multiple pages if they are contiguous.
 // Verify that pin pages can pin discontiguous memory if and only if IOMMU is enabled.
-
+// Verify that lookup pinning finds the pinning covering an address, and only that.
+// Verify that cached pinnings are shared and reused, and dropped once unmapped.
+// Verify that batched pin pages reports each entry's result separately.
+// Verify that async pin pages completes every ticket once and wakes poll().
+// Verify that segmented pinnings report segments that cover the range.
+// Verify that unpinning part of a pinning keeps the rest where it was.
+// Verify that memfd pinnings are shared between fds and dropped by each.
+// Verify that memfd pinnings need a writable, unsealed file.
+// Verify that memfd pinnings are not shared once the file is truncated.
+// Verify that NOC windows of pinnings keep their addresses as neighbours go.
+
+#include <algorithm>
 #include <iostream>
 #include <memory>
 #include <regex>
 #include <stdexcept>
 #include <string>
 #include <vector>
+#include <cerrno>
 #include <cmath>
 #include <cstddef>
 #include <cstdlib>
@@ -25,6 +37,7 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <unistd.h>
 
@@ -433,6 +446,650 @@ void VerifyUnpinPagesBadSize(const EnumeratedDevice &dev)
     }
 }
 
+int LookupPinning(int dev_fd, std::uint64_t virtual_address, tenstorrent_lookup_pinning &lookup)
+{
+    zero(&lookup);
+    lookup.argsz = sizeof(lookup);
+    lookup.virtual_address = virtual_address;
+
+    if (ioctl(dev_fd, TENSTORRENT_IOCTL_LOOKUP_PINNING, &lookup) != 0)
+        return errno;
+
+    return 0;
+}
+
+void VerifyLookupPinning(const EnumeratedDevice &dev)
+{
+    auto page_size = getpagesize();
+
+    struct tenstorrent_pin_pages pin_pages;
+    struct tenstorrent_unpin_pages unpin_pages;
+    struct tenstorrent_lookup_pinning lookup;
+
+    void *p = std::aligned_alloc(page_size, page_size * 4);
+    std::unique_ptr<void, Freer> pages(p);
+    auto base = reinterpret_cast<uintptr_t>(pages.get());
+
+    DevFd dev_fd(dev.path);
+
+    // Pin pages 0 and 2 separately, leaving a hole at page 1.
+    std::uint64_t physical_address[4] = {};
+    for (unsigned int i : { 0, 2 })
+    {
+        zero(&pin_pages);
+        pin_pages.in.output_size_bytes = sizeof(pin_pages.out);
+        pin_pages.in.flags = TENSTORRENT_PIN_PAGES_CONTIGUOUS;
+        pin_pages.in.virtual_address = base + i * page_size;
+        pin_pages.in.size = page_size;
+
+        if (ioctl(dev_fd.get(), TENSTORRENT_IOCTL_PIN_PAGES, &pin_pages) != 0)
+            THROW_TEST_FAILURE("PIN_PAGES failed single-page pin.");
+
+        physical_address[i] = pin_pages.out.physical_address;
+    }
+
+    if (LookupPinning(dev_fd.get(), base + 2 * page_size + 100, lookup) != 0)
+        THROW_TEST_FAILURE("LOOKUP_PINNING did not find a pinned address.");
+
+    if (lookup.pinned_address != base + 2 * page_size || lookup.pinned_size != std::uint64_t(page_size))
+        THROW_TEST_FAILURE("LOOKUP_PINNING reported the wrong pinning.");
+
+    if (lookup.physical_address != physical_address[2] + 100)
+        THROW_TEST_FAILURE("LOOKUP_PINNING reported the wrong physical address.");
+
+    if (LookupPinning(dev_fd.get(), base + page_size, lookup) != ENOENT)
+        THROW_TEST_FAILURE("LOOKUP_PINNING found an unpinned address.");
+
+    zero(&unpin_pages);
+    unpin_pages.in.virtual_address = base + 2 * page_size;
+    unpin_pages.in.size = page_size;
+
+    if (ioctl(dev_fd.get(), TENSTORRENT_IOCTL_UNPIN_PAGES, &unpin_pages) != 0)
+        THROW_TEST_FAILURE("UNPIN_PAGES failed single-page unpin.");
+
+    if (LookupPinning(dev_fd.get(), base + 2 * page_size, lookup) != ENOENT)
+        THROW_TEST_FAILURE("LOOKUP_PINNING found an unpinned range.");
+
+    if (LookupPinning(dev_fd.get(), base, lookup) != 0 || lookup.physical_address != physical_address[0])
+        THROW_TEST_FAILURE("LOOKUP_PINNING lost a pinning after another was unpinned.");
+}
+
+int PinCached(int dev_fd, void *p, std::size_t size, std::uint64_t &physical_address)
+{
+    struct tenstorrent_pin_pages pin_pages;
+
+    zero(&pin_pages);
+    pin_pages.in.output_size_bytes = sizeof(pin_pages.out);
+    pin_pages.in.flags = TENSTORRENT_PIN_PAGES_CONTIGUOUS | TENSTORRENT_PIN_PAGES_CACHE;
+    pin_pages.in.virtual_address = reinterpret_cast<uintptr_t>(p);
+    pin_pages.in.size = size;
+
+    if (ioctl(dev_fd, TENSTORRENT_IOCTL_PIN_PAGES, &pin_pages) != 0)
+        return errno;
+
+    physical_address = pin_pages.out.physical_address;
+    return 0;
+}
+
+int Unpin(int dev_fd, void *p, std::size_t size)
+{
+    struct tenstorrent_unpin_pages unpin_pages;
+
+    zero(&unpin_pages);
+    unpin_pages.in.virtual_address = reinterpret_cast<uintptr_t>(p);
+    unpin_pages.in.size = size;
+
+    if (ioctl(dev_fd, TENSTORRENT_IOCTL_UNPIN_PAGES, &unpin_pages) != 0)
+        return errno;
+
+    return 0;
+}
+
+void VerifyPinPagesCache(const EnumeratedDevice &dev)
+{
+    auto page_size = getpagesize();
+    std::uint64_t first = 0, again = 0;
+
+    DevFd dev_fd(dev.path);
+
+    void *p = mmap(nullptr, page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        THROW_TEST_FAILURE("mmap failed.");
+    std::unique_ptr<void, Unmapper> page(p, Unmapper{1});
+
+    int err = PinCached(dev_fd.get(), p, page_size, first);
+    if (err == EOPNOTSUPP)
+        return;
+    if (err != 0)
+        THROW_TEST_FAILURE("PIN_PAGES with CACHE failed single-page pin.");
+
+    // A second pin of a cached range shares it.
+    if (PinCached(dev_fd.get(), p, page_size, again) != 0 || again != first)
+        THROW_TEST_FAILURE("Cached PIN_PAGES of a pinned range was not shared.");
+
+    if (Unpin(dev_fd.get(), p, page_size) != 0 || Unpin(dev_fd.get(), p, page_size) != 0)
+        THROW_TEST_FAILURE("UNPIN_PAGES of a cached pinning failed.");
+
+    if (Unpin(dev_fd.get(), p, page_size) != EINVAL)
+        THROW_TEST_FAILURE("UNPIN_PAGES of an unpinned cached range did not fail with EINVAL.");
+
+    // Unpinned, but still cached.
+    if (PinCached(dev_fd.get(), p, page_size, again) != 0 || again != first)
+        THROW_TEST_FAILURE("Cached PIN_PAGES did not reuse the cached pinning.");
+
+    if (Unpin(dev_fd.get(), p, page_size) != 0)
+        THROW_TEST_FAILURE("UNPIN_PAGES of a cached pinning failed.");
+
+    // Replacing the mapping invalidates the cached pinning; pinning the new
+    // memory at the same address must still work.
+    void *q = mmap(p, page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    if (q != p)
+        THROW_TEST_FAILURE("mmap MAP_FIXED failed.");
+
+    if (PinCached(dev_fd.get(), p, page_size, again) != 0)
+        THROW_TEST_FAILURE("Cached PIN_PAGES of a remapped range failed.");
+
+    if (Unpin(dev_fd.get(), p, page_size) != 0)
+        THROW_TEST_FAILURE("UNPIN_PAGES of a cached pinning failed.");
+}
+
+void VerifyPinPagesBatch(const EnumeratedDevice &dev)
+{
+    const unsigned int count = 64;
+    auto page_size = getpagesize();
+
+    void *p = std::aligned_alloc(page_size, page_size * count);
+    std::unique_ptr<void, Freer> pages(p);
+
+    DevFd dev_fd(dev.path);
+
+    std::vector<tenstorrent_pin_pages_batch_entry> entries(count + 1);
+    for (unsigned int i = 0; i < count; i++)
+    {
+        zero(&entries[i]);
+        entries[i].virtual_address = reinterpret_cast<uintptr_t>(p) + page_size * i;
+        entries[i].size = page_size;
+    }
+
+    // A duplicate of an earlier entry fails on its own.
+    entries[count] = entries[0];
+
+    tenstorrent_pin_pages_batch batch;
+    zero(&batch);
+    batch.argsz = sizeof(batch);
+    batch.count = entries.size();
+    batch.entries = reinterpret_cast<uintptr_t>(entries.data());
+
+    if (ioctl(dev_fd.get(), TENSTORRENT_IOCTL_PIN_PAGES_BATCH, &batch) != 0)
+        THROW_TEST_FAILURE("PIN_PAGES_BATCH failed.");
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        if (entries[i].status != 0)
+            THROW_TEST_FAILURE("PIN_PAGES_BATCH failed entry " + std::to_string(i) + ".");
+
+        tenstorrent_lookup_pinning lookup;
+        if (LookupPinning(dev_fd.get(), entries[i].virtual_address, lookup) != 0
+            || lookup.physical_address != entries[i].physical_address)
+            THROW_TEST_FAILURE("PIN_PAGES_BATCH reported the wrong address for entry " + std::to_string(i) + ".");
+    }
+
+    if (entries[count].status != -EEXIST)
+        THROW_TEST_FAILURE("PIN_PAGES_BATCH did not reject a duplicate entry with EEXIST.");
+
+    for (unsigned int i = 0; i < count; i++)
+        if (Unpin(dev_fd.get(), reinterpret_cast<void *>(entries[i].virtual_address), page_size) != 0)
+            THROW_TEST_FAILURE("UNPIN_PAGES failed after PIN_PAGES_BATCH.");
+
+    batch.count = 0;
+    if (ioctl(dev_fd.get(), TENSTORRENT_IOCTL_PIN_PAGES_BATCH, &batch) == 0)
+        THROW_TEST_FAILURE("PIN_PAGES_BATCH succeeded with count = 0.");
+}
+
+void VerifyPinPagesAsync(const EnumeratedDevice &dev)
+{
+    const unsigned int count = 16;
+    auto page_size = getpagesize();
+
+    void *p = std::aligned_alloc(page_size, page_size * count);
+    std::unique_ptr<void, Freer> pages(p);
+
+    DevFd dev_fd(dev.path);
+
+    std::vector<std::uint64_t> tickets;
+    for (unsigned int i = 0; i < count; i++)
+    {
+        tenstorrent_pin_pages_async async;
+        zero(&async);
+        async.argsz = sizeof(async);
+        async.virtual_address = reinterpret_cast<uintptr_t>(p) + page_size * i;
+        async.size = page_size;
+
+        if (ioctl(dev_fd.get(), TENSTORRENT_IOCTL_PIN_PAGES_ASYNC, &async) != 0)
+            THROW_TEST_FAILURE("PIN_PAGES_ASYNC failed.");
+        if (async.ticket == 0)
+            THROW_TEST_FAILURE("PIN_PAGES_ASYNC returned ticket 0.");
+
+        tickets.push_back(async.ticket);
+    }
+
+    // The last one by ticket, the rest in completion order.
+    tenstorrent_pin_pages_complete complete;
+    zero(&complete);
+    complete.argsz = sizeof(complete);
+    complete.ticket = tickets.back();
+
+    if (ioctl(dev_fd.get(), TENSTORRENT_IOCTL_PIN_PAGES_COMPLETE, &complete) != 0 || complete.status != 0)
+        THROW_TEST_FAILURE("PIN_PAGES_COMPLETE failed for a single-page pin.");
+    if (complete.ticket != tickets.back())
+        THROW_TEST_FAILURE("PIN_PAGES_COMPLETE reported the wrong ticket.");
+
+    for (unsigned int i = 0; i + 1 < count; i++)
+    {
+        pollfd pfd = { dev_fd.get(), POLLIN, 0 };
+        if (poll(&pfd, 1, 10000) != 1 || !(pfd.revents & POLLIN))
+            THROW_TEST_FAILURE("poll did not report a completed async pin.");
+
+        zero(&complete);
+        complete.argsz = sizeof(complete);
+        complete.flags = TENSTORRENT_PIN_PAGES_COMPLETE_NONBLOCK;
+
+        if (ioctl(dev_fd.get(), TENSTORRENT_IOCTL_PIN_PAGES_COMPLETE, &complete) != 0 || complete.status != 0)
+            THROW_TEST_FAILURE("PIN_PAGES_COMPLETE failed after poll.");
+
+        auto it = std::find(tickets.begin(), tickets.end(), complete.ticket);
+        if (it == tickets.end())
+            THROW_TEST_FAILURE("PIN_PAGES_COMPLETE reported an unknown or repeated ticket.");
+        tickets.erase(it);
+    }
+
+    zero(&complete);
+    complete.argsz = sizeof(complete);
+    if (ioctl(dev_fd.get(), TENSTORRENT_IOCTL_PIN_PAGES_COMPLETE, &complete) == 0 || errno != ENOENT)
+        THROW_TEST_FAILURE("PIN_PAGES_COMPLETE with nothing outstanding did not fail with ENOENT.");
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        tenstorrent_lookup_pinning lookup;
+        if (LookupPinning(dev_fd.get(), reinterpret_cast<uintptr_t>(p) + page_size * i, lookup) != 0)
+            THROW_TEST_FAILURE("Async pinning not found by LOOKUP_PINNING.");
+    }
+}
+
+void VerifyPinPagesSegmented(const EnumeratedDevice &dev)
+{
+    const unsigned int count = 64;
+    auto page_size = getpagesize();
+
+    void *p = std::aligned_alloc(page_size, page_size * count);
+    std::unique_ptr<void, Freer> pages(p);
+
+    DevFd dev_fd(dev.path);
+
+    tenstorrent_pin_pages pin_pages;
+    zero(&pin_pages);
+    pin_pages.in.output_size_bytes = sizeof(pin_pages.out);
+    pin_pages.in.flags = TENSTORRENT_PIN_PAGES_SEGMENTED;
+    pin_pages.in.virtual_address = reinterpret_cast<uintptr_t>(p);
+    pin_pages.in.size = page_size * count;
+
+    if (ioctl(dev_fd.get(), TENSTORRENT_IOCTL_PIN_PAGES, &pin_pages) != 0)
+        THROW_TEST_FAILURE("PIN_PAGES with SEGMENTED failed.");
+
+    tenstorrent_get_pin_segments get_segments;
+    zero(&get_segments);
+    get_segments.argsz = sizeof(get_segments);
+    get_segments.virtual_address = reinterpret_cast<uintptr_t>(p) + page_size;
+
+    if (ioctl(dev_fd.get(), TENSTORRENT_IOCTL_GET_PIN_SEGMENTS, &get_segments) != 0)
+        THROW_TEST_FAILURE("GET_PIN_SEGMENTS failed to count segments.");
+    if (get_segments.count == 0 || get_segments.count > count)
+        THROW_TEST_FAILURE("GET_PIN_SEGMENTS reported " + std::to_string(get_segments.count) + " segments.");
+
+    std::vector<tenstorrent_pin_segment> segments(get_segments.count);
+    get_segments.segments = reinterpret_cast<uintptr_t>(segments.data());
+
+    if (ioctl(dev_fd.get(), TENSTORRENT_IOCTL_GET_PIN_SEGMENTS, &get_segments) != 0)
+        THROW_TEST_FAILURE("GET_PIN_SEGMENTS failed.");
+    if (get_segments.count != segments.size())
+        THROW_TEST_FAILURE("GET_PIN_SEGMENTS changed its segment count.");
+    if (segments[0].address != pin_pages.out.physical_address)
+        THROW_TEST_FAILURE("GET_PIN_SEGMENTS does not start at the pinned address.");
+
+    // Each page must be where the segments say it is.
+    std::uint64_t offset = 0;
+    for (const auto &segment : segments)
+    {
+        if (segment.size == 0 || segment.size % page_size != 0)
+            THROW_TEST_FAILURE("GET_PIN_SEGMENTS reported a bad segment size.");
+
+        for (std::uint64_t i = 0; i < segment.size; i += page_size)
+        {
+            tenstorrent_lookup_pinning lookup;
+            if (LookupPinning(dev_fd.get(), reinterpret_cast<uintptr_t>(p) + offset + i, lookup) != 0
+                || lookup.physical_address != segment.address + i)
+                THROW_TEST_FAILURE("LOOKUP_PINNING disagrees with GET_PIN_SEGMENTS.");
+        }
+
+        offset += segment.size;
+    }
+
+    if (offset != page_size * count)
+        THROW_TEST_FAILURE("GET_PIN_SEGMENTS segments do not cover the pinning.");
+
+    if (Unpin(dev_fd.get(), p, page_size * count) != 0)
+        THROW_TEST_FAILURE("UNPIN_PAGES failed for a segmented pinning.");
+
+    if (ioctl(dev_fd.get(), TENSTORRENT_IOCTL_GET_PIN_SEGMENTS, &get_segments) == 0 || errno != ENOENT)
+        THROW_TEST_FAILURE("GET_PIN_SEGMENTS of an unpinned range did not fail with ENOENT.");
+}
+
+void VerifyUnpinPagesPartial(const EnumeratedDevice &dev)
+{
+    const unsigned int count = 16;
+    auto page_size = getpagesize();
+
+    void *p = std::aligned_alloc(page_size, page_size * count);
+    std::unique_ptr<void, Freer> pages(p);
+    auto base = reinterpret_cast<uintptr_t>(p);
+
+    DevFd dev_fd(dev.path);
+
+    tenstorrent_pin_pages pin_pages;
+    zero(&pin_pages);
+    pin_pages.in.output_size_bytes = sizeof(pin_pages.out);
+    pin_pages.in.flags = TENSTORRENT_PIN_PAGES_SEGMENTED;
+    pin_pages.in.virtual_address = base;
+    pin_pages.in.size = page_size * count;
+
+    if (ioctl(dev_fd.get(), TENSTORRENT_IOCTL_PIN_PAGES, &pin_pages) != 0)
+        THROW_TEST_FAILURE("PIN_PAGES with SEGMENTED failed.");
+
+    std::vector<std::uint64_t> physical(count);
+    for (unsigned int i = 0; i < count; i++)
+    {
+        tenstorrent_lookup_pinning lookup;
+        if (LookupPinning(dev_fd.get(), base + page_size * i, lookup) != 0)
+            THROW_TEST_FAILURE("LOOKUP_PINNING failed.");
+        physical[i] = lookup.physical_address;
+    }
+
+    // Pages 4..7 go, leaving 0..3 and 8..15.
+    int err = Unpin(dev_fd.get(), reinterpret_cast<void *>(base + page_size * 4), page_size * 4);
+    if (err == EOPNOTSUPP)
+    {
+        // IOMMU-mapped pinnings can only be unpinned whole.
+        if (Unpin(dev_fd.get(), p, page_size * count) != 0)
+            THROW_TEST_FAILURE("UNPIN_PAGES failed.");
+        return;
+    }
+    if (err != 0)
+        THROW_TEST_FAILURE("UNPIN_PAGES of part of a pinning failed.");
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        tenstorrent_lookup_pinning lookup;
+        bool unpinned = i >= 4 && i < 8;
+
+        err = LookupPinning(dev_fd.get(), base + page_size * i, lookup);
+        if (unpinned && err != ENOENT)
+            THROW_TEST_FAILURE("A partly unpinned page is still pinned.");
+        if (!unpinned && (err != 0 || lookup.physical_address != physical[i]))
+            THROW_TEST_FAILURE("Partial UNPIN_PAGES moved or dropped a page it should have kept.");
+    }
+
+    if (Unpin(dev_fd.get(), p, page_size * count) != EINVAL)
+        THROW_TEST_FAILURE("UNPIN_PAGES of the original range after a split did not fail with EINVAL.");
+
+    if (Unpin(dev_fd.get(), p, page_size * 4) != 0
+        || Unpin(dev_fd.get(), reinterpret_cast<void *>(base + page_size * 8), page_size * 8) != 0)
+        THROW_TEST_FAILURE("UNPIN_PAGES of the pieces of a split pinning failed.");
+}
+
+int PinMemfd(int dev_fd, int memfd, std::uint32_t flags, std::uint64_t size, tenstorrent_pin_memfd &pin)
+{
+    zero(&pin);
+    pin.argsz = sizeof(pin);
+    pin.flags = flags;
+    pin.fd = memfd;
+    pin.size = size;
+
+    if (ioctl(dev_fd, TENSTORRENT_IOCTL_PIN_MEMFD, &pin) != 0)
+        return errno;
+
+    return 0;
+}
+
+int UnpinMemfd(int dev_fd, int memfd, std::uint64_t size)
+{
+    tenstorrent_unpin_memfd unpin;
+    zero(&unpin);
+    unpin.argsz = sizeof(unpin);
+    unpin.fd = memfd;
+    unpin.size = size;
+
+    if (ioctl(dev_fd, TENSTORRENT_IOCTL_UNPIN_MEMFD, &unpin) != 0)
+        return errno;
+
+    return 0;
+}
+
+void VerifyPinMemfd(const EnumeratedDevice &dev)
+{
+    // One page, so that it is contiguous even without an IOMMU.
+    auto page_size = getpagesize();
+
+    int memfd = memfd_create("pin_memfd", 0);
+    if (memfd < 0)
+        THROW_TEST_FAILURE("memfd_create failed.");
+
+    if (ftruncate(memfd, page_size) != 0)
+    {
+        close(memfd);
+        THROW_TEST_FAILURE("ftruncate of memfd failed.");
+    }
+
+    DevFd dev_fd1(dev.path);
+    DevFd dev_fd2(dev.path);
+
+    tenstorrent_pin_memfd pin1;
+    int err = PinMemfd(dev_fd1.get(), memfd, 0, page_size, pin1);
+    if (err == EOPNOTSUPP)
+    {
+        // Needs Linux 6.11.
+        close(memfd);
+        return;
+    }
+    if (err != 0)
+        THROW_TEST_FAILURE("PIN_MEMFD failed.");
+
+    tenstorrent_pin_memfd pin2;
+    if (PinMemfd(dev_fd2.get(), memfd, TENSTORRENT_PIN_MEMFD_NOC_DMA, page_size, pin2) != 0)
+        THROW_TEST_FAILURE("PIN_MEMFD of an already pinned range failed.");
+
+    if (pin2.physical_address != pin1.physical_address)
+        THROW_TEST_FAILURE("PIN_MEMFD of the same range from two fds returned different addresses.");
+
+    if (pin2.noc_address == 0)
+        THROW_TEST_FAILURE("PIN_MEMFD with NOC_DMA returned no NOC address.");
+
+    // Each fd drops only its own pin.
+    if (UnpinMemfd(dev_fd1.get(), memfd, page_size) != 0)
+        THROW_TEST_FAILURE("UNPIN_MEMFD failed.");
+
+    if (UnpinMemfd(dev_fd1.get(), memfd, page_size) != EINVAL)
+        THROW_TEST_FAILURE("Second UNPIN_MEMFD from the same fd did not fail with EINVAL.");
+
+    if (UnpinMemfd(dev_fd2.get(), memfd, page_size) != 0)
+        THROW_TEST_FAILURE("UNPIN_MEMFD from the second fd failed.");
+
+    // The device may write the pages, so a read-only fd can't pin them.
+    std::string path = "/proc/self/fd/" + std::to_string(memfd);
+    int read_only = open(path.c_str(), O_RDONLY);
+    if (read_only < 0)
+        THROW_TEST_FAILURE("Reopening memfd read-only failed.");
+
+    err = PinMemfd(dev_fd1.get(), read_only, 0, page_size, pin1);
+    close(read_only);
+    if (err != EBADF)
+        THROW_TEST_FAILURE("PIN_MEMFD of a read-only fd did not fail with EBADF.");
+
+    close(memfd);
+
+    // Nor can a write-sealed memfd.
+    memfd = memfd_create("pin_memfd_sealed", MFD_ALLOW_SEALING);
+    if (memfd < 0)
+        THROW_TEST_FAILURE("memfd_create failed.");
+
+    if (ftruncate(memfd, page_size) != 0 || fcntl(memfd, F_ADD_SEALS, F_SEAL_WRITE) != 0)
+    {
+        close(memfd);
+        THROW_TEST_FAILURE("Sealing memfd failed.");
+    }
+
+    err = PinMemfd(dev_fd1.get(), memfd, 0, page_size, pin1);
+    close(memfd);
+    if (err != EPERM)
+        THROW_TEST_FAILURE("PIN_MEMFD of a write-sealed memfd did not fail with EPERM.");
+
+    tenstorrent_pin_memfd bad;
+    if (PinMemfd(dev_fd1.get(), -1, 0, page_size, bad) != EBADF)
+        THROW_TEST_FAILURE("PIN_MEMFD of an invalid fd did not fail with EBADF.");
+
+    if (PinMemfd(dev_fd1.get(), dev_fd1.get(), 0, page_size / 2, bad) != EINVAL)
+        THROW_TEST_FAILURE("PIN_MEMFD of a partial page did not fail with EINVAL.");
+}
+
+// Truncating a pinned memfd drops its pages from the file, so a later
+// PIN_MEMFD of the range must pin the new pages rather than share the old.
+void VerifyPinMemfdTruncate(const EnumeratedDevice &dev)
+{
+    auto page_size = getpagesize();
+
+    int memfd = memfd_create("pin_memfd_truncate", 0);
+    if (memfd < 0)
+        THROW_TEST_FAILURE("memfd_create failed.");
+
+    if (ftruncate(memfd, page_size) != 0)
+    {
+        close(memfd);
+        THROW_TEST_FAILURE("ftruncate of memfd failed.");
+    }
+
+    DevFd dev_fd1(dev.path);
+    DevFd dev_fd2(dev.path);
+
+    tenstorrent_pin_memfd pin1;
+    int err = PinMemfd(dev_fd1.get(), memfd, 0, page_size, pin1);
+    if (err == EOPNOTSUPP)
+    {
+        close(memfd);
+        return;
+    }
+    if (err != 0)
+        THROW_TEST_FAILURE("PIN_MEMFD failed.");
+
+    if (ftruncate(memfd, 0) != 0 || ftruncate(memfd, page_size) != 0)
+        THROW_TEST_FAILURE("Truncating pinned memfd failed.");
+
+    tenstorrent_pin_memfd pin2;
+    if (PinMemfd(dev_fd2.get(), memfd, 0, page_size, pin2) != 0)
+        THROW_TEST_FAILURE("PIN_MEMFD of a truncated range failed.");
+
+    if (pin2.physical_address == pin1.physical_address)
+        THROW_TEST_FAILURE("PIN_MEMFD after truncation shared the pinning of the dropped pages.");
+
+    if (UnpinMemfd(dev_fd1.get(), memfd, page_size) != 0 || UnpinMemfd(dev_fd2.get(), memfd, page_size) != 0)
+        THROW_TEST_FAILURE("UNPIN_MEMFD after truncation failed.");
+
+    close(memfd);
+}
+
+void VerifyPinPagesNocCoalesce(const EnumeratedDevice &dev)
+{
+    // More pinnings than there are outbound iATU regions. Those the driver
+    // can't give a window, because none of its windows is adjacent, fail.
+    const unsigned int count = 64;
+    auto page_size = getpagesize();
+
+    void *p = std::aligned_alloc(page_size, page_size * count);
+    std::unique_ptr<void, Freer> pages(p);
+    auto base = reinterpret_cast<uintptr_t>(p);
+
+    DevFd dev_fd(dev.path);
+
+    std::vector<std::uint64_t> noc;
+    for (unsigned int i = 0; i < count; i++)
+    {
+        struct
+        {
+            tenstorrent_pin_pages_in in;
+            tenstorrent_pin_pages_out_extended out;
+        } pin_extended;
+        zero(&pin_extended);
+        pin_extended.in.output_size_bytes = sizeof(pin_extended.out);
+        pin_extended.in.flags = TENSTORRENT_PIN_PAGES_NOC_DMA;
+        pin_extended.in.virtual_address = base + page_size * i;
+        pin_extended.in.size = page_size;
+
+        if (ioctl(dev_fd.get(), TENSTORRENT_IOCTL_PIN_PAGES, &pin_extended) != 0)
+        {
+            if (errno != ENOSPC && errno != ENOMEM)
+                THROW_TEST_FAILURE("NOC_DMA PIN_PAGES failed with an unexpected error.");
+            break;
+        }
+
+        for (auto other : noc)
+            if (other == pin_extended.out.noc_address)
+                THROW_TEST_FAILURE("Two pinnings were given the same NOC address.");
+
+        noc.push_back(pin_extended.out.noc_address);
+    }
+
+    auto check_remaining = [&](const std::vector<bool> &unpinned)
+    {
+        for (unsigned int i = 0; i < noc.size(); i++)
+        {
+            if (unpinned[i])
+                continue;
+
+            tenstorrent_lookup_pinning lookup;
+            if (LookupPinning(dev_fd.get(), base + page_size * i, lookup) != 0)
+                THROW_TEST_FAILURE("LOOKUP_PINNING of a pinned page failed.");
+            if (lookup.noc_address != noc[i])
+                THROW_TEST_FAILURE("A pinning's NOC address changed as others were unpinned.");
+        }
+    };
+
+    // Odd pages first, some from the middle of a shared window, which can
+    // only go once a window end reaches them. Each pass unpins what it can.
+    std::vector<bool> unpinned(noc.size(), false);
+    unsigned int remaining = noc.size();
+    for (unsigned int pass = 0; remaining > 0; pass++)
+    {
+        unsigned int before = remaining;
+
+        for (unsigned int i = pass == 0 ? 1 : 0; i < noc.size(); i += pass == 0 ? 2 : 1)
+        {
+            if (unpinned[i])
+                continue;
+
+            int err = Unpin(dev_fd.get(), reinterpret_cast<void *>(base + page_size * i), page_size);
+            if (err == EBUSY)
+                continue;
+            if (err != 0)
+                THROW_TEST_FAILURE("UNPIN_PAGES of a NOC_DMA pinning failed.");
+
+            unpinned[i] = true;
+            remaining--;
+            check_remaining(unpinned);
+        }
+
+        if (pass > 0 && remaining == before)
+            THROW_TEST_FAILURE("UNPIN_PAGES of NOC_DMA pinnings failed with EBUSY at every window end.");
+    }
+}
+
 void TestPinPages(const EnumeratedDevice &dev)
 {
     VerifyPinPagesSimple(dev);
@@ -444,4 +1101,13 @@ void TestPinPages(const EnumeratedDevice &dev)
     VerifyPinPagesNotContiguous(dev);
     VerifyUnpinPagesSimple(dev);
     VerifyUnpinPagesBadSize(dev);
+    VerifyLookupPinning(dev);
+    VerifyPinPagesCache(dev);
+    VerifyPinPagesBatch(dev);
+    VerifyPinPagesAsync(dev);
+    VerifyPinPagesSegmented(dev);
+    VerifyUnpinPagesPartial(dev);
+    VerifyPinMemfd(dev);
+    VerifyPinMemfdTruncate(dev);
+    VerifyPinPagesNocCoalesce(dev);
 }
@@ -6,6 +6,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <cerrno>
 #include <algorithm>
 #include <array>
 #include <memory>
@@ -604,6 +605,73 @@ void VerifyMappedWindowCannotBeFreed(const EnumeratedDevice &dev)
         THROW_TEST_FAILURE("Failed to free TLB");
 }
 
+// A per-fd limit caps how many windows of one kind the fd may own.
+void VerifyTlbQuotaEnforced(const EnumeratedDevice &dev)
+{
+    DevFd dev_fd(dev.path);
+    int fd = dev_fd.get();
+
+    tenstorrent_set_tlb_quota quota{};
+    quota.argsz = sizeof(quota);
+    quota.size = TWO_MEG;
+    quota.limit = 1;
+    if (ioctl(fd, TENSTORRENT_IOCTL_SET_TLB_QUOTA, &quota) != 0)
+        THROW_TEST_FAILURE("Failed to set TLB quota");
+
+    tenstorrent_allocate_tlb first{};
+    first.in.size = TWO_MEG;
+    if (ioctl(fd, TENSTORRENT_IOCTL_ALLOCATE_TLB, &first) != 0)
+        THROW_TEST_FAILURE("Failed to allocate TLB within quota");
+
+    tenstorrent_allocate_tlb second{};
+    second.in.size = TWO_MEG;
+    if (ioctl(fd, TENSTORRENT_IOCTL_ALLOCATE_TLB, &second) == 0)
+        THROW_TEST_FAILURE("Allocated TLB beyond quota");
+    if (errno != EDQUOT)
+        THROW_TEST_FAILURE("Expected EDQUOT allocating TLB beyond quota");
+
+    tenstorrent_free_tlb free_tlb{};
+    free_tlb.in.id = first.out.id;
+    if (ioctl(fd, TENSTORRENT_IOCTL_FREE_TLB, &free_tlb) != 0)
+        THROW_TEST_FAILURE("Failed to free TLB");
+
+    if (ioctl(fd, TENSTORRENT_IOCTL_ALLOCATE_TLB, &second) != 0)
+        THROW_TEST_FAILURE("Failed to allocate TLB after freeing within quota");
+}
+
+// A reserved window stays available to its fd after another fd has allocated
+// every window it can.
+void VerifyTlbReservationHonored(const EnumeratedDevice &dev)
+{
+    DevFd reserving_fd(dev.path);
+    DevFd greedy_fd(dev.path);
+
+    tenstorrent_set_tlb_quota quota{};
+    quota.argsz = sizeof(quota);
+    quota.size = TWO_MEG;
+    quota.reserve = 1;
+    if (ioctl(reserving_fd.get(), TENSTORRENT_IOCTL_SET_TLB_QUOTA, &quota) != 0) {
+        if (errno == EPERM)
+            return; // Reservations require CAP_SYS_ADMIN.
+        THROW_TEST_FAILURE("Failed to reserve TLB");
+    }
+
+    for (;;) {
+        tenstorrent_allocate_tlb allocate_tlb{};
+        allocate_tlb.in.size = TWO_MEG;
+        if (ioctl(greedy_fd.get(), TENSTORRENT_IOCTL_ALLOCATE_TLB, &allocate_tlb) != 0)
+            break;
+    }
+
+    if (errno != ENOMEM)
+        THROW_TEST_FAILURE("Expected ENOMEM once only reserved windows remain");
+
+    tenstorrent_allocate_tlb allocate_tlb{};
+    allocate_tlb.in.size = TWO_MEG;
+    if (ioctl(reserving_fd.get(), TENSTORRENT_IOCTL_ALLOCATE_TLB, &allocate_tlb) != 0)
+        THROW_TEST_FAILURE("Failed to allocate reserved TLB");
+}
+
 } // namespace
 
 void TestTlbs(const EnumeratedDevice &dev)
@@ -631,4 +699,6 @@ void TestTlbs(const EnumeratedDevice &dev)
 
     VerifyPartialUnmappingDisallowed(dev);
     VerifyMappedWindowCannotBeFreed(dev);
+    VerifyTlbQuotaEnforced(dev);
+    VerifyTlbReservationHonored(dev);
 }
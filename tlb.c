@@ -1,71 +1,157 @@
 // SPDX-FileCopyrightText: © 2025 Tenstorrent Inc.
 // SPDX-License-Identifier: GPL-2.0-only
 
-#include <linux/sched/signal.h>
+#include <linux/spinlock.h>
 
 #include "tlb.h"
 #include "device.h"
+#include "module.h"
 
-int tenstorrent_device_allocate_tlb(struct tenstorrent_device *tt_dev, size_t size)
+// First bit of TLB kind @kind in the device TLB bitmap.
+static unsigned long tlb_kind_offset(struct tenstorrent_device *tt_dev, int kind)
 {
-	const struct tenstorrent_device_class *dev_class = tt_dev->dev_class;
-	unsigned long id = 0;
-	unsigned long offset = 0; // Offset into the TLB bitmap.
-	unsigned long n = 0; // Total number of TLBs of the requested size.
+	unsigned long offset = 0;
+	int i;
+
+	for (i = 0; i < kind; ++i)
+		offset += tt_dev->tlb_counts[i];
+
+	return offset;
+}
+
+static int tlb_kind_for_id(struct tenstorrent_device *tt_dev, unsigned int id)
+{
+	unsigned long offset = 0;
 	int kind;
 
-	if (dev_class->tlb_kinds == 0)
-		return -EINVAL;
+	for (kind = 0; kind < tt_dev->dev_class->tlb_kinds; ++kind) {
+		offset += tt_dev->tlb_counts[kind];
+		if (id < offset)
+			return kind;
+	}
 
-	for (kind = 0; kind < dev_class->tlb_kinds; ++kind) {
-		long tlb_count = tt_dev->tlb_counts[kind];
-		long tlb_size = dev_class->tlb_sizes[kind];
+	return -EINVAL;
+}
 
-		if (size == tlb_size) {
-			n = tlb_count;
-			break;
-		}
+int tenstorrent_tlb_kind_for_size(struct tenstorrent_device *tt_dev, size_t size)
+{
+	const struct tenstorrent_device_class *dev_class = tt_dev->dev_class;
+	int kind;
 
-		offset += tlb_count;
+	for (kind = 0; kind < dev_class->tlb_kinds; ++kind) {
+		if (size == dev_class->tlb_sizes[kind] && tt_dev->tlb_counts[kind] != 0)
+			return kind;
 	}
 
-	if (n == 0)
-		return -EINVAL;
+	return -EINVAL;
+}
 
-	// Find a free TLB and atomically claim it.
-	for (;;) {
-		id = find_next_zero_bit(tt_dev->tlbs, offset + n, offset);
+static u32 count_free_tlbs(struct tenstorrent_device *tt_dev, int kind)
+{
+	unsigned long offset = tlb_kind_offset(tt_dev, kind);
+	unsigned long end = offset + tt_dev->tlb_counts[kind];
+	unsigned long id;
+	u32 n = 0;
 
-		if (id == offset + n)
-			return -ENOMEM;
+	for (id = find_next_zero_bit(tt_dev->tlbs, end, offset); id < end;
+	     id = find_next_zero_bit(tt_dev->tlbs, end, id + 1))
+		n++;
 
-		if (!test_and_set_bit(id, tt_dev->tlbs)) {
-			refcount_set(&tt_dev->tlb_refcount[id], 1);
-			return id; // Claimed this TLB.
-		}
+	return n;
+}
 
-		cond_resched();
-		if (signal_pending(current))
-			return -ERESTARTSYS;
-	}
+// Windows reserved by an fd that it has not allocated yet.
+static u32 tlb_quota_pending(const struct tenstorrent_tlb_quota *quota, int kind)
+{
+	if (quota->reserved[kind] > quota->used[kind])
+		return quota->reserved[kind] - quota->used[kind];
 
-	// Unreachable.
-	return -EINVAL;
+	return 0;
 }
 
-int tenstorrent_device_free_tlb(struct tenstorrent_device *tt_dev, unsigned int id)
+// Change the number of windows an fd owns, keeping the device-wide count of
+// outstanding reservations in step.
+static void tlb_quota_adjust_used(struct tenstorrent_device *tt_dev,
+				  struct tenstorrent_tlb_quota *quota, int kind, int delta)
 {
-	const struct tenstorrent_device_class *dev_class = tt_dev->dev_class;
-	u64 total_tlbs = 0;
-	int i;
+	lockdep_assert_held(&tt_dev->tlb_quota_lock);
 
-	if (dev_class->tlb_kinds == 0)
-		return -EINVAL;
+	tt_dev->tlb_reserve_outstanding[kind] -= tlb_quota_pending(quota, kind);
+	quota->used[kind] += delta;
+	tt_dev->tlb_reserve_outstanding[kind] += tlb_quota_pending(quota, kind);
+}
+
+u32 tenstorrent_tlb_default_limit(struct tenstorrent_device *tt_dev, int kind)
+{
+	u32 percent = min(READ_ONCE(tlb_quota_percent), 100u);
 
-	for (i = 0; i < dev_class->tlb_kinds; ++i)
-		total_tlbs += tt_dev->tlb_counts[i];
+	return DIV_ROUND_UP(tt_dev->tlb_counts[kind] * percent, 100);
+}
+
+u32 tenstorrent_tlb_quota_limit(struct tenstorrent_device *tt_dev,
+				const struct tenstorrent_tlb_quota *quota, int kind)
+{
+	if (quota->limit[kind])
+		return quota->limit[kind];
 
-	if (id >= total_tlbs)
+	return tenstorrent_tlb_default_limit(tt_dev, kind);
+}
+
+int tenstorrent_device_allocate_tlb(struct tenstorrent_device *tt_dev,
+				    struct tenstorrent_tlb_quota *quota, size_t size)
+{
+	unsigned long offset; // Offset into the TLB bitmap.
+	unsigned long end;
+	unsigned long id;
+	int kind;
+	int ret;
+
+	kind = tenstorrent_tlb_kind_for_size(tt_dev, size);
+	if (kind < 0)
+		return kind;
+
+	offset = tlb_kind_offset(tt_dev, kind);
+	end = offset + tt_dev->tlb_counts[kind];
+
+	spin_lock(&tt_dev->tlb_quota_lock);
+
+	if (quota->used[kind] >= tenstorrent_tlb_quota_limit(tt_dev, quota, kind)) {
+		ret = -EDQUOT;
+		goto unlock;
+	}
+
+	// Free windows beyond those other fds have reserved are open to anyone;
+	// an fd with an unused reservation may also take one of the rest.
+	if (tlb_quota_pending(quota, kind) == 0 &&
+	    count_free_tlbs(tt_dev, kind) <= tt_dev->tlb_reserve_outstanding[kind]) {
+		ret = -ENOMEM;
+		goto unlock;
+	}
+
+	// Windows are only claimed under tlb_quota_lock, so a free bit found here
+	// cannot be taken from under us; frees clear bits without the lock.
+	id = find_next_zero_bit(tt_dev->tlbs, end, offset);
+	if (id == end) {
+		ret = -ENOMEM;
+		goto unlock;
+	}
+
+	set_bit(id, tt_dev->tlbs);
+	refcount_set(&tt_dev->tlb_refcount[id], 1);
+	tlb_quota_adjust_used(tt_dev, quota, kind, 1);
+	ret = id;
+
+unlock:
+	spin_unlock(&tt_dev->tlb_quota_lock);
+	return ret;
+}
+
+int tenstorrent_device_free_tlb(struct tenstorrent_device *tt_dev,
+				struct tenstorrent_tlb_quota *quota, unsigned int id)
+{
+	int kind = tlb_kind_for_id(tt_dev, id);
+
+	if (kind < 0)
 		return -EINVAL;
 
 	if (!test_bit(id, tt_dev->tlbs))
@@ -77,9 +163,57 @@ int tenstorrent_device_free_tlb(struct tenstorrent_device *tt_dev, unsigned int
 	if (refcount_dec_and_test(&tt_dev->tlb_refcount[id]))
 		clear_bit(id, tt_dev->tlbs);
 
+	spin_lock(&tt_dev->tlb_quota_lock);
+	tlb_quota_adjust_used(tt_dev, quota, kind, -1);
+	spin_unlock(&tt_dev->tlb_quota_lock);
+
 	return 0;
 }
 
+// Set an fd's limit and reservation for one TLB kind. A reservation is only
+// granted if enough windows are free right now, so that it can be honored.
+int tenstorrent_tlb_set_quota(struct tenstorrent_device *tt_dev, struct tenstorrent_tlb_quota *quota,
+			      int kind, u32 limit, u32 reserve)
+{
+	u32 pending;
+	u32 others;
+	int ret = 0;
+
+	spin_lock(&tt_dev->tlb_quota_lock);
+
+	pending = reserve > quota->used[kind] ? reserve - quota->used[kind] : 0;
+	others = tt_dev->tlb_reserve_outstanding[kind] - tlb_quota_pending(quota, kind);
+
+	if (pending > tlb_quota_pending(quota, kind) &&
+	    count_free_tlbs(tt_dev, kind) < others + pending) {
+		ret = -ENOSPC;
+		goto unlock;
+	}
+
+	quota->limit[kind] = limit;
+	quota->reserved[kind] = reserve;
+	tt_dev->tlb_reserve_outstanding[kind] = others + pending;
+
+unlock:
+	spin_unlock(&tt_dev->tlb_quota_lock);
+	return ret;
+}
+
+// Return an fd's unused reservations to the pool, e.g. once it can no longer
+// allocate windows because it is closing or was invalidated by a reset.
+void tenstorrent_tlb_drop_reservations(struct tenstorrent_device *tt_dev,
+				       struct tenstorrent_tlb_quota *quota)
+{
+	int kind;
+
+	spin_lock(&tt_dev->tlb_quota_lock);
+	for (kind = 0; kind < tt_dev->dev_class->tlb_kinds; ++kind) {
+		tt_dev->tlb_reserve_outstanding[kind] -= tlb_quota_pending(quota, kind);
+		quota->reserved[kind] = 0;
+	}
+	spin_unlock(&tt_dev->tlb_quota_lock);
+}
+
 // Take an export reference on an allocated TLB window, keeping it allocated
 // (and out of the free pool) for the lifetime of a dma-buf export, even across
 // FREE_TLB or close() of the owning fd. The caller must currently own the
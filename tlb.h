@@ -6,6 +6,8 @@
 
 #include <linux/types.h>
 
+#define MAX_TLB_KINDS 4
+
 struct tenstorrent_device;
 struct tenstorrent_noc_tlb_config;
 
@@ -15,11 +17,29 @@ struct tlb_descriptor {
 	unsigned long bar_offset;
 };
 
-int tenstorrent_device_allocate_tlb(struct tenstorrent_device *tt_dev, size_t size);
-int tenstorrent_device_free_tlb(struct tenstorrent_device *tt_dev, unsigned int id);
+// Per-fd TLB window accounting, indexed by TLB kind.
+// Protected by tenstorrent_device.tlb_quota_lock.
+struct tenstorrent_tlb_quota {
+	u32 limit[MAX_TLB_KINDS];	// Most windows the fd may own, 0 = tlb_quota_percent default
+	u32 reserved[MAX_TLB_KINDS];	// Windows guaranteed to the fd
+	u32 used[MAX_TLB_KINDS];	// Windows the fd currently owns
+};
+
+int tenstorrent_device_allocate_tlb(struct tenstorrent_device *tt_dev,
+				    struct tenstorrent_tlb_quota *quota, size_t size);
+int tenstorrent_device_free_tlb(struct tenstorrent_device *tt_dev,
+				struct tenstorrent_tlb_quota *quota, unsigned int id);
 void tenstorrent_tlb_export_get(struct tenstorrent_device *tt_dev, unsigned int id);
 void tenstorrent_tlb_export_put(struct tenstorrent_device *tt_dev, unsigned int id);
 int tenstorrent_device_configure_tlb(struct tenstorrent_device *tt_dev, int tlb,
 				     struct tenstorrent_noc_tlb_config *config);
+int tenstorrent_tlb_kind_for_size(struct tenstorrent_device *tt_dev, size_t size);
+u32 tenstorrent_tlb_quota_limit(struct tenstorrent_device *tt_dev,
+				const struct tenstorrent_tlb_quota *quota, int kind);
+u32 tenstorrent_tlb_default_limit(struct tenstorrent_device *tt_dev, int kind);
+int tenstorrent_tlb_set_quota(struct tenstorrent_device *tt_dev, struct tenstorrent_tlb_quota *quota,
+			      int kind, u32 limit, u32 reserve);
+void tenstorrent_tlb_drop_reservations(struct tenstorrent_device *tt_dev,
+				       struct tenstorrent_tlb_quota *quota);
 
 #endif // TTDRIVER_TLB_H_INCLUDED
@@ -18,6 +18,7 @@
 #include "tlb.h"
 #include "telemetry.h"
 #include "enumerate.h"
+#include "interrupt.h"
 
 #define TLB_1M_WINDOW_COUNT 156
 #define TLB_1M_SHIFT 20
@@ -167,10 +168,12 @@ static int arc_msg_poll_completion(struct pci_dev *pdev, u8 __iomem *reset_unit_
 {
 	// Scale poll_period for around 100 polls, and at least 10 us
 	u32 poll_period_us = max((u32)10, timeout_us / 100);
+	struct tenstorrent_device *tt_dev = pci_get_drvdata(pdev);
 
 	ktime_t end_time = ktime_add_us(ktime_get(), timeout_us);
 
 	while (true) {
+		u32 irq_seq = tenstorrent_arc_irq_seq(tt_dev);
 		u32 read_val = ioread32(msg_reg);
 
 		if ((read_val & 0xffff) == msg_code) {
@@ -194,7 +197,7 @@ static int arc_msg_poll_completion(struct pci_dev *pdev, u8 __iomem *reset_unit_
 			return -1;
 		}
 
-		usleep_range(poll_period_us, 2 * poll_period_us);
+		tenstorrent_wait_arc_irq(tt_dev, irq_seq, poll_period_us, 2 * poll_period_us);
 	}
 }
 